@@ -4,33 +4,69 @@
 #include <iostream>
 #include <algorithm>
 
+#if ALIGNED_POOL_ENABLE_MEM_LOG
+#include "../../utils/trace.h"
+#endif//ALIGNED_POOL_ENABLE_MEM_LOG
+
+#if ALIGNED_POOL_ENABLE_LATENCY
+#include "../../utils/latency.h"
+#endif//ALIGNED_POOL_ENABLE_LATENCY
+
+#if ALIGNED_POOL_ENABLE_CHECKED
+#include "../../utils/checked.h"
+#endif//ALIGNED_POOL_ENABLE_CHECKED
+
+#if ALIGNED_POOL_ENABLE_CANARY
+#include "../../utils/canary.h"
+#include <cstddef>
+#endif//ALIGNED_POOL_ENABLE_CANARY
+
 namespace align_pool
 {
 	//-----------------------------------------------------------
 	AlignedPool::AlignedPool(size_t blockSize, size_t blockCount)
 		:	
 		m_blockSize{ blockSize },
+		m_blockStride{ getBlockStride(blockSize) },
 		m_blockCount{ blockCount },
 		m_curFreeIdx{ 0u },
 		m_data{ nullptr },
-		m_dataState{ nullptr }
+		m_dataState{ nullptr },
+		m_stats{}
 	{
 		_init();
+		m_stats.capacity = m_blockSize * m_blockCount;
+#if ALIGNED_POOL_ENABLE_MEM_LOG
+		m_traceId = pool_trace::newPoolId(pool_trace::PoolKind::ALIGNED_POOL);
+		pool_trace::record(pool_trace::EventOp::INIT, m_traceId, m_data, m_blockSize * m_blockCount);
+#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 	}
 
 	//-----------------------------------------------------------
 	AlignedPool::AlignedPool(size_t blockSize, size_t blockCount, char* ptr)
 	{
 		m_blockSize = blockSize;
+		m_blockStride = getBlockStride(blockSize);
 		m_blockCount = blockCount;
 		m_curFreeIdx = 0u;
 		m_data = ptr;
-		m_dataState = static_cast<size_t*>(static_cast<void*>(ptr + m_blockSize * m_blockCount));
+		m_dataState = static_cast<size_t*>(static_cast<void*>(ptr + m_blockStride * m_blockCount));
+		m_stats = PoolStats{};
+		m_stats.capacity = m_blockSize * m_blockCount;
+#if ALIGNED_POOL_ENABLE_MEM_LOG
+		m_traceId = pool_trace::newPoolId(pool_trace::PoolKind::ALIGNED_POOL);
+		pool_trace::record(pool_trace::EventOp::INIT, m_traceId, m_data, m_blockSize * m_blockCount);
+#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 	}
 
 	//-----------------------------------------------------------
 	AlignedPool::~AlignedPool()
 	{
+#if ALIGNED_POOL_ENABLE_CHECKED
+		//memory of the pool identifies it in the side table, as the pool itself can be moved
+		if (m_data)
+			pool_check::onReset(m_data);
+#endif//ALIGNED_POOL_ENABLE_CHECKED
 		if (m_data)
 			std::free(m_data);
 		if (m_dataState)
@@ -58,32 +94,56 @@ namespace align_pool
 		this->m_blockSize = other.m_blockSize;
 		other.m_blockSize = 0;
 
+		this->m_blockStride = other.m_blockStride;
+		other.m_blockStride = 0;
+
 		this->m_blockCount = other.m_blockCount;
 		other.m_blockCount = 0;
 
 		this->m_curFreeIdx = other.m_curFreeIdx;
 		other.m_curFreeIdx = 0;
 
+		this->m_stats = other.m_stats;
+		other.m_stats = PoolStats{};
+
+#if ALIGNED_POOL_ENABLE_MEM_LOG
+		this->m_traceId = other.m_traceId;
+#endif//ALIGNED_POOL_ENABLE_MEM_LOG
+
 		return *this;
 	}
 
 	//-----------------------------------------------------------
 	void* AlignedPool::malloc()
 	{
+#if ALIGNED_POOL_ENABLE_LATENCY
+		pool_latency::Scope latency{ pool_latency::PoolKind::ALIGNED_POOL, pool_latency::Op::MALLOC, m_blockSize };
+#endif//ALIGNED_POOL_ENABLE_LATENCY
 		void* res = nullptr; 
 		size_t idx = m_curFreeIdx;
 
 		if (idx == INVALID_ID)
 		{
 			std::cout << "\nError in " << __FUNCTION__ << " there is no available memory for allocation of that number:[" << 1u << "] of memory blocks, each with size: [" << m_blockSize << "]\n";
+			m_stats.failedAllocations++;
+#if ALIGNED_POOL_ENABLE_MEM_LOG
+			pool_trace::record(pool_trace::EventOp::FAIL, m_traceId, nullptr, m_blockSize);
+#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 		}
 		else
 		{
-			res = static_cast<char*>(m_data) + idx * m_blockSize;
+			res = static_cast<char*>(m_data) + idx * m_blockStride;
 			*(m_dataState + idx) = 1u;
 			m_curFreeIdx = _getNextFreeIdx(idx + 1u);
+			_countAllocation(m_blockSize);
+#if ALIGNED_POOL_ENABLE_CANARY
+			_fillCanary(res, 1u);
+#endif//ALIGNED_POOL_ENABLE_CANARY
+#if ALIGNED_POOL_ENABLE_CHECKED
+			pool_check::onAlloc(m_data, res, m_blockSize, POOL_CHECK_CALLER());
+#endif//ALIGNED_POOL_ENABLE_CHECKED
 #if ALIGNED_POOL_ENABLE_MEM_LOG
-			_log(idx, m_blockSize, MemHint::ALLOC);
+			pool_trace::record(pool_trace::EventOp::ALLOC, m_traceId, res, m_blockSize);
 #endif//ALIGNED_POOL_ENABLE_MEM_LOG
 		}
 		return res;
@@ -92,20 +152,34 @@ namespace align_pool
 	//-----------------------------------------------------------
 	void* AlignedPool::malloc_n(const size_t blockNum)
 	{
+#if ALIGNED_POOL_ENABLE_LATENCY
+		pool_latency::Scope latency{ pool_latency::PoolKind::ALIGNED_POOL, pool_latency::Op::MALLOC_N, m_blockSize * blockNum };
+#endif//ALIGNED_POOL_ENABLE_LATENCY
 		void* res = nullptr;
 		size_t idx = _tryMallocN(blockNum);
 
 		if (idx == INVALID_ID)
 		{
 			std::cout << "\nError in " << __FUNCTION__ << " there is no available memory for allocation of that number:[" << blockNum << "] of memory blocks, each with size: [" << m_blockSize << "]\n";
+			m_stats.failedAllocations++;
+#if ALIGNED_POOL_ENABLE_MEM_LOG
+			pool_trace::record(pool_trace::EventOp::FAIL, m_traceId, nullptr, m_blockSize * blockNum);
+#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 		}
 		else
 		{
-			res = static_cast<char*>(m_data) + idx * m_blockSize;
+			res = static_cast<char*>(m_data) + idx * m_blockStride;
 			*(m_dataState + idx) = blockNum;
 			m_curFreeIdx = _getNextFreeIdx(idx + blockNum);
+			_countAllocation(m_blockSize * blockNum);
+#if ALIGNED_POOL_ENABLE_CANARY
+			_fillCanary(res, blockNum);
+#endif//ALIGNED_POOL_ENABLE_CANARY
+#if ALIGNED_POOL_ENABLE_CHECKED
+			pool_check::onAlloc(m_data, res, m_blockSize * blockNum, POOL_CHECK_CALLER());
+#endif//ALIGNED_POOL_ENABLE_CHECKED
 #if ALIGNED_POOL_ENABLE_MEM_LOG
-			_log(idx, m_blockSize * blockNum, MemHint::ALLOC);
+			pool_trace::record(pool_trace::EventOp::ALLOC, m_traceId, res, m_blockSize * blockNum);
 #endif//ALIGNED_POOL_ENABLE_MEM_LOG
 		}
 		return res;
@@ -114,41 +188,101 @@ namespace align_pool
 	//-----------------------------------------------------------
 	void AlignedPool::free(const void* p)
 	{
+#if ALIGNED_POOL_ENABLE_LATENCY
+		pool_latency::Scope latency{ pool_latency::PoolKind::ALIGNED_POOL, pool_latency::Op::FREE, m_blockSize };
+#endif//ALIGNED_POOL_ENABLE_LATENCY
 		size_t id = _findIdx(p);
+#if ALIGNED_POOL_ENABLE_CHECKED
+		if (pool_check::onFree(m_data, p, id != INVALID_ID, POOL_CHECK_CALLER()) != pool_check::Error::NONE)
+		{
+			m_stats.failedFrees++;
+			return;
+		}
+#endif//ALIGNED_POOL_ENABLE_CHECKED
 		if (id == INVALID_ID)
 		{
 			std::cout << "\nError in " << __FUNCTION__ << " trying to free pointer:[0x" << p << "] which are not from that pool\n";
+			m_stats.failedFrees++;
+			return;
 		}
 
-#if ALIGNED_POOL_ENABLE_MEM_LOG
+		//freed block and blocks inside of a run have no state, freeing them would corrupt m_curFreeIdx
 		size_t blockNum = *(m_dataState + id);
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
+		if (blockNum == 0 || p != _getData(id))
+		{
+			std::cout << "\nError in " << __FUNCTION__ << " trying to free pointer:[0x" << p << "] which isn't allocated, it's a double free or a pointer inside of an allocation\n";
+			m_stats.failedFrees++;
+			return;
+		}
+#if ALIGNED_POOL_ENABLE_LATENCY
+		latency.setSize(m_blockSize * blockNum);
+#endif//ALIGNED_POOL_ENABLE_LATENCY
+#if ALIGNED_POOL_ENABLE_CANARY
+		_checkCanary(p, blockNum);
+#endif//ALIGNED_POOL_ENABLE_CANARY
 		*(m_dataState + id) = 0;
 		m_curFreeIdx = m_curFreeIdx < id ? m_curFreeIdx : id;
+		m_stats.frees++;
+		m_stats.bytesInUse -= m_blockSize * blockNum;
 #if ALIGNED_POOL_ENABLE_MEM_LOG
-		_log(id, m_blockSize * blockNum, MemHint::FREE);
+		pool_trace::record(pool_trace::EventOp::FREE, m_traceId, p, m_blockSize * blockNum);
 #endif//ALIGNED_POOL_ENABLE_MEM_LOG
 	}
 
 	//-----------------------------------------------------------
 	void AlignedPool::free_n(const void* p, size_t blockNumber)
 	{
+#if ALIGNED_POOL_ENABLE_LATENCY
+		pool_latency::Scope latency{ pool_latency::PoolKind::ALIGNED_POOL, pool_latency::Op::FREE_N, m_blockSize * blockNumber };
+#endif//ALIGNED_POOL_ENABLE_LATENCY
 		size_t id = _findIdx(p);
+		//wrong number of blocks of a live allocation is rejected first, so it stays live in checked mode too
+		if (id != INVALID_ID && *(m_dataState + id) != 0 && *(m_dataState + id) != blockNumber && p == _getData(id))
+		{
+			std::cout << "\nError in " << __FUNCTION__ << " trying to free [" << blockNumber << "] elements , starting at address["
+				<< p << "] while [" << *(m_dataState + id) << "] blocks are allocated there\n";
+			m_stats.failedFrees++;
+			return;
+		}
+#if ALIGNED_POOL_ENABLE_CHECKED
+		if (pool_check::onFree(m_data, p, id != INVALID_ID, POOL_CHECK_CALLER()) != pool_check::Error::NONE)
+		{
+			m_stats.failedFrees++;
+			return;
+		}
+#endif//ALIGNED_POOL_ENABLE_CHECKED
 		if (id == INVALID_ID)
 		{
 			std::cout << "\nError in " << __FUNCTION__ << " trying to free pointer:[0x" << p << "] which are not from that pool with block size[" << m_blockSize << "]\n";
+			m_stats.failedFrees++;
+			return;
 		}
 
 		if (id + blockNumber > m_blockCount)
 		{
 			std::cout << "\nError in " << __FUNCTION__ << " trying to free [" << blockNumber << "] elements , starting at address["
 				<< p << "] which correspond to id[" << id << ", and goes out of range\n";
+			m_stats.failedFrees++;
+			return;
+		}
+
+		if (*(m_dataState + id) == 0 || p != _getData(id))
+		{
+			std::cout << "\nError in " << __FUNCTION__ << " trying to free pointer:[0x" << p << "] which isn't allocated, it's a double free or a pointer inside of an allocation\n";
+			m_stats.failedFrees++;
+			return;
 		}
 
-		std::memset(m_dataState + id, 0, blockNumber);
+#if ALIGNED_POOL_ENABLE_CANARY
+		_checkCanary(p, blockNumber);
+#endif//ALIGNED_POOL_ENABLE_CANARY
+		//only the first block of the run keeps the state
+		*(m_dataState + id) = 0;
 		m_curFreeIdx = m_curFreeIdx < id ? m_curFreeIdx : id;
+		m_stats.frees++;
+		m_stats.bytesInUse -= m_blockSize * blockNumber;
 #if ALIGNED_POOL_ENABLE_MEM_LOG
-		_log(id, m_blockSize * blockNumber, MemHint::FREE);
+		pool_trace::record(pool_trace::EventOp::FREE, m_traceId, p, m_blockSize * blockNumber);
 #endif//ALIGNED_POOL_ENABLE_MEM_LOG
 	}
 
@@ -160,7 +294,7 @@ namespace align_pool
 			return;
 		}
 
-		m_data = std::malloc(m_blockSize * m_blockCount);
+		m_data = std::malloc(m_blockStride * m_blockCount);
 		m_dataState = static_cast<size_t*>(std::malloc(m_blockCount * sizeof(size_t)));
 
 		if (m_dataState)
@@ -173,10 +307,37 @@ namespace align_pool
 	inline void* AlignedPool::_getData(const size_t idx) const
 	{
 		if (idx < m_blockCount)
-			return static_cast<char*>(m_data) + idx * m_blockSize;
+			return static_cast<char*>(m_data) + idx * m_blockStride;
 		return nullptr;
 	}
 
+	//-----------------------------------------------------------
+	size_t AlignedPool::getBlockStride(const size_t blockSize)
+	{
+#if ALIGNED_POOL_ENABLE_CANARY
+		//stride stays a multiple of blockSize, as long as blockSize is below the alignment of malloc
+		const size_t align = blockSize < alignof(std::max_align_t) ? blockSize : alignof(std::max_align_t);
+		return (blockSize + ALIGNED_POOL_CANARY_SIZE + align - 1u) / align * align;
+#else
+		return blockSize;
+#endif//ALIGNED_POOL_ENABLE_CANARY
+	}
+
+#if ALIGNED_POOL_ENABLE_CANARY
+	//-----------------------------------------------------------
+	void AlignedPool::_fillCanary(void* p, const size_t blockNum)
+	{
+		//run of blocks is contiguous for the user, so canaries of all its blocks are at its end
+		pool_canary::fill(static_cast<char*>(p) + m_blockSize * blockNum, (m_blockStride - m_blockSize) * blockNum);
+	}
+
+	//-----------------------------------------------------------
+	void AlignedPool::_checkCanary(const void* p, const size_t blockNum) const
+	{
+		pool_canary::check("AlignedPool", p, static_cast<const char*>(p) + m_blockSize * blockNum, (m_blockStride - m_blockSize) * blockNum);
+	}
+#endif//ALIGNED_POOL_ENABLE_CANARY
+
 	//-----------------------------------------------------------
 	size_t AlignedPool::_getNextFreeIdx(const size_t _idx) const
 	{
@@ -196,15 +357,25 @@ namespace align_pool
 	size_t AlignedPool::_tryMallocN(size_t n) const
 	{
 		size_t idx = m_curFreeIdx;
-		size_t _n = 1;
+		if (idx == INVALID_ID || n == 0)
+		{
+			return INVALID_ID;
+		}
+
+		//every block of the run is checked, including the first one after a skipped allocation
+		size_t _n = 0;
 		while (_n < n && idx + n <= m_blockCount)
 		{
-			if (*(m_dataState + _n + idx) != 0)
+			const size_t state = *(m_dataState + _n + idx);
+			if (state != 0)
+			{
+				idx += _n + state;
+				_n = 0;
+			}
+			else
 			{
-				idx += _n + *(m_dataState + _n + idx);
-				_n = 1;
+				_n++;
 			}
-			_n++;
 		}
 
 		if (_n == n)
@@ -216,61 +387,47 @@ namespace align_pool
 	}
 
 	//-----------------------------------------------------------
-	size_t AlignedPool::_findIdx(const void* p) const
+	size_t AlignedPool::getLargestFreeRun() const
 	{
-		size_t res = INVALID_ID;
-		if (p >= m_data &&
-			p < static_cast<char*>(m_data) + m_blockCount * m_blockSize)
+		size_t res = 0;
+		size_t run = 0;
+		size_t idx = 0;
+		while (idx < m_blockCount)
 		{
-			res = (static_cast<const char*>(p) - static_cast<char*>(m_data)) / m_blockSize;
+			const size_t state = *(m_dataState + idx);
+			if (state == 0)
+			{
+				run++;
+				idx++;
+				res = run > res ? run : res;
+			}
+			else
+			{
+				run = 0;
+				idx += state;
+			}
 		}
 		return res;
 	}
 
-#if ALIGNED_POOL_ENABLE_MEM_LOG
 	//-----------------------------------------------------------
-	void AlignedPool::_log(int blockId, size_t memory, MemHint hint) const
+	size_t AlignedPool::_findIdx(const void* p) const
 	{
-		std::cout << "#--------------------------------------------------------------------#\n";
-		if (hint == MemHint::ALLOC)
-		{
-			std::cout << "At memory location:[0x" << _getData(blockId) << "] allocated " << memory << " bytes of memory\n";
-		}
-		else if (hint == MemHint::FREE)
-		{
-			std::cout << "At memory location:[0x" << _getData(blockId) << "] freed " << memory << " bytes of memory\n";
-		}
-		std::cout << "Block index:[" << blockId << "]\n";
-
-		size_t curSize = 0;
-		
-		for (size_t i = 0, idx = 0; i < m_blockCount;)
+		size_t res = INVALID_ID;
+		if (p >= m_data &&
+			p < static_cast<char*>(m_data) + m_blockCount * m_blockStride)
 		{
-			idx = *(m_dataState + i);
-			if (idx != 0)
-			{
-				curSize += idx;
-				i += idx;
-			}
-			else
-			{
-				i++;
-			}
+			res = (static_cast<const char*>(p) - static_cast<char*>(m_data)) / m_blockStride;
 		}
-		std::cout << "Current occupied blocks:[" << curSize << "]\n";
-		std::cout << "Current free ID :[" << m_curFreeIdx << "]\n";
-		std::cout << "Max block count:[" << m_blockCount << "]\n";
-		std::cout << "Percent of free blocks:[" << 100.0f * (1.0f - (static_cast<float>(curSize) / m_blockCount))<< "%]\n";
-		std::cout << "#--------------------------------------------------------------------#\n\n";
+		return res;
 	}
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 
 #if APM_ENABLE_CACHING
 	//-----------------------------------------------------------
 	inline void AlignedPool::_fillRange(void*& b, void*& e) const
 	{
 		b = this->m_data;
-		e = static_cast<char*>(this->m_data) + m_blockCount * m_blockSize;
+		e = static_cast<char*>(this->m_data) + m_blockCount * m_blockStride;
 	}
 #endif //APM_ENABLE_CACHING
 	
@@ -298,6 +455,10 @@ namespace align_pool
 	//-----------------------------------------------------------
 	AlignedPoolManager::AlignedPoolManager()
 		: m_data{ nullptr }
+		, m_mallocCacheHits{ 0u }
+		, m_mallocCacheMisses{ 0u }
+		, m_freeCacheHits{ 0u }
+		, m_freeCacheMisses{ 0u }
 	{
 	}
 
@@ -324,6 +485,11 @@ namespace align_pool
 		{
 			this->m_pools[i] = std::move(other.m_pools[i]);
 		}
+
+		this->m_mallocCacheHits = other.m_mallocCacheHits;
+		this->m_mallocCacheMisses = other.m_mallocCacheMisses;
+		this->m_freeCacheHits = other.m_freeCacheHits;
+		this->m_freeCacheMisses = other.m_freeCacheMisses;
 		return *this;
 	}
 
@@ -344,7 +510,7 @@ namespace align_pool
 			if (m_pools[i].blockSize != 0)
 			{
 				//size of data + size of data states + size of AlignedePool itself
-				totalSize += (m_pools[i].blockSize + sizeof(size_t)) * m_pools[i].blockNumber + s_poolSize;
+				totalSize += (AlignedPool::getBlockStride(m_pools[i].blockSize) + sizeof(size_t)) * m_pools[i].blockNumber + s_poolSize;
 			}
 		}
 
@@ -370,14 +536,7 @@ namespace align_pool
 				offset += s_poolSize;
 
 				new (m_pools[i].pool) AlignedPool(m_pools[i].blockSize, m_pools[i].blockNumber, m_data + offset);
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-				std::cout << "Pool successfuly created in address [" << m_pools[i].pool << "]\n";
-				std::cout << "Pool successfuly initialized with parameters blockSize[" << m_pools[i].blockSize << "]\t"
-					<< "blockNumber[" << m_pools[i].blockNumber << "]\n"
-					<< "address of the data  is[" << static_cast<void*>(m_data + offset) << "]\n"
-					<< "address of the data states is[" << static_cast<void*>(m_data + offset + m_pools[i].blockSize * m_pools[i].blockNumber) << "]\n\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
-				offset += (m_pools[i].blockSize + sizeof(size_t)) * m_pools[i].blockNumber;
+				offset += (AlignedPool::getBlockStride(m_pools[i].blockSize) + sizeof(size_t)) * m_pools[i].blockNumber;
 			}
 		}
 
@@ -423,19 +582,13 @@ namespace align_pool
 		{
 			m_cacheMalloc.hits = 0u; 
 			m_cacheMalloc.id = ~0u;
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-			std::cout << "malloc(): cache miss of the object size[" << size << "], hit count[" << m_cacheMalloc.hits << "]\n";
-			std::cout << "size in cache[" << m_cacheMalloc.size << "]\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 		}
 		else if (m_cacheMalloc.hits > APM_HIT_COUNT_TO_BE_CACHED)
 		{
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-			std::cout << "malloc(): cache hit of the object size[" << size << "]\n";
-			std::cout << "memory is allocated from pool[" << m_pools[m_cacheMalloc.id].pool << "], with blockSize[" << m_pools[m_cacheMalloc.id].blockSize <<"]\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
+			m_mallocCacheHits++;
 			return m_pools[m_cacheMalloc.id].pool->malloc();
 		}
+		m_mallocCacheMisses++;
 #endif//APM_ENABLE_CACHING
 		for (int i = 0; i < APM_POOL_NUMBER; i++)
 		{
@@ -446,10 +599,6 @@ namespace align_pool
 				m_cacheMalloc.id = i;
 				m_cacheMalloc.size = size;
 #endif//APM_ENABLE_CACHING
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-				std::cout << "malloc(): allocate object with size[" << size << "]\n";
-				std::cout << "memory is allocated from pool[" << m_pools[m_cacheMalloc.id].pool << "], with blockSize[" << m_pools[m_cacheMalloc.id].blockSize << "]\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 				return m_pools[i].pool->malloc();
 			}
 		}
@@ -465,19 +614,13 @@ namespace align_pool
 		{
 			m_cacheMalloc.hits = 0u;
 			m_cacheMalloc.id = ~0u;
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-			std::cout << "malloc_n(): cache miss of the object size[" << size << "]\n";
-			std::cout << "size in cache[" << m_cacheMalloc.size << "]\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 		}
 		else if (m_cacheMalloc.hits > APM_HIT_COUNT_TO_BE_CACHED)
 		{
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-			std::cout << "malloc_n(): cache hit of the object size[" << size << "], hit count[" << m_cacheMalloc.hits << "]\n";
-			std::cout << "memory is allocated from pool[" << m_pools[m_cacheMalloc.id].pool << "], with blockSize[" << m_pools[m_cacheMalloc.id].blockSize << "]\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
+			m_mallocCacheHits++;
 			return m_pools[m_cacheMalloc.id].pool->malloc_n(blockNumber);
 		}
+		m_mallocCacheMisses++;
 #endif//APM_ENABLE_CACHING
 		for (int i = 0; i < APM_POOL_NUMBER; i++)
 		{
@@ -488,10 +631,6 @@ namespace align_pool
 				m_cacheMalloc.id = i;
 				m_cacheMalloc.size = size;
 #endif//APM_ENABLE_CACHING
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-				std::cout << "malloc_n(): allocate object with size[" << size << "]\n";
-				std::cout << "memory is allocated from pool[" << m_pools[m_cacheMalloc.id].pool << "], with blockSize[" << m_pools[m_cacheMalloc.id].blockSize << "]\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 				return m_pools[i].pool->malloc_n(blockNumber);
 			}
 		}
@@ -507,21 +646,14 @@ namespace align_pool
 		{
 			m_cacheFree.hits = 0u;
 			m_cacheFree.id = ~0u;
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-			std::cout << "free(): cache miss of the object with address[" << ptr << "] in range[" << m_cacheFree.begin << ", " << m_cacheFree.end << ")\n";
-			std::cout << "size in cache[" << m_cacheFree.size << "]\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 		}
 		else if (m_cacheFree.hits >= APM_HIT_COUNT_TO_BE_CACHED)
 		{
+			m_freeCacheHits++;
 			m_pools[m_cacheFree.id].pool->free(ptr);
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-			std::cout << "free(): cache hit of the object with address[" << ptr << "] in range[" << m_cacheFree.begin << ", " << m_cacheFree.end << ")\n";
-			std::cout << "size in cache[" << m_cacheFree.size << "], hit count[" << m_cacheFree.hits << "\n";
-			std::cout << "pool[" << m_pools[m_cacheFree.id].pool << "], with block size[" << m_pools[m_cacheFree.id].blockSize << "\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 			return;
 		}
+		m_freeCacheMisses++;
 #endif//APM_ENABLE_CACHING
 		for (int i = 0; i < APM_POOL_NUMBER; i++)
 		{
@@ -534,11 +666,6 @@ namespace align_pool
 				if (m_cacheFree.hits == 1u)
 					m_pools[i].pool->_fillRange(m_cacheFree.begin, m_cacheFree.end);
 #endif//APM_ENABLE_CACHING
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-				std::cout << "free(): memory address[" << ptr << "] freed from pool within  range[" << m_cacheFree.begin << ", " << m_cacheFree.end << ")\n";
-				std::cout << "size in cache[" << m_cacheFree.size << "]\n";
-				std::cout << "pool[" << m_pools[m_cacheFree.id].pool << "], with block size[" << m_pools[m_cacheFree.id].pool->m_blockSize << "\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 				return;
 			}
 		}
@@ -553,21 +680,14 @@ namespace align_pool
 		{
 			m_cacheFree.hits = 0u;
 			m_cacheFree.id = ~0u;
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-			std::cout << "free(): cache miss of the object with address[" << ptr << "] in range[" << m_cacheFree.begin << ", " << m_cacheFree.end << ")\n";
-			std::cout << "size in cache[" << m_cacheFree.size << "]\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 		}
 		else if (m_cacheFree.hits >= APM_HIT_COUNT_TO_BE_CACHED)
 		{
+			m_freeCacheHits++;
 			m_pools[m_cacheFree.id].pool->free_n(ptr, blockNumber);
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-			std::cout << "free(): cache hit of the object with address[" << ptr << "] in range[" << m_cacheFree.begin << ", " << m_cacheFree.end << ")\n";
-			std::cout << "size in cache[" << m_cacheFree.size << "], hit count[" << m_cacheFree.hits << "\n";
-			std::cout << "pool[" << m_pools[m_cacheFree.id].pool << "], with block size[" << m_pools[m_cacheFree.id].blockSize << "\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 			return;
 		}
+		m_freeCacheMisses++;
 #endif//APM_ENABLE_CACHING
 		for (int i = 0; i < APM_POOL_NUMBER; i++)
 		{
@@ -580,17 +700,52 @@ namespace align_pool
 				if (m_cacheFree.hits == 1u)
 					m_pools[i].pool->_fillRange(m_cacheFree.begin, m_cacheFree.end);
 #endif//APM_ENABLE_CACHING
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-				std::cout << "free(): memory address[" << ptr << "] freed from pool within  range[" << m_cacheFree.begin << ", " << m_cacheFree.end << ")\n";
-				std::cout << "size in cache[" << m_cacheFree.size << "]\n";
-				std::cout << "pool[" << m_pools[m_cacheFree.id].pool << "], with block size[" << m_pools[m_cacheFree.id].pool->m_blockSize << "\n";
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 				return;
 			}
 		}
 		std::cout << "Object with address[" << ptr << "] doesn't reside in any pool\n";
 	}
 
+	//-----------------------------------------------------------
+	AlignedPoolManager::Stats AlignedPoolManager::stats() const
+	{
+		Stats res{};
+		for (int i = 0; i < APM_POOL_NUMBER; i++)
+		{
+			if (!m_pools[i].pool)
+				continue;
+
+			const PoolStats pool = m_pools[i].pool->stats();
+			res.pools.allocations += pool.allocations;
+			res.pools.frees += pool.frees;
+			res.pools.failedAllocations += pool.failedAllocations;
+			res.pools.failedFrees += pool.failedFrees;
+			res.pools.bytesInUse += pool.bytesInUse;
+			res.pools.peakBytesInUse += pool.peakBytesInUse;
+			res.pools.capacity += pool.capacity;
+		}
+		res.mallocCacheHits = m_mallocCacheHits;
+		res.mallocCacheMisses = m_mallocCacheMisses;
+		res.freeCacheHits = m_freeCacheHits;
+		res.freeCacheMisses = m_freeCacheMisses;
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	size_t AlignedPoolManager::largestFreeBlock() const
+	{
+		size_t res = 0;
+		for (int i = 0; i < APM_POOL_NUMBER; i++)
+		{
+			if (!m_pools[i].pool)
+				continue;
+
+			const size_t bytes = m_pools[i].pool->getLargestFreeRun() * m_pools[i].blockSize;
+			res = bytes > res ? bytes : res;
+		}
+		return res;
+	}
+
 	//-----------------------------------------------------------
 	AlignedPoolManager g_poolManager;
 
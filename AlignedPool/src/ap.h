@@ -1,12 +1,36 @@
 #ifndef ALIGNED_POOL_SRC_AP
 #define ALIGNED_POOL_SRC_AP
 
+//allocations and frees are recorded into the trace ring of the thread(utils/trace.h)
 #if defined(NDEBUG) || defined(DISABLE_LOG)
 #define ALIGNED_POOL_ENABLE_MEM_LOG 0
 #else
 #define ALIGNED_POOL_ENABLE_MEM_LOG  1
 #endif
 
+//latency of every malloc, malloc_n, free and free_n is recorded into histograms(utils/latency.h)
+#ifndef ALIGNED_POOL_ENABLE_LATENCY
+#define ALIGNED_POOL_ENABLE_LATENCY 0
+#endif
+
+//every allocation is tracked in the side table, double frees and foreign frees are rejected, leaks are reported(utils/checked.h)
+#ifndef ALIGNED_POOL_ENABLE_CHECKED
+#define ALIGNED_POOL_ENABLE_CHECKED 0
+#endif
+
+/*
+every block is followed by canary bytes, which are checked when the block is freed, so an overrun into
+the neighbour block is reported(utils/canary.h). Blocks keep the alignment of blockSize up to the alignment of malloc
+*/
+#ifndef ALIGNED_POOL_ENABLE_CANARY
+#define ALIGNED_POOL_ENABLE_CANARY 0
+#endif
+
+//minimal number of canary bytes after every block, run of blocks of malloc_n has the canary of all its blocks at its end
+#ifndef ALIGNED_POOL_CANARY_SIZE
+#define ALIGNED_POOL_CANARY_SIZE 16
+#endif
+
 #define APM_POOL_NUMBER 16
 #define APM_HIT_COUNT_TO_BE_CACHED 3
 #define APM_ENABLE_CACHING 1
@@ -16,6 +40,19 @@ namespace align_pool
 #if APM_ENABLE_CACHING
 	class AlignedPoolManager;
 #endif//APM_ENABLE_CACHING
+
+	//counters are kept in release builds too, bytes are counted in whole blocks
+	struct PoolStats
+	{
+		size_t			allocations;
+		size_t			frees;
+		size_t			failedAllocations;
+		//double frees, frees of foreign pointers, which were rejected
+		size_t			failedFrees;
+		size_t			bytesInUse;
+		size_t			peakBytesInUse;
+		size_t			capacity;
+	};
 	
 	struct AlignedPool
 	{
@@ -40,10 +77,16 @@ namespace align_pool
 		void*			malloc_n(const size_t blockNumber);
 		void			free(const void* ptr);
 		void			free_n(const void* ptr, size_t blockNumber);
+
+		PoolStats		stats() const { return m_stats; }
+		//longest run of free blocks, which malloc_n can take, O(blockCount)
+		size_t			getLargestFreeRun() const;
+		//distance in bytes between blocks of blockSize, it's larger than blockSize in canary mode
+		static size_t	getBlockStride(const size_t blockSize);
 		
 		inline bool		isFrom(const void* const ptr) const
 														{
-															return ptr >= m_data && ptr < static_cast<char*>(m_data) + m_blockSize * m_blockCount;
+															return ptr >= m_data && ptr < static_cast<char*>(m_data) + m_blockStride * m_blockCount;
 														}
 	private:
 		void			_init();
@@ -51,17 +94,17 @@ namespace align_pool
 		size_t			_getNextFreeIdx(const size_t)	const;
 		size_t			_tryMallocN(size_t n)			const;
 		size_t			_findIdx(const void* p)			const;
+		inline void		_countAllocation(const size_t bytes)
+														{
+															m_stats.allocations++;
+															m_stats.bytesInUse += bytes;
+															m_stats.peakBytesInUse = m_stats.peakBytesInUse > m_stats.bytesInUse ? m_stats.peakBytesInUse : m_stats.bytesInUse;
+														}
+#if ALIGNED_POOL_ENABLE_CANARY
+		void			_fillCanary(void* p, const size_t blockNum);
+		void			_checkCanary(const void* p, const size_t blockNum) const;
+#endif//ALIGNED_POOL_ENABLE_CANARY
 
-#if ALIGNED_POOL_ENABLE_MEM_LOG
-	private:
-		enum class MemHint
-		{
-			INFO = 0,
-			ALLOC = 1 << INFO,
-			FREE = 1 << ALLOC,
-		};
-		void			_log(int blockId, size_t memory, MemHint hint) const;
-#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 
 #if APM_ENABLE_CACHING
 		
@@ -73,7 +116,13 @@ namespace align_pool
 		size_t*			m_dataState;
 		size_t			m_curFreeIdx;
 		size_t			m_blockSize;
+		size_t			m_blockStride;
 		size_t			m_blockCount;
+		PoolStats		m_stats;
+#if ALIGNED_POOL_ENABLE_MEM_LOG
+		//id of the pool in trace events
+		unsigned int	m_traceId;
+#endif//ALIGNED_POOL_ENABLE_MEM_LOG
 
 	private:
 		static constexpr size_t INVALID_ID = ~0u;
@@ -107,6 +156,19 @@ namespace align_pool
 		
 		void	free(const void* ptr);
 		void	free_n(const void* ptr, size_t blockNumber);
+
+		struct Stats
+		{
+			//sum of counters of all pools, peak is the sum of peaks of the pools
+			PoolStats	pools;
+			size_t		mallocCacheHits;
+			size_t		mallocCacheMisses;
+			size_t		freeCacheHits;
+			size_t		freeCacheMisses;
+		};
+		Stats	stats() const;
+		//size in bytes of the longest run of free blocks among pools, O(blocks of all pools)
+		size_t	largestFreeBlock() const;
 	private:
 		struct PoolInfo
 		{
@@ -138,6 +200,11 @@ namespace align_pool
 		Cache				m_cacheMalloc;
 		Cache				m_cacheFree;
 #endif//APM_ENABLE_CACHING
+		//hits and misses of caches, stay zero when caching is disabled
+		size_t				m_mallocCacheHits;
+		size_t				m_mallocCacheMisses;
+		size_t				m_freeCacheHits;
+		size_t				m_freeCacheMisses;
 	private:
 		char*				m_data;
 		PoolInfo			m_pools[APM_POOL_NUMBER];
@@ -0,0 +1,516 @@
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include "ConcurrentHeapStorage.h"
+
+namespace hbp
+{
+	namespace
+	{
+		//reader slot of the thread in EpochManager, released when the thread exits
+		struct ReaderSlot
+		{
+			Size				idx = s_invalidId;
+			Size				depth = 0u;
+			std::atomic<bool>*	owned = nullptr;
+
+			~ReaderSlot()
+			{
+				if (owned)
+					owned->store(false, std::memory_order_release);
+			}
+		};
+
+		thread_local ReaderSlot t_readerSlot;
+
+		//threads are spread over arenas in the order they allocate first time
+		std::atomic<Size> g_nextThreadIdx{ 0u };
+		thread_local Size t_threadIdx = s_invalidId;
+	}
+
+	//index of the reader shared by threads which didn't get own one
+	constexpr static Size s_sharedReaderIdx = s_maxEpochReaders;
+
+	static EpochManager g_epochManager{};
+	static ConcurrentHeapStorage g_concurrentHeapStorage{};
+
+	//-----------------------------------------------------------
+	EpochManager& GetEpochManager()
+	{
+		return g_epochManager;
+	}
+
+	//-----------------------------------------------------------
+	ConcurrentHeapStorage& GetConcurrentHeapStorage()
+	{
+		return g_concurrentHeapStorage;
+	}
+
+	//-----------------------------------------------------------
+	EpochManager::EpochManager()
+		: m_sharedReadersNumber{ 0u }
+		, m_epoch{ 1u }
+		, m_exclusive{ false }
+	{
+		for (Reader& reader : m_readers) {
+			reader.epoch.store(0u, std::memory_order_relaxed);
+			reader.owned.store(false, std::memory_order_relaxed);
+		}
+	}
+
+	//-----------------------------------------------------------
+	void EpochManager::enter()
+	{
+		if (t_readerSlot.depth++)
+			return;
+
+		if (_readerIdx() == s_sharedReaderIdx) {
+			//objects are being overwritten, wait outside of the epoch
+			while (!_enterShared()) {
+				while (m_exclusive.load())
+					std::this_thread::yield();
+			}
+			return;
+		}
+
+		Reader& reader = m_readers[t_readerSlot.idx];
+		while (true) {
+			reader.epoch.store(m_epoch.load());
+			if (!m_exclusive.load())
+				break;
+
+			//objects are being overwritten, wait outside of the epoch
+			reader.epoch.store(0u);
+			while (m_exclusive.load())
+				std::this_thread::yield();
+		}
+	}
+
+	//-----------------------------------------------------------
+	void EpochManager::leave()
+	{
+		if (--t_readerSlot.depth)
+			return;
+
+		if (t_readerSlot.idx == s_sharedReaderIdx)
+			_leaveShared();
+		else
+			m_readers[t_readerSlot.idx].epoch.store(0u, std::memory_order_release);
+	}
+
+	//-----------------------------------------------------------
+	UInt EpochManager::advance()
+	{
+		return m_epoch.fetch_add(1u);
+	}
+
+	//-----------------------------------------------------------
+	bool EpochManager::isSafe(CUInt epoch) const
+	{
+		for (const Reader& reader : m_readers) {
+			CUInt readerEpoch = reader.epoch.load();
+			if (readerEpoch && readerEpoch <= epoch)
+				return false;
+		}
+		return true;
+	}
+
+	//-----------------------------------------------------------
+	void EpochManager::lockExclusive()
+	{
+		m_exclusiveLock.lock();
+		m_exclusive.store(true);
+
+		//current thread can be a reader itself
+		CSize self = t_readerSlot.depth ? t_readerSlot.idx : s_invalidId;
+		for (Size i = 0; i < s_maxEpochReaders; i++) {
+			while (i != self && m_readers[i].epoch.load())
+				std::this_thread::yield();
+		}
+		CSize selfShared = self == s_sharedReaderIdx ? 1u : 0u;
+		while (m_sharedReadersNumber.load() > selfShared)
+			std::this_thread::yield();
+	}
+
+	//-----------------------------------------------------------
+	void EpochManager::unlockExclusive()
+	{
+		m_exclusive.store(false);
+		m_exclusiveLock.unlock();
+	}
+
+	//-----------------------------------------------------------
+	Size EpochManager::_readerIdx()
+	{
+		if (t_readerSlot.idx != s_invalidId)
+			return t_readerSlot.idx;
+
+		for (Size i = 0; i < s_maxEpochReaders; i++) {
+			bool owned = false;
+			if (m_readers[i].owned.compare_exchange_strong(owned, true)) {
+				t_readerSlot.idx = i;
+				t_readerSlot.owned = &m_readers[i].owned;
+				return i;
+			}
+		}
+
+		//all slots are taken, the thread uses the shared one till it exits
+		static std::atomic<bool> s_reported{ false };
+		if (!s_reported.exchange(true))
+			printf_s("More than [%zu] threads read handles, the rest share one epoch reader!\n", s_maxEpochReaders);
+		t_readerSlot.idx = s_sharedReaderIdx;
+		return s_sharedReaderIdx;
+	}
+
+	//-----------------------------------------------------------
+	bool EpochManager::_enterShared()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_sharedLock };
+			if (!m_sharedReadersNumber.fetch_add(1u))
+				m_readers[s_sharedReaderIdx].epoch.store(m_epoch.load());
+		}
+		if (!m_exclusive.load())
+			return true;
+
+		_leaveShared();
+		return false;
+	}
+
+	//-----------------------------------------------------------
+	void EpochManager::_leaveShared()
+	{
+		std::lock_guard<std::mutex> lock{ m_sharedLock };
+		if (m_sharedReadersNumber.fetch_sub(1u) == 1u)
+			m_readers[s_sharedReaderIdx].epoch.store(0u, std::memory_order_release);
+	}
+
+	//-----------------------------------------------------------
+	ConcurrentHeapStorage::ConcurrentHeapStorage()
+		: m_arenasNumber{ 0u }
+		, m_nextDefragArena{ 0u }
+		, m_compactorSkips{ 0u }
+		, m_compactorRunning{ false }
+		, m_compactorTrigger{ 1.0f, 0u, 0u }
+		, m_compactorBudget{ 0u }
+		, m_compactorPeriodUs{ 0u }
+	{
+	}
+
+	//-----------------------------------------------------------
+	ConcurrentHeapStorage::~ConcurrentHeapStorage()
+	{
+		/*
+		arenas free their regions themselves, cleanAll isn't called because
+		handles of slab pages live in AlignedPoolManager, which can be destroyed first at exit
+		*/
+		stopCompactor();
+	}
+
+	//-----------------------------------------------------------
+	void ConcurrentHeapStorage::init(CSize size, CSize arenasNumber /*0*/)
+	{
+		if (m_arenas) {
+			printf_s("ConcurrentHeapStorage is already initialized!\n");
+			return;
+		}
+
+		m_arenasNumber = arenasNumber ? arenasNumber : std::max(1u, std::thread::hardware_concurrency());
+		m_arenas.reset(new Arena[m_arenasNumber]);
+		for (Size i = 0; i < m_arenasNumber; i++) {
+			m_arenas[i].heap.init(size);
+			m_arenas[i].heap.setDeferredFree(true);
+		}
+	}
+
+	//-----------------------------------------------------------
+	void* ConcurrentHeapStorage::malloc(CSize size)
+	{
+		Arena* arena = _getArena();
+		if (!arena) {
+			printf_s("ConcurrentHeapStorage isn't initialized!\n");
+			return nullptr;
+		}
+
+		std::unique_lock<std::mutex> lock = _lockArena(*arena);
+		if (!arena->retired.empty())
+			_reclaim(*arena);
+		return arena->heap.malloc(size);
+	}
+
+	//-----------------------------------------------------------
+	void ConcurrentHeapStorage::free(void* ptr)
+	{
+		if (!ptr)
+			return;
+
+		Arena* arena = _findArena(ptr);
+		if (!arena) {
+			printf_s("Memory address[%p] doesn't belong to ConcurrentHeapStorage!\n", ptr);
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock = _lockArena(*arena);
+		if (arena != _ownArena())
+			arena->contention.remoteFrees++;
+		arena->heap.free(ptr);
+	}
+
+	//-----------------------------------------------------------
+	void ConcurrentHeapStorage::destroy(IHandle* handle, CSize handlesNumber /*1*/)
+	{
+		if (!handle)
+			return;
+
+		void* ptr = helpers::hPtr(static_cast<Handle<void>*>(handle));
+		Arena* arena = ptr ? _findArena(ptr) : nullptr;
+		if (!arena) {
+			helpers::destroyHandle(handle, handlesNumber);
+			return;
+		}
+
+		//object can only move inside of its arena, so after the lock handle points to its final place
+		std::unique_lock<std::mutex> lock = _lockArena(*arena);
+		if (arena != _ownArena())
+			arena->contention.remoteFrees++;
+		arena->heap.free(helpers::destroyHandle(handle, handlesNumber));
+	}
+
+	//-----------------------------------------------------------
+	DefragReport ConcurrentHeapStorage::defragmentStep(CSize byteBudget, CSize timeBudgetUs /*0*/)
+	{
+		if (!m_arenas)
+			return DefragReport{ 0u, 0u, 0.0f, 0.0f, true };
+
+		Arena& arena = m_arenas[m_nextDefragArena.fetch_add(1u) % m_arenasNumber];
+		std::lock_guard<std::mutex> lock{ arena.lock };
+		return _defragmentArena(arena, byteBudget, timeBudgetUs);
+	}
+
+	//-----------------------------------------------------------
+	DefragReport ConcurrentHeapStorage::compact()
+	{
+		DefragReport report{ 0u, 0u, 0.0f, 0.0f, true };
+		if (!m_arenas)
+			return report;
+
+		GetEpochManager().lockExclusive();
+		for (Size i = 0; i < m_arenasNumber; i++) {
+			Arena& arena = m_arenas[i];
+			std::lock_guard<std::mutex> lock{ arena.lock };
+
+			arena.retired.clear();
+			DefragReport r = arena.heap.compact();
+			report.bytesMoved += r.bytesMoved;
+			report.objectsMoved += r.objectsMoved;
+			report.fragmentationBefore = std::max(report.fragmentationBefore, r.fragmentationBefore);
+			report.fragmentationAfter = std::max(report.fragmentationAfter, r.fragmentationAfter);
+		}
+		GetEpochManager().unlockExclusive();
+
+		return report;
+	}
+
+	//-----------------------------------------------------------
+	void ConcurrentHeapStorage::reclaim()
+	{
+		for (Size i = 0; i < m_arenasNumber; i++) {
+			std::lock_guard<std::mutex> lock{ m_arenas[i].lock };
+			_reclaim(m_arenas[i]);
+		}
+	}
+
+	//-----------------------------------------------------------
+	void ConcurrentHeapStorage::startCompactor(const DefragTrigger& trigger, CSize byteBudget /*16kb*/, CSize periodUs /*1000*/)
+	{
+		std::lock_guard<std::mutex> lock{ m_compactorLock };
+		if (m_compactorRunning) {
+			printf_s("Compactor is already running!\n");
+			return;
+		}
+
+		m_compactorTrigger = trigger;
+		m_compactorBudget = byteBudget;
+		m_compactorPeriodUs = periodUs;
+		m_compactorRunning = true;
+		m_compactor = std::thread{ &ConcurrentHeapStorage::_compactorLoop, this };
+	}
+
+	//-----------------------------------------------------------
+	void ConcurrentHeapStorage::stopCompactor()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_compactorLock };
+			m_compactorRunning = false;
+		}
+		m_compactorCv.notify_all();
+
+		if (m_compactor.joinable())
+			m_compactor.join();
+	}
+
+	//-----------------------------------------------------------
+	void ConcurrentHeapStorage::cleanAll()
+	{
+		stopCompactor();
+		for (Size i = 0; i < m_arenasNumber; i++) {
+			std::lock_guard<std::mutex> lock{ m_arenas[i].lock };
+			m_arenas[i].retired.clear();
+			m_arenas[i].heap.cleanAll();
+		}
+		m_arenas.reset();
+		m_arenasNumber = 0u;
+		m_compactorSkips.store(0u, std::memory_order_relaxed);
+	}
+
+	//-----------------------------------------------------------
+	HeapStats ConcurrentHeapStorage::stats()
+	{
+		HeapStats res{};
+		for (Size i = 0; i < m_arenasNumber; i++) {
+			HeapStats arena{};
+			{
+				std::lock_guard<std::mutex> lock{ m_arenas[i].lock };
+				arena = m_arenas[i].heap.stats();
+			}
+			res.allocations += arena.allocations;
+			res.frees += arena.frees;
+			res.failedAllocations += arena.failedAllocations;
+			res.bytesInUse += arena.bytesInUse;
+			res.peakBytesInUse += arena.peakBytesInUse;
+			res.heapUsed += arena.heapUsed;
+			res.heapSize += arena.heapSize;
+			res.reinits += arena.reinits;
+			res.defragSteps += arena.defragSteps;
+			res.compactions += arena.compactions;
+			res.objectsMoved += arena.objectsMoved;
+			res.bytesMoved += arena.bytesMoved;
+		}
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	ContentionStats ConcurrentHeapStorage::contention()
+	{
+		ContentionStats res{};
+		for (Size i = 0; i < m_arenasNumber; i++) {
+			std::lock_guard<std::mutex> lock{ m_arenas[i].lock };
+			const ContentionStats& arena = m_arenas[i].contention;
+			res.locks += arena.locks;
+			res.contendedLocks += arena.contendedLocks;
+			res.remoteFrees += arena.remoteFrees;
+		}
+		res.compactorSkips = m_compactorSkips.load(std::memory_order_relaxed);
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	DefragReport ConcurrentHeapStorage::_defragmentArena(Arena& arena, CSize byteBudget, CSize timeBudgetUs)
+	{
+		CSize retired = arena.heap.retiredNumber();
+		DefragReport report = arena.heap.defragmentStep(byteBudget, timeBudgetUs);
+
+		//handles already point to new places, readers which still see old ones entered before the advance
+		if (arena.heap.retiredNumber() != retired)
+			arena.retired.push_back(Arena::Retired{ GetEpochManager().advance(), arena.heap.retiredNumber() - retired });
+
+		_reclaim(arena);
+		return report;
+	}
+
+	//-----------------------------------------------------------
+	void ConcurrentHeapStorage::_compactorLoop()
+	{
+		std::unique_lock<std::mutex> wait{ m_compactorLock };
+		while (m_compactorRunning) {
+			wait.unlock();
+
+			for (Size i = 0; i < m_arenasNumber; i++) {
+				Arena& arena = m_arenas[i];
+				//arena is used by foreground thread, don't make it wait
+				std::unique_lock<std::mutex> lock{ arena.lock, std::try_to_lock };
+				if (!lock) {
+					m_compactorSkips.fetch_add(1u, std::memory_order_relaxed);
+					continue;
+				}
+
+				if (arena.heap.needsDefragmentation(m_compactorTrigger)) {
+					_defragmentArena(arena, m_compactorBudget, 0u);
+				} else if (!arena.retired.empty()) {
+					_reclaim(arena);
+				}
+			}
+
+			wait.lock();
+			m_compactorCv.wait_for(wait, std::chrono::microseconds(m_compactorPeriodUs),
+				[this]() { return !m_compactorRunning; });
+		}
+	}
+
+	//-----------------------------------------------------------
+	ConcurrentHeapStorage::Arena* ConcurrentHeapStorage::_getArena()
+	{
+		if (!m_arenas)
+			return nullptr;
+
+		if (t_threadIdx == s_invalidId)
+			t_threadIdx = g_nextThreadIdx.fetch_add(1u);
+		return &m_arenas[t_threadIdx % m_arenasNumber];
+	}
+
+	//-----------------------------------------------------------
+	ConcurrentHeapStorage::Arena* ConcurrentHeapStorage::_ownArena() const
+	{
+		//unlike _getArena, threads which only free memory don't take arena slots
+		if (!m_arenas || t_threadIdx == s_invalidId)
+			return nullptr;
+		return &m_arenas[t_threadIdx % m_arenasNumber];
+	}
+
+	//-----------------------------------------------------------
+	std::unique_lock<std::mutex> ConcurrentHeapStorage::_lockArena(Arena& arena)
+	{
+		//try_lock fails only while another thread holds the lock, so uncontended path costs the same
+		std::unique_lock<std::mutex> lock{ arena.lock, std::try_to_lock };
+		if (!lock) {
+			lock.lock();
+			arena.contention.contendedLocks++;
+		}
+		arena.contention.locks++;
+		return lock;
+	}
+
+	//-----------------------------------------------------------
+	ConcurrentHeapStorage::Arena* ConcurrentHeapStorage::_findArena(const void* ptr)
+	{
+		for (Size i = 0; i < m_arenasNumber; i++) {
+			if (m_arenas[i].heap.contains(ptr))
+				return &m_arenas[i];
+		}
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		//guarded objects are outside of heaps, index of an arena is checked under its lock
+		for (Size i = 0; i < m_arenasNumber; i++) {
+			std::unique_lock<std::mutex> lock = _lockArena(m_arenas[i]);
+			if (m_arenas[i].heap.isGuarded(ptr))
+				return &m_arenas[i];
+		}
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		return nullptr;
+	}
+
+	//-----------------------------------------------------------
+	/*
+	<precondition>
+	lock of the arena is taken
+	*/
+	void ConcurrentHeapStorage::_reclaim(Arena& arena)
+	{
+		Size number = 0u;
+		while (!arena.retired.empty() && GetEpochManager().isSafe(arena.retired.front().epoch)) {
+			number += arena.retired.front().number;
+			arena.retired.pop_front();
+		}
+		arena.heap.freeRetired(number);
+	}
+}//namespace hbp
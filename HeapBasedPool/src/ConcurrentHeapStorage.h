@@ -0,0 +1,188 @@
+#ifndef HEAP_BASED_POOL_SRC_CONCURRENT_HEAP_STORAGE
+#define HEAP_BASED_POOL_SRC_CONCURRENT_HEAP_STORAGE
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+
+#include "hbp.h"
+#include "Handle.h"
+
+namespace hbp
+{
+	//max number of threads with own reader slot, other threads share one slot
+	constexpr static Size s_maxEpochReaders = 64u;
+
+	/*
+	epoch based coordination between threads which read objects through handles
+	and defragmentation which moves them. Memory left by moved objects is retired in the current epoch
+	and freed only when every reader has entered a later one
+	*/
+	class EpochManager final
+	{
+	public:
+						EpochManager();
+
+		void			enter();
+		void			leave();
+
+		//returns epoch in which memory is retired, epoch is advanced
+		UInt			advance();
+		//true if no reader can still use memory retired in the epoch
+		bool			isSafe(CUInt epoch) const;
+
+		/*
+		waits until all readers leave and blocks new ones,
+		used by operations which overwrite objects in place
+		*/
+		void			lockExclusive();
+		void			unlockExclusive();
+
+	private:
+		Size			_readerIdx();
+		bool			_enterShared();
+		void			_leaveShared();
+
+	private:
+		struct alignas(64) Reader
+		{
+			//0 - reader is outside of guard
+			std::atomic<UInt>	epoch;
+			std::atomic<bool>	owned;
+		};
+
+		//the last reader is shared, its epoch is the one of the first thread which enters
+		//and is kept until all threads leave it, so memory is freed later than with own readers
+		Reader			m_readers[s_maxEpochReaders + 1u];
+		std::atomic<Size> m_sharedReadersNumber;
+		std::mutex		m_sharedLock;
+		std::atomic<UInt> m_epoch;
+		std::atomic<bool> m_exclusive;
+		std::mutex		m_exclusiveLock;
+	};
+
+	EpochManager& GetEpochManager();
+
+	//pointers read from handles inside of the guard stay valid until the guard is destroyed
+	class EpochGuard
+	{
+	public:
+				EpochGuard() { GetEpochManager().enter(); }
+				~EpochGuard() { GetEpochManager().leave(); }
+
+				EpochGuard(const EpochGuard&) = delete;
+				void operator=(const EpochGuard&) = delete;
+	};
+
+	//lock counters of arenas, they are kept in release builds like HeapStats
+	struct ContentionStats
+	{
+		//locks of arenas taken by malloc, free and destroy
+		Size			locks;
+		//locks which were held by another thread at the time
+		Size			contendedLocks;
+		//frees of objects from the arena of another thread
+		Size			remoteFrees;
+		//arenas skipped by the compactor because they were busy
+		Size			compactorSkips;
+	};
+
+	/*
+	HeapStorage which can be used from several threads.
+	Every thread allocates from its own arena(HeapStorage guarded by a mutex),
+	objects can be freed from any thread. Objects referenced by handles can be read from other threads
+	inside of EpochGuard while defragmentStep moves them, writers have to pin the handle.
+	Handles of objects in arenas have to be destroyed with destroy(), so the object isn't moved meanwhile.
+	*/
+	class ConcurrentHeapStorage final
+	{
+	public:
+								ConcurrentHeapStorage();
+								~ConcurrentHeapStorage();
+
+		//size of every arena, 0 arenas - one arena per hardware thread
+		void					init(CSize size, CSize arenasNumber = 0u);
+		void*					malloc(CSize size);
+		void					free(void* ptr);
+
+		//destroys handles and frees object they point to
+		void					destroy(IHandle* handle, CSize handlesNumber = 1u);
+
+		//moves objects of the next arena, can run concurrently with readers
+		DefragReport			defragmentStep(CSize byteBudget, CSize timeBudgetUs = 0u);
+		//compacts all arenas, waits until readers leave
+		DefragReport			compact();
+		//frees retired memory which isn't visible for readers anymore
+		void					reclaim();
+
+		/*
+		Starts background thread, which every periodUs checks free space of arenas and
+		runs defragmentStep with byteBudget on arenas which satisfy the trigger.
+		Busy arenas are skipped, so foreground threads never wait for the compactor longer than one step.
+		Moves are published through the handle table after the copy is complete,
+		so readers inside of EpochGuard see either the old or the new copy.
+		*/
+		void					startCompactor(const DefragTrigger& trigger, CSize byteBudget = 16u * 1024u, CSize periodUs = 1000u);
+		//arenas with fragmentation above the threshold are defragmented
+		void					startCompactor(const float fragmentationThreshold = 0.3f, CSize byteBudget = 16u * 1024u, CSize periodUs = 1000u)
+									{ startCompactor(DefragTrigger{ fragmentationThreshold, 0u, 0u }, byteBudget, periodUs); }
+		void					stopCompactor();
+
+		void					cleanAll();
+
+		//sum of counters of all arenas, peak is the sum of peaks of arenas
+		HeapStats				stats();
+		ContentionStats			contention();
+
+		Size					arenasNumber() const { return m_arenasNumber; }
+
+	private:
+		struct Arena
+		{
+			struct Retired
+			{
+				UInt	epoch;
+				Size	number;
+			};
+
+			std::mutex			lock;
+			HeapStorage			heap;
+			std::deque<Retired>	retired;
+			//counters are changed under the lock, compactorSkips is kept by the storage
+			ContentionStats		contention{};
+		};
+
+		Arena*					_getArena();
+		//arena of the calling thread or nullptr if the thread hasn't allocated yet
+		Arena*					_ownArena() const;
+		//takes the lock of the arena and counts it
+		std::unique_lock<std::mutex> _lockArena(Arena& arena);
+		Arena*					_findArena(const void* ptr);
+		void					_reclaim(Arena& arena);
+		//lock of the arena has to be taken
+		DefragReport			_defragmentArena(Arena& arena, CSize byteBudget, CSize timeBudgetUs);
+
+		void					_compactorLoop();
+
+	private:
+		std::unique_ptr<Arena[]> m_arenas;
+		Size					m_arenasNumber;
+		std::atomic<Size>		m_nextDefragArena;
+		std::atomic<Size>		m_compactorSkips;
+
+		std::thread				m_compactor;
+		std::mutex				m_compactorLock;
+		std::condition_variable	m_compactorCv;
+		bool					m_compactorRunning;
+		DefragTrigger			m_compactorTrigger;
+		Size					m_compactorBudget;
+		Size					m_compactorPeriodUs;
+	};
+
+	ConcurrentHeapStorage& GetConcurrentHeapStorage();
+}//namespace hbp
+
+#endif//HEAP_BASED_POOL_SRC_CONCURRENT_HEAP_STORAGE
@@ -2,12 +2,15 @@
 
 #include "ap.h"
 
+#include <thread>
+
 namespace hbp
 {
 	using namespace helpers;
 
-	static HandleManager g_handleManager{};
-	static UInt g_id{ 0u };
+	HandleManager g_handleManager{};
+	//AlignedPoolManager isn't thread safe, handles can be created from different threads
+	static std::mutex g_handlePoolLock;
 
 	//-----------------------------------------------------------
 	void customSetupAlignedPool()
@@ -16,40 +19,34 @@ namespace hbp
 		align_pool::GetAlignedPoolManager().init();
 	}
 
-	//-----------------------------------------------------------
-	void ResetHandlesId()
-	{
-		g_id = 0u;
-	}
-
-	//-----------------------------------------------------------
-	HandleManager& GetHandleManager()
-	{
-		return g_handleManager;
-	}
-
 	//-----------------------------------------------------------
 	IHandle::IHandle()
 		:m_id{ s_invalidId }
+		,m_cachedPtr{ nullptr }
+		,m_cachedEpoch{ s_invalidId }
 	{
 	}
 
 	//-----------------------------------------------------------
 	IHandle::IHandle(void* ptr)
 		: m_id{ s_invalidId }
+		, m_cachedPtr{ nullptr }
+		, m_cachedEpoch{ s_invalidId }
 	{
 		if (ptr) {
-			m_id = HandleManager::GenerateNewId();
-			GetHandleManager().insert(m_id, ptr);
+			m_id = GetHandleManager().insert(ptr);
 		}
 	}
 
 	//-----------------------------------------------------------
 	IHandle::IHandle(IHandle&& other) noexcept
+		: m_id{ s_invalidId }
+		, m_cachedPtr{ other.m_cachedPtr }
+		, m_cachedEpoch{ other.m_cachedEpoch }
 	{
-		release();
 		this->m_id = other.m_id;
 		other.m_id = s_invalidId;
+		other.m_cachedEpoch = s_invalidId;
 	}
 
 	//-----------------------------------------------------------
@@ -62,18 +59,21 @@ namespace hbp
 	{
 		release();
 		this->m_id = other.m_id;
+		this->m_cachedPtr = other.m_cachedPtr;
+		this->m_cachedEpoch = other.m_cachedEpoch;
 		other.m_id = s_invalidId;
+		other.m_cachedEpoch = s_invalidId;
 	}
 
 	void IHandle::operator=(void* ptr)
 	{
 		GetHandleManager().replace(m_id, ptr);
+		m_cachedEpoch = s_invalidId;
 	}
 
-	//-----------------------------------------------------------
-	void* IHandle::get() const
+	void IHandle::setRelocate(RelocateFn relocate)
 	{
-		return GetHandleManager().getHandle(m_id);
+		GetHandleManager().setRelocate(m_id, relocate);
 	}
 
 	void IHandle::release()
@@ -82,20 +82,43 @@ namespace hbp
 		{
 			GetHandleManager().erase(m_id);
 			m_id = s_invalidId;
+			m_cachedEpoch = s_invalidId;
 		}
 	}
 
 	//-----------------------------------------------------------
 	IHandle* helpers::makeHandle(void* obj, CUInt handlesNumber, CUInt objOffset)
 	{
-		if (!align_pool::GetAlignedPoolManager().isInitialized()) {
-			customSetupAlignedPool();
+		IHandle* h = nullptr;
+		{
+			std::lock_guard<std::mutex> lock{ g_handlePoolLock };
+			if (!align_pool::GetAlignedPoolManager().isInitialized()) {
+				customSetupAlignedPool();
+			}
+			h = static_cast<IHandle*>(align_pool::GetAlignedPoolManager().malloc_n(sizeof(IHandle), handlesNumber));
 		}
-		IHandle* h = static_cast<IHandle*>(align_pool::GetAlignedPoolManager().malloc_n(sizeof(IHandle), handlesNumber));
-		char* objPtr = static_cast<char*>(obj);
-		for (UInt i = 0; i < handlesNumber; i++, 
-			objPtr ? objPtr += objOffset : objPtr) {
-			new (h + i) IHandle{ objPtr};
+		if (!h)
+			return nullptr;
+
+		if (handlesNumber == 1u) {
+			new (h) IHandle{ obj };
+		} else {
+			//slots of the array are filled in one pass
+			CUInt first = obj ? GetHandleManager().insertRange(obj, handlesNumber, objOffset) : s_invalidId;
+			for (UInt i = 0; i < handlesNumber; i++) {
+				new (h + i) IHandle{};
+				if (first != s_invalidId)
+					h[i].m_id = GetHandleManager().getId(first + i);
+			}
+		}
+
+		//table of handles is full, handles without slots would point to nothing
+		if (obj && h->m_id == s_invalidId) {
+			for (UInt i = 0; i < handlesNumber; i++)
+				h[i].~IHandle();
+			std::lock_guard<std::mutex> lock{ g_handlePoolLock };
+			align_pool::GetAlignedPoolManager().free_n(h, handlesNumber);
+			return nullptr;
 		}
 		return h;
 	}
@@ -108,72 +131,327 @@ namespace hbp
 
 		IHandle* first = ptr;
 		void* obj = ptr ? hPtr(static_cast<Handle<void>*>(ptr)) : nullptr;
+
+		//handles created by makeHandle for an array still occupy consecutive slots
+		bool isRange = handlesNumber > 1u;
+		CUInt firstIdx = first->m_id & s_handleIndexMask;
+		for (UInt i = 0; i < handlesNumber && isRange; i++) {
+			isRange = GetHandleManager().isValid(first[i].m_id) && (first[i].m_id & s_handleIndexMask) == firstIdx + i;
+		}
+		if (isRange) {
+			GetHandleManager().eraseRange(first->m_id, handlesNumber);
+			for (UInt i = 0; i < handlesNumber; i++)
+				first[i].m_id = s_invalidId;
+		}
+
 		for (UInt i = 0; i < handlesNumber; i++)
 		{
 			(first+i)->~IHandle();
 		}
+		std::lock_guard<std::mutex> lock{ g_handlePoolLock };
 		align_pool::GetAlignedPoolManager().free_n(first, handlesNumber);
 		return obj;
 	}
 
 	//-----------------------------------------------------------
 	HandleManager::HandleManager()
-	{}
+		: m_size{ 0u }
+		, m_version{ 0u }
+		, m_pinsNumber{ 0u }
+		, m_relocationEpoch{ 0u }
+	{
+		for (auto& page : m_pages)
+			page.store(nullptr, std::memory_order_relaxed);
+	}
 
 	//-----------------------------------------------------------
 	HandleManager::~HandleManager()
 	{
-		m_handles.clear();
+		for (auto& page : m_pages) {
+			delete[] page.exchange(nullptr);
+		}
+		m_freeSlots.clear();
+		m_freeRanges.clear();
+		m_freeRangesBySize.clear();
 	}
 
 	//-----------------------------------------------------------
-	void* HandleManager::getHandle(CUInt id) const
+	UInt HandleManager::insert(void* ptr)
 	{
-		void* res = nullptr;
-		HandleTable::const_iterator it = m_handles.find(id);
-		if (it != m_handles.cend()) 
-			res = it->second;
-		return res;
+		UInt idx = s_invalidId;
+		{
+			std::lock_guard<std::mutex> lock{ m_freeSlotsLock };
+			if (!m_freeSlots.empty()) {
+				idx = m_freeSlots.back();
+				m_freeSlots.pop_back();
+			}
+		}
+
+		HandleSlot* slot = nullptr;
+		if (idx != s_invalidId) {
+			slot = _slot(idx);
+		} else if (_takeFromRange(idx)) {
+			slot = _slot(idx);
+		} else {
+			idx = m_size.fetch_add(1u, std::memory_order_acq_rel);
+			if (idx >= s_handleIndexMask) {
+				m_size.fetch_sub(1u, std::memory_order_acq_rel);
+				printf_s("There is no free slot for a new handle, max number of handles is[%zu]\n", s_handleIndexMask);
+				return s_invalidId;
+			}
+			slot = _allocSlot(idx);
+		}
+
+		//pin of the previous handle, which has lost the race with its erase, can be left in the slot
+		if (CUInt pins = _dropPins(*slot))
+			m_pinsNumber.fetch_sub(pins, std::memory_order_acq_rel);
+
+		//slot becomes visible to readers only with the new generation
+		slot->ptr.store(ptr, std::memory_order_relaxed);
+		CUInt generation = (slot->generation.load(std::memory_order_relaxed) + 1u) & s_handleGenerationMask;
+		slot->generation.store(generation, std::memory_order_release);
+		m_version.fetch_add(1u, std::memory_order_acq_rel);
+		return generation << s_handleIndexBits | idx;
 	}
 
 	//-----------------------------------------------------------
-	void HandleManager::insert(CUInt id, void* ptr)
+	void HandleManager::erase(CUInt id)
 	{
-		if (m_handles.find(id) != m_handles.cend()){
-			printf_s("There is already a handle with id[%zd]\n", id);
-		} else {
-			m_handles[id] = ptr;
+		if (_isValid(id)) {
+			CUInt idx = id & s_handleIndexMask;
+			HandleSlot& slot = *_slot(idx);
+			slot.generation.store((slot.generation.load(std::memory_order_relaxed) + 1u) & s_handleGenerationMask, std::memory_order_release);
+			slot.ptr.store(nullptr, std::memory_order_relaxed);
+			//guards of released handle can't find the slot anymore
+			if (CUInt pins = _dropPins(slot))
+				m_pinsNumber.fetch_sub(pins, std::memory_order_acq_rel);
+			slot.relocate = nullptr;
+			{
+				std::lock_guard<std::mutex> lock{ m_freeSlotsLock };
+				m_freeSlots.push_back(idx);
+			}
+			m_version.fetch_add(1u, std::memory_order_acq_rel);
 		}
 	}
 
 	//-----------------------------------------------------------
-	void HandleManager::erase(CUInt id)
+	UInt HandleManager::insertRange(void* ptr, CUInt number, CUInt stride)
 	{
-		HandleTable::iterator it;
-		if (m_handles.size() != 0 && 
-			(it = m_handles.find(id)) != m_handles.cend()) {
-			//delete item from table
-			m_handles.erase(it);
-			if (m_handles.size() == 0) {
-				ResetHandlesId();
+		if (number == 0u)
+			return s_invalidId;
+
+		UInt first = s_invalidId;
+		{
+			std::lock_guard<std::mutex> lock{ m_freeSlotsLock };
+			//the smallest range which fits, the rest of it stays free
+			auto fit = m_freeRangesBySize.lower_bound(std::make_pair(number, UInt(0)));
+			if (fit != m_freeRangesBySize.end()) {
+				first = fit->second;
+				CUInt rest = fit->first - number;
+				_removeFreeRange(m_freeRanges.find(first));
+				if (rest)
+					_addFreeRange(first + number, rest);
+			}
+		}
+
+		if (first == s_invalidId) {
+			first = m_size.fetch_add(number, std::memory_order_acq_rel);
+			if (first + number > s_handleIndexMask) {
+				m_size.fetch_sub(number, std::memory_order_acq_rel);
+				printf_s("There is no free slots for [%zu] new handles, max number of handles is[%zu]\n", number, s_handleIndexMask);
+				return s_invalidId;
 			}
+			for (UInt idx = first; idx < first + number; idx = (idx | (s_handlePageSize - 1)) + 1)
+				_allocSlot(idx);
+		}
+
+		char* objPtr = static_cast<char*>(ptr);
+		UInt pins = 0u;
+		for (UInt idx = first; idx < first + number; idx++, objPtr += stride) {
+			HandleSlot& slot = *_slot(idx);
+			pins += _dropPins(slot);
+			slot.ptr.store(objPtr, std::memory_order_relaxed);
+			slot.generation.store((slot.generation.load(std::memory_order_relaxed) + 1u) & s_handleGenerationMask, std::memory_order_release);
+		}
+		if (pins)
+			m_pinsNumber.fetch_sub(pins, std::memory_order_acq_rel);
+		m_version.fetch_add(1u, std::memory_order_acq_rel);
+		return first;
+	}
+
+	//-----------------------------------------------------------
+	void HandleManager::eraseRange(CUInt firstId, CUInt number)
+	{
+		CUInt first = firstId & s_handleIndexMask;
+		UInt pins = 0u;
+		for (UInt idx = first; idx < first + number; idx++) {
+			HandleSlot& slot = *_slot(idx);
+			slot.generation.store((slot.generation.load(std::memory_order_relaxed) + 1u) & s_handleGenerationMask, std::memory_order_release);
+			slot.ptr.store(nullptr, std::memory_order_relaxed);
+			pins += _dropPins(slot);
+			slot.relocate = nullptr;
+		}
+		if (pins)
+			m_pinsNumber.fetch_sub(pins, std::memory_order_acq_rel);
+
+		{
+			std::lock_guard<std::mutex> lock{ m_freeSlotsLock };
+			_addFreeRange(first, number);
 		}
+		m_version.fetch_add(1u, std::memory_order_acq_rel);
 	}
 
 	//-----------------------------------------------------------
 	void HandleManager::replace(CUInt id, void* ptr)
 	{
-		if (m_handles.find(id) == m_handles.cend()) {
+		if (!_isValid(id)) {
 			printf_s("There isn't a handle with id[%zd]\n", id);
 		}
 		else {
-			m_handles[id] = ptr;
+			_slot(id & s_handleIndexMask)->ptr.store(ptr, std::memory_order_release);
+			m_version.fetch_add(1u, std::memory_order_acq_rel);
+			onRelocation();
 		}
 	}
 
 	//-----------------------------------------------------------
-	UInt HandleManager::GenerateNewId()
+	void HandleManager::setRelocate(CUInt id, RelocateFn relocate)
 	{
-		return g_id++;
+		if (_isValid(id))
+			_slot(id & s_handleIndexMask)->relocate = relocate;
+	}
+
+	//-----------------------------------------------------------
+	void* HandleManager::pin(CUInt id)
+	{
+		if (!_isValid(id))
+			return nullptr;
+
+		HandleSlot& slot = *_slot(id & s_handleIndexMask);
+		//pin taken before the move stops it, pin taken during the move has to get the new place
+		UInt pins = slot.pins.fetch_add(1u, std::memory_order_acq_rel);
+		while (pins & s_pinMovingBit) {
+			std::this_thread::yield();
+			pins = slot.pins.load(std::memory_order_acquire);
+		}
+		m_pinsNumber.fetch_add(1u, std::memory_order_acq_rel);
+
+		/*
+		handle could be erased before the pin became visible, erase doesn't see such pin,
+		so it's taken back from the slot directly, id isn't valid anymore
+		*/
+		void* ptr = slot.ptr.load(std::memory_order_acquire);
+		if (!ptr || slot.generation.load(std::memory_order_acquire) != id >> s_handleIndexBits) {
+			_unpin(slot);
+			return nullptr;
+		}
+		return ptr;
+	}
+
+	//-----------------------------------------------------------
+	void HandleManager::unpin(CUInt id)
+	{
+		//pins of released handle are dropped by erase
+		if (_isValid(id))
+			_unpin(*_slot(id & s_handleIndexMask));
+	}
+
+	//-----------------------------------------------------------
+	bool HandleManager::beginMove(HandleSlot& slot)
+	{
+		UInt pins = 0u;
+		return slot.pins.compare_exchange_strong(pins, s_pinMovingBit, std::memory_order_acq_rel);
+	}
+
+	//-----------------------------------------------------------
+	void HandleManager::endMove(HandleSlot& slot)
+	{
+		slot.pins.fetch_and(~s_pinMovingBit, std::memory_order_acq_rel);
+	}
+
+	//-----------------------------------------------------------
+	bool HandleManager::_isValid(CUInt id) const
+	{
+		const HandleSlot* slot = _slot(id & s_handleIndexMask);
+		return slot && slot->generation.load(std::memory_order_acquire) == id >> s_handleIndexBits;
+	}
+
+	//-----------------------------------------------------------
+	void HandleManager::_unpin(HandleSlot& slot)
+	{
+		UInt pins = slot.pins.load(std::memory_order_acquire);
+		while ((pins & ~s_pinMovingBit) && !slot.pins.compare_exchange_weak(pins, pins - 1u, std::memory_order_acq_rel)) {}
+		if (pins & ~s_pinMovingBit)
+			m_pinsNumber.fetch_sub(1u, std::memory_order_acq_rel);
+	}
+
+	//-----------------------------------------------------------
+	UInt HandleManager::_dropPins(HandleSlot& slot)
+	{
+		//moving bit belongs to HeapStorage, it's cleared by endMove
+		UInt pins = slot.pins.load(std::memory_order_acquire);
+		while ((pins & ~s_pinMovingBit) && !slot.pins.compare_exchange_weak(pins, pins & s_pinMovingBit, std::memory_order_acq_rel)) {}
+		return pins & ~s_pinMovingBit;
+	}
+
+	//-----------------------------------------------------------
+	bool HandleManager::_takeFromRange(UInt& idx)
+	{
+		std::lock_guard<std::mutex> lock{ m_freeSlotsLock };
+		if (m_freeRangesBySize.empty())
+			return false;
+
+		//slot is taken from the smallest range, big ranges are kept for arrays
+		CUInt number = m_freeRangesBySize.begin()->first;
+		CUInt first = m_freeRangesBySize.begin()->second;
+		_removeFreeRange(m_freeRanges.find(first));
+		idx = first + number - 1u;
+		if (number > 1u)
+			_addFreeRange(first, number - 1u);
+		return true;
+	}
+
+	//-----------------------------------------------------------
+	void HandleManager::_addFreeRange(UInt first, UInt number)
+	{
+		std::map<UInt, UInt>::iterator next = m_freeRanges.lower_bound(first);
+		if (next != m_freeRanges.end() && first + number == next->first) {
+			number += next->second;
+			next = _removeFreeRange(next);
+		}
+		if (next != m_freeRanges.begin()) {
+			std::map<UInt, UInt>::iterator prev = std::prev(next);
+			if (prev->first + prev->second == first) {
+				first = prev->first;
+				number += prev->second;
+				_removeFreeRange(prev);
+			}
+		}
+		m_freeRanges.emplace(first, number);
+		m_freeRangesBySize.emplace(number, first);
+	}
+
+	//-----------------------------------------------------------
+	std::map<UInt, UInt>::iterator HandleManager::_removeFreeRange(std::map<UInt, UInt>::iterator range)
+	{
+		m_freeRangesBySize.erase(std::make_pair(range->second, range->first));
+		return m_freeRanges.erase(range);
+	}
+
+	//-----------------------------------------------------------
+	HandleSlot* HandleManager::_allocSlot(CUInt idx)
+	{
+		std::atomic<HandleSlot*>& page = m_pages[idx >> s_handlePageBits];
+		HandleSlot* ptr = page.load(std::memory_order_acquire);
+		if (!ptr) {
+			//several threads can try to allocate the same page, only one of them wins
+			HandleSlot* newPage = new HandleSlot[s_handlePageSize]();
+			if (page.compare_exchange_strong(ptr, newPage, std::memory_order_acq_rel)) {
+				ptr = newPage;
+			} else {
+				delete[] newPage;
+			}
+		}
+		return ptr + (idx & (s_handlePageSize - 1));
 	}
-}// namespace hbp
\ No newline at end of file
+}// namespace hbp
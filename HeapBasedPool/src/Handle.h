@@ -1,6 +1,14 @@
 #ifndef HEAP_BASED_POOL_SRC_HANDLE
 #define HEAP_BASED_POOL_SRC_HANDLE
+#include <vector>
 #include <map>
+#include <set>
+#include <iterator>
+#include <type_traits>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <utility>
 
 namespace hbp {
 
@@ -8,13 +16,68 @@ namespace hbp {
 	typedef const ptrdiff_t			CInt;
 	typedef size_t					UInt;
 	typedef const size_t			CUInt;
-	typedef std::map<UInt, void*>	HandleTable;
+
+	/*
+	moves object from src to dst and destroys the source,
+	used by HeapStorage for objects which can't be moved with memcpy
+	*/
+	typedef void (*RelocateFn)(void* dst, void* src);
+
+	/*
+	slot of the handle table, generation is odd while slot is occupied,
+	so id of released handle never matches reused slot,
+	object of the pinned slot is never moved by HeapStorage,
+	relocate is nullptr for trivially copyable objects
+	*/
+	struct HandleSlot
+	{
+		std::atomic<void*>	ptr;
+		std::atomic<UInt>	generation;
+		std::atomic<UInt>	pins;
+		RelocateFn			relocate;
+	};
 
 	constexpr static UInt s_invalidId = ~0;
+	//set in pins of the slot while HeapStorage moves its object, pins of the slot wait for the new place meanwhile
+	constexpr static UInt s_pinMovingBit = UInt(1) << (sizeof(UInt) * 8 - 1);
 	constexpr static UInt s_maxNumberOfHandles = 1000000u;
 
+	//handle id is [generation | slot index]
+	constexpr static UInt s_handleIndexBits = 24u;
+	constexpr static UInt s_handleIndexMask = (UInt(1) << s_handleIndexBits) - 1;
+	constexpr static UInt s_handleGenerationMask = s_invalidId >> s_handleIndexBits;
+
+	//handle table is allocated by pages, which never move, so slots can be read without locks
+	constexpr static UInt s_handlePageBits = 12u;
+	constexpr static UInt s_handlePageSize = UInt(1) << s_handlePageBits;
+	constexpr static UInt s_handlePagesNumber = (s_handleIndexMask + 1) >> s_handlePageBits;
+
+	template<typename T>
+	class PinGuard;
+
+	template<typename T>
+	class PinRange;
+
+	class IHandle;
+
+	namespace helpers {
+		//handles for an array are created and released in bulk, nullptr if there are no free slots for handles of obj
+		IHandle* makeHandle(void* obj, CUInt handlesNumber = 1, CUInt objOffset = 0);
+
+		void* destroyHandle(IHandle* ptr, CUInt handlesNumber = 1);
+	}
+
 	class IHandle
 	{
+		template<typename T>
+		friend class PinGuard;
+
+		template<typename T>
+		friend class PinRange;
+
+		friend IHandle* helpers::makeHandle(void* obj, CUInt handlesNumber, CUInt objOffset);
+		friend void* helpers::destroyHandle(IHandle* ptr, CUInt handlesNumber);
+
 	public:
 				IHandle();
 				IHandle(void* ptr);
@@ -24,13 +87,23 @@ namespace hbp {
 
 				void operator=(IHandle&& other) noexcept;
 				void operator=(void* ptr);
+
+				//object is moved with relocate instead of memcpy
+				void setRelocate(RelocateFn relocate);
 	protected:
 
-				void*	get() const;
+		inline	void*	get() const;
 
 	private:
 				void	release();
 		UInt	m_id;
+
+		/*
+		pointer resolved at relocation epoch m_cachedEpoch, it's valid until objects are moved again,
+		cache isn't synchronized, so one handle shouldn't be dereferenced from several threads at once
+		*/
+		mutable void*	m_cachedPtr;
+		mutable UInt	m_cachedEpoch;
 	};
 
 	template<typename T>
@@ -72,38 +145,285 @@ namespace hbp {
 				{
 					return *(pointer<MyType>());
 				}
+
+				//object stays in place while returned guard is alive
+				PinGuard<T> pin() const
+				{
+					return PinGuard<T>{ *this };
+				}
 	};
 	
+	/*
+	table of handles, lookups, insert and erase can be called from different threads,
+	object behind a handle can be moved only by HeapStorage which owns it
+	*/
 	class HandleManager final
 	{
 	public:
-		typedef HandleTable::iterator iterator;
+		//iterates over occupied slots, which point to some object
+		class iterator
+		{
+		public:
+						iterator(HandleManager* manager, CUInt idx, CUInt end)
+							: m_manager{ manager }, m_idx{ idx }, m_end{ end }
+							{ _skip(); }
+
+			HandleSlot&	operator*() const { return *m_manager->_slot(m_idx); }
+			HandleSlot*	operator->() const { return m_manager->_slot(m_idx); }
+			iterator&	operator++() { ++m_idx; _skip(); return *this; }
+			iterator	operator++(int) { iterator tmp = *this; ++(*this); return tmp; }
+			bool		operator==(const iterator& other) const { return m_idx == other.m_idx; }
+			bool		operator!=(const iterator& other) const { return m_idx != other.m_idx; }
+
+		private:
+			void		_skip()
+						{
+							for (; m_idx < m_end; ++m_idx) {
+								const HandleSlot* slot = m_manager->_slot(m_idx);
+								if (slot && (slot->generation.load(std::memory_order_acquire) & 1u) && slot->ptr.load(std::memory_order_relaxed))
+									break;
+							}
+						}
+
+			HandleManager*	m_manager;
+			UInt			m_idx;
+			UInt			m_end;
+		};
 		
 	public:
 						HandleManager();
 						~HandleManager();
 
-		void*			getHandle(CUInt id) const;
-		void			insert(CUInt id, void* ptr);
+		inline void*	getHandle(CUInt id) const
+		{
+			const HandleSlot* slot = _slot(id & s_handleIndexMask);
+			return slot && slot->generation.load(std::memory_order_acquire) == id >> s_handleIndexBits
+				? slot->ptr.load(std::memory_order_acquire)
+				: nullptr;
+		}
+
+		//returns id of the new handle
+		UInt			insert(void* ptr);
 		void			erase(CUInt id);
 
+		/*
+		fills number consecutive slots with ptr, ptr + stride, ...
+		returns index of the first slot or s_invalidId
+		*/
+		UInt			insertRange(void* ptr, CUInt number, CUInt stride);
+		//releases consecutive slots starting from the slot of firstId
+		void			eraseRange(CUInt firstId, CUInt number);
+		bool			isValid(CUInt id) const { return _isValid(id); }
+		//id of the occupied slot
+		UInt			getId(CUInt idx) const 
+							{ return _slot(idx)->generation.load(std::memory_order_acquire) << s_handleIndexBits | idx; }
+
 		void			replace(CUInt id, void* ptr);
+		void			setRelocate(CUInt id, RelocateFn relocate);
+
+		//changes on every insert, erase and replace
+		UInt			version() const { return m_version.load(std::memory_order_acquire); }
+
+		//changes when pointer of any existing handle changes(objects are moved or replaced)
+		UInt			relocationEpoch() const { return m_relocationEpoch.load(std::memory_order_acquire); }
+		void			onRelocation() { m_relocationEpoch.fetch_add(1u, std::memory_order_acq_rel); }
+
+		//returns pointer to the pinned object, nullptr if id isn't valid
+		void*			pin(CUInt id);
+		void			unpin(CUInt id);
+
+		/*
+		HeapStorage marks every handle of the object before it's moved, false if the handle is pinned.
+		After the new pointer of the slot is stored endMove lets waiting pins take it
+		*/
+		static bool		beginMove(HandleSlot& slot);
+		static void		endMove(HandleSlot& slot);
+
+		//total number of pins over all handles
+		UInt			pinsNumber() const { return m_pinsNumber.load(std::memory_order_acquire); }
+
+		iterator		begin() { return iterator{ this, 0u, m_size.load(std::memory_order_acquire) }; };
+		iterator		end() { CUInt size = m_size.load(std::memory_order_acquire); return iterator{ this, size, size }; }
+
+	private:
+		bool			_isValid(CUInt id) const;
+		//releases one pin of the slot, id of the slot isn't checked
+		void			_unpin(HandleSlot& slot);
+		//clears pins of the slot besides the moving bit, returns their number, m_pinsNumber isn't changed
+		UInt			_dropPins(HandleSlot& slot);
+
+		//nullptr if page of the slot isn't allocated yet
+		inline HandleSlot* _slot(CUInt idx) const
+		{
+			HandleSlot* page = m_pages[idx >> s_handlePageBits].load(std::memory_order_acquire);
+			return page ? page + (idx & (s_handlePageSize - 1)) : nullptr;
+		}
+		HandleSlot*		_allocSlot(CUInt idx);
+		//takes one slot from released ranges
+		bool			_takeFromRange(UInt& idx);
+		//range is merged with adjacent free ranges, both have to be called under m_freeSlotsLock
+		void			_addFreeRange(UInt first, UInt number);
+		std::map<UInt, UInt>::iterator _removeFreeRange(std::map<UInt, UInt>::iterator range);
+
+	private:
+		std::atomic<HandleSlot*> m_pages[s_handlePagesNumber];
+		//number of slots which have ever been used
+		std::atomic<UInt> m_size;
+
+		//guards lists of free slots
+		std::mutex		m_freeSlotsLock;
+		std::vector<UInt> m_freeSlots;
+		//ranges released by eraseRange, adjacent ranges are merged [first index -> number]
+		std::map<UInt, UInt> m_freeRanges;
+		//the same ranges ordered by size [number, first index], so the best fit is found in O(log ranges)
+		std::set<std::pair<UInt, UInt>> m_freeRangesBySize;
+
+		std::atomic<UInt> m_version;
+		std::atomic<UInt> m_pinsNumber;
+		std::atomic<UInt> m_relocationEpoch;
+	};
+
+	//defined in Handle.cpp, accessed inline, because every dereference of a handle goes through it
+	extern HandleManager g_handleManager;
 
-		iterator		begin() { return m_handles.begin(); };
-		iterator		end() { return m_handles.end(); }
+	inline HandleManager& GetHandleManager()
+	{
+		return g_handleManager;
+	}
+
+	//-----------------------------------------------------------
+	inline void* IHandle::get() const
+	{
+		//common case, nothing has been moved since the last access
+		HandleManager& manager = GetHandleManager();
+		CUInt epoch = manager.relocationEpoch();
+		if (m_cachedEpoch != epoch) {
+			m_cachedPtr = manager.getHandle(m_id);
+			m_cachedEpoch = epoch;
+		}
+		return m_cachedPtr;
+	}
+
+	/*
+	RAII pin of one handle, pointer stays valid until the guard is destroyed,
+	HeapStorage neither compacts nor copies pinned objects
+	*/
+	template<typename T>
+	class PinGuard
+	{
+	public:
+				PinGuard()
+					: m_id{ s_invalidId }, m_ptr{ nullptr }
+					{};
+		explicit PinGuard(const IHandle& handle)
+					: m_id{ handle.m_id }, m_ptr{ static_cast<T*>(GetHandleManager().pin(handle.m_id)) }
+					{
+						if (!m_ptr)
+							m_id = s_invalidId;
+					};
+				PinGuard(const PinGuard&) = delete;
+				PinGuard(PinGuard&& other) noexcept
+					: m_id{ other.m_id }, m_ptr{ other.m_ptr }
+					{
+						other.m_id = s_invalidId;
+						other.m_ptr = nullptr;
+					};
+				~PinGuard()
+					{ unpin(); };
+
+				void operator=(PinGuard&& other) noexcept
+				{
+					unpin();
+					m_id = other.m_id;
+					m_ptr = other.m_ptr;
+					other.m_id = s_invalidId;
+					other.m_ptr = nullptr;
+				}
+
+				void unpin()
+				{
+					if (m_id != s_invalidId) {
+						GetHandleManager().unpin(m_id);
+						m_id = s_invalidId;
+						m_ptr = nullptr;
+					}
+				}
+
+				T*	get() const { return m_ptr; }
+				T&	operator*() const { return *m_ptr; }
+				T*	operator->() const { return m_ptr; }
 
-		static UInt		GenerateNewId();
 	private:
-		HandleTable		m_handles;
+		UInt	m_id;
+		T*		m_ptr;
 	};
 
-	HandleManager& GetHandleManager();
+	/*
+	pins a sequence of handles(HandleVec, array from makeHandle),
+	raw pointers are stored contiguously, so loops over them cost the same as over raw pointers
+	*/
+	template<typename T>
+	class PinRange
+	{
+	public:
+		typedef T* const* const_iterator;
+
+	public:
+				template<typename It>
+				PinRange(It first, It last)
+				{
+					for (; first != last; ++first) {
+						const IHandle& handle = *first;
+						T* ptr = static_cast<T*>(GetHandleManager().pin(handle.m_id));
+						if (ptr) {
+							m_ids.push_back(handle.m_id);
+							m_ptrs.push_back(ptr);
+						}
+					}
+				}
+				template<typename C>
+				explicit PinRange(const C& container)
+					: PinRange(std::begin(container), std::end(container))
+					{};
+				PinRange(const PinRange&) = delete;
+				PinRange(PinRange&& other) noexcept = default;
+				~PinRange()
+					{ unpin(); };
+
+				void unpin()
+				{
+					for (CUInt id : m_ids)
+						GetHandleManager().unpin(id);
+					m_ids.clear();
+					m_ptrs.clear();
+				}
+
+				UInt			size() const { return m_ptrs.size(); }
+				T&				operator[](CUInt idx) const { return *m_ptrs[idx]; }
+				const_iterator	begin() const { return m_ptrs.data(); }
+				const_iterator	end() const { return m_ptrs.data() + m_ptrs.size(); }
+
+	private:
+		std::vector<UInt>	m_ids;
+		std::vector<T*>		m_ptrs;
+	};
 	
 	namespace helpers {
 
-		IHandle* makeHandle(void* obj, CUInt handlesNumber = 1, CUInt objOffset = 0);
+		template<typename T>
+		void relocateObject(void* dst, void* src)
+		{
+			T* obj = static_cast<T*>(src);
+			new (dst) T(std::move(*obj));
+			obj->~T();
+		}
 
-		void* destroyHandle(IHandle* ptr, CUInt handlesNumber = 1);
+		//nullptr when memcpy is enough to move the object
+		template<typename T>
+		constexpr RelocateFn getRelocateFn()
+		{
+			return std::is_trivially_copyable<T>::value ? nullptr : &relocateObject<T>;
+		}
 
 		template<typename MyType>
 		MyType hVal(Handle<MyType>* handle)
@@ -189,7 +509,7 @@ namespace hbp {
 		template <typename U>
 		HandleAllocator(const HandleAllocator<U>& other) {};
 
-		HandleAllocator& operator=(const HandleAllocator& other) {};
+		HandleAllocator& operator=(const HandleAllocator& other) { return *this; };
 
 
 		static pointer address(reference r) { return &r; }
@@ -197,17 +517,13 @@ namespace hbp {
 
 		static pointer allocate(const size_type n, const void* = 0)
 		{
-			return static_cast<pointer>(::operator new(std::_Get_size_of_n<sizeof(value_type)>(n)));
-			//return helpers::makeHandle(nullptr, n);
+			return static_cast<pointer>(::operator new(n * sizeof(value_type)));
 		}
 
 		static void deallocate(pointer ptr, const size_type blockNumber)
 		{
-			::operator delete(ptr, std::_Get_size_of_n<sizeof(value_type)>(blockNumber));
-			/*for (size_type i = 0; i < blockNumber; i++)
-			{
-				helpers::destroyHandle(ptr + i);
-			}*/
+			(void)blockNumber;
+			::operator delete(ptr);
 		}
 
 		static  void construct(pointer const p, value_type&& t)
@@ -257,7 +573,7 @@ namespace hbp {
 		template <typename U>
 		HandleAllocator(const HandleAllocator<U>& other) {};
 
-		HandleAllocator& operator=(const HandleAllocator& other) {};
+		HandleAllocator& operator=(const HandleAllocator& other) { return *this; };
 
 
 		static pointer address(reference r) { return &r; }
@@ -1,359 +1,1625 @@
 #include <memory>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "hbp.h"
 #include "Handle.h"
 
-namespace hbp
-{
-	//-----------------------------------------------------------
-	void* FreeListStorage::malloc(CSize size)
-	{
-		if (size == 0u)
-			return nullptr;
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+#include "../../utils/trace.h"
+#endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
+
+#if HEAP_BASED_POOL_ENABLE_LATENCY
+#include "../../utils/latency.h"
+#endif// HEAP_BASED_POOL_ENABLE_LATENCY
+
+#if HEAP_BASED_POOL_ENABLE_CHECKED
+#include "../../utils/checked.h"
+#endif// HEAP_BASED_POOL_ENABLE_CHECKED
+
+#if HEAP_BASED_POOL_ENABLE_CANARY
+#include "../../utils/canary.h"
+#endif// HEAP_BASED_POOL_ENABLE_CANARY
+
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+#include <cstddef>
+#include <cstdint>
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+
+namespace hbp
+{
+	namespace
+	{
+		//-----------------------------------------------------------
+		Size pageSize()
+		{
+#if defined(_WIN32)
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			return info.dwPageSize;
+#else
+			return static_cast<Size>(sysconf(_SC_PAGESIZE));
+#endif
+		}
+
+		//-----------------------------------------------------------
+		Size roundUpToPage(CSize size)
+		{
+			static CSize page = pageSize();
+			return (size + page - 1) / page * page;
+		}
+
+		//-----------------------------------------------------------
+		void* reserveRange(CSize size)
+		{
+#if defined(_WIN32)
+			return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+			void* ptr = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			return ptr != MAP_FAILED ? ptr : nullptr;
+#endif
+		}
+
+		//-----------------------------------------------------------
+		bool commitRange(void* ptr, CSize size)
+		{
+#if defined(_WIN32)
+			return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+			return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+		}
+
+		//-----------------------------------------------------------
+		void releaseRange(void* ptr, CSize size)
+		{
+#if defined(_WIN32)
+			(void)size;
+			VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+			munmap(ptr, size);
+#endif
+		}
+
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		//guarded object keeps alignment of malloc, so it's followed by the guard page up to this padding
+		constexpr Size s_guardedAlignment = alignof(std::max_align_t);
+
+		//-----------------------------------------------------------
+		//pages of the guarded object start on the page boundary before it
+		char* guardedRange(const void* obj)
+		{
+			static CSize page = pageSize();
+			return const_cast<char*>(static_cast<const char*>(obj)) - reinterpret_cast<uintptr_t>(obj) % page;
+		}
+
+		//-----------------------------------------------------------
+		//pages of the object and the guard page after them
+		Size guardedRangeSize(const void* obj, CSize objSize)
+		{
+			return roundUpToPage(static_cast<const char*>(obj) - guardedRange(obj) + objSize) + roundUpToPage(1u);
+		}
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+
+		static_assert(HEAP_BASED_POOL_SMALL_OBJECT_SIZE <= 256, "small objects are limited by the biggest size class");
+
+		//8 bytes steps up to 64, 16 bytes steps up to 128, 32 bytes steps up to 256
+		constexpr Size s_slabSizes[] = { 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256 };
+	}
+
+	//-----------------------------------------------------------
+	void* FreeListStorage::malloc(CSize size)
+	{
+		if (size == 0u)
+			return nullptr;
+
+		Size actualSize = _actualSize(size);
+		void* curSeg = _findFit(actualSize);
+
+		if (curSeg) {
+			void* res = _takeFromSegment(curSeg, actualSize);
+			//next search starts right after the object
+			m_rover = static_cast<char*>(curSeg) + actualSize;
+
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+			_log(res, _segSize(curSeg), true);
+#endif
+
+			return res;
+		}
+
+		return nullptr;
+	}
+	
+	//-----------------------------------------------------------
+	void FreeListStorage::free(void* ptr)
+	{
+		if (!ptr)
+			return;
+
+		void* actualAddres = static_cast<char*>(ptr) - s_ptrSize;
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+		_log(static_cast<char*>(ptr), *static_cast<size_t*>(actualAddres), false);
+#endif
+		addBLock(actualAddres, _segSize(actualAddres));
+	}
+
+	//-----------------------------------------------------------
+	/*
+	merges the block with adjacent free segments
+	*/
+	void FreeListStorage::addBLock(void* ptr, CSize size)
+	{
+		void* prev = _lower(ptr);
+		void* next = _upper(ptr);
+		Size totalSize = size;
+
+		if (next && static_cast<char*>(ptr) + size == next) {
+			_unindex(next);
+			totalSize += _segSize(next);
+			_erase(m_data, next);
+		}
+
+		if (prev && static_cast<char*>(prev) + _segSize(prev) == ptr) {
+			_unindex(prev);
+			_resize(m_data, prev, _segSize(prev) + totalSize);
+			_index(prev);
+		} else {
+			_segSize(ptr) = totalSize;
+			_insert(m_data, ptr);
+			_index(ptr);
+		}
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::reinit(FreeListStorage* ptr)
+	{
+		m_data = ptr ? ptr->m_data : nullptr;
+		m_rover = nullptr;
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+		//objects were copied by the new storage, further events continue its trace
+		if (ptr)
+			m_traceId = ptr->m_traceId;
+#endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
+		_rebuildIndex();
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::setPolicy(const PlacementPolicy policy)
+	{
+		m_policy = policy;
+		m_rover = nullptr;
+		_rebuildIndex();
+	}
+
+	//defragmentation functionality
+	
+	//-----------------------------------------------------------
+	void FreeListStorage::getNextHole(void*& nextHole, Size& holeSize, void* start /*nullptr*/) const
+	{
+		nextHole = _upper(start);
+		if (nextHole)
+			holeSize = _segSize(nextHole);
+	}
+
+	//-----------------------------------------------------------
+	void* FreeListStorage::mallocFromHole(void* hole, CSize size)
+	{
+		Size actualSize = _actualSize(size);
+		if (!hole || _upper(static_cast<char*>(hole) - 1) != hole || _segSize(hole) < actualSize)
+			return nullptr;
+
+		void* res = _takeFromSegment(hole, actualSize);
+
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+		_log(res, _segSize(hole), true);
+#endif
+
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	void* FreeListStorage::getHoleBelow(const void* obj, CSize size) const
+	{
+		//subtrees are skipped by their max size, so it's a single descent
+		void* hole = _firstFit(m_data, _actualSize(size), nullptr);
+		return hole < obj ? hole : nullptr;
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::rebuild(const Hole* holes, CSize holesNumber)
+	{
+		m_data = nullptr;
+		for (Size i = 0; i < holesNumber; i++) {
+			void* seg = holes[i].ptr;
+			_segSize(seg) = holes[i].size;
+			_insert(m_data, seg);
+		}
+		m_rover = nullptr;
+		_rebuildIndex();
+	}
+
+	//-----------------------------------------------------------
+	FreeSpaceStats FreeListStorage::getFreeSpace() const
+	{
+		FreeSpaceStats res = m_freeSpace;
+		res.largestHole = getLargestHole();
+		return res;
+	}
+
+#if  HEAP_BASED_POOL_ENABLE_MEM_LOG
+	//-----------------------------------------------------------
+	void FreeListStorage::_log(const void* const ptr, CSize blockNum, const bool isAllocation)
+	{
+		if (!m_traceId)
+			m_traceId = pool_trace::newPoolId(pool_trace::PoolKind::FREE_LIST_STORAGE);
+		pool_trace::record(isAllocation ? pool_trace::EventOp::ALLOC : pool_trace::EventOp::FREE, m_traceId, ptr, blockNum);
+	}
+#endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
+
+	//-----------------------------------------------------------
+	void* FreeListStorage::_takeFromSegment(void* curSeg, Size actualSize)
+	{
+		Size rest = _segSize(curSeg) - actualSize;
+
+		_unindex(curSeg);
+		_erase(m_data, curSeg);
+
+		//remainder which can't hold segment metadata stays with the object
+		if (rest < s_minSegSize) {
+			actualSize += rest;
+		} else {
+			void* newSeg = static_cast<char*>(curSeg) + actualSize;
+			_segSize(newSeg) = rest;
+			_insert(m_data, newSeg);
+			_index(newSeg);
+		}
+		_segSize(curSeg) = actualSize;
+
+		return static_cast<char*>(curSeg) + s_ptrSize;
+	}
+
+	//-----------------------------------------------------------
+	/*
+	freed block has to be big enough to become a node of the treap
+	*/
+	Size FreeListStorage::_actualSize(CSize size)
+	{
+		CSize minObjSize = s_minSegSize - s_ptrSize;
+		Size minS = size < minObjSize ? minObjSize : size;
+		Size mod = minS % s_ptrSize;
+		return minS
+			+ (mod ? s_ptrSize - mod : 0)
+			+ s_ptrSize;
+	}
+
+	//-----------------------------------------------------------
+	void* FreeListStorage::_findFit(CSize actualSize) const
+	{
+		switch (m_policy) {
+		case PlacementPolicy::NEXT_FIT: {
+			//search after the previous object, then wrap around
+			void* seg = _firstFit(m_data, actualSize, m_rover);
+			return seg || !m_rover ? seg : _firstFit(m_data, actualSize, nullptr);
+		}
+		case PlacementPolicy::BEST_FIT:
+		case PlacementPolicy::GOOD_FIT:
+			return _findIndexedFit(actualSize);
+		default:
+			return _firstFit(m_data, actualSize, nullptr);
+		}
+	}
+
+	//-----------------------------------------------------------
+	void* FreeListStorage::_findIndexedFit(CSize actualSize) const
+	{
+		if (m_policy == PlacementPolicy::BEST_FIT) {
+			auto it = m_bySize.lower_bound(std::make_pair(actualSize, static_cast<void*>(nullptr)));
+			return it != m_bySize.end() ? it->second : nullptr;
+		}
+
+		//every hole of the bin which starts at the next power of two fits
+		CSize bin = _bin(actualSize);
+		CSize firstFitting = (Size(1) << bin) == actualSize ? bin : bin + 1;
+		for (Size i = firstFitting; i < sizeof(Size) * 8; i++) {
+			if (!m_bins[i].empty())
+				return *m_bins[i].begin();
+		}
+
+		//holes of the own bin can be smaller than the object
+		for (void* seg : m_bins[bin]) {
+			if (_segSize(seg) >= actualSize)
+				return seg;
+		}
+		return nullptr;
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::_index(void* const seg)
+	{
+		CSize size = _segSize(seg);
+		m_freeSpace.holes[_bin(size)]++;
+		m_freeSpace.holesNumber++;
+		m_freeSpace.freeBytes += size;
+
+		if (m_policy == PlacementPolicy::BEST_FIT) {
+			m_bySize.insert(std::make_pair(size, seg));
+		} else if (m_policy == PlacementPolicy::GOOD_FIT) {
+			m_bins[_bin(size)].insert(seg);
+		}
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::_unindex(void* const seg)
+	{
+		CSize size = _segSize(seg);
+		m_freeSpace.holes[_bin(size)]--;
+		m_freeSpace.holesNumber--;
+		m_freeSpace.freeBytes -= size;
+
+		if (m_policy == PlacementPolicy::BEST_FIT) {
+			m_bySize.erase(std::make_pair(size, seg));
+		} else if (m_policy == PlacementPolicy::GOOD_FIT) {
+			m_bins[_bin(size)].erase(seg);
+		}
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::_rebuildIndex()
+	{
+		m_bySize.clear();
+		for (std::set<void*>& bin : m_bins)
+			bin.clear();
+		m_freeSpace = FreeSpaceStats{};
+
+		for (void* seg = _upper(nullptr); seg; seg = _upper(seg))
+			_index(seg);
+	}
+
+	//-----------------------------------------------------------
+	Size FreeListStorage::_bin(CSize size)
+	{
+		return highestBit(size);
+	}
+
+	//-----------------------------------------------------------
+	void* FreeListStorage::_lower(const void* ptr) const
+	{
+		void* res = nullptr;
+		for (void* node = m_data; node; ) {
+			if (node < ptr) {
+				res = node;
+				node = _right(node);
+			} else {
+				node = _left(node);
+			}
+		}
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	//nullptr - the first segment
+	void* FreeListStorage::_upper(const void* ptr) const
+	{
+		void* res = nullptr;
+		for (void* node = m_data; node; ) {
+			if (!ptr || ptr < node) {
+				res = node;
+				node = _left(node);
+			} else {
+				node = _right(node);
+			}
+		}
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	/*
+	subtrees which can't fit the size are skipped by their max size,
+	subtrees before from are skipped by address
+	*/
+	void* FreeListStorage::_firstFit(void* node, CSize size, const void* from)
+	{
+		if (!node || _maxSize(node) < size)
+			return nullptr;
+
+		if (node >= from) {
+			void* res = _firstFit(_left(node), size, from);
+			if (res)
+				return res;
+			if (_segSize(node) >= size)
+				return node;
+		}
+		return _firstFit(_right(node), size, from);
+	}
+
+	//-----------------------------------------------------------
+	Size FreeListStorage::_priority(const void* node)
+	{
+		//fibonacci hashing spreads aligned addresses over the whole range
+		return static_cast<Size>((reinterpret_cast<size_t>(node) >> 3) * static_cast<Size>(0x9E3779B97F4A7C15ull));
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::_update(void* node)
+	{
+		Size maxSize = _segSize(node);
+		if (_left(node) && _maxSize(_left(node)) > maxSize)
+			maxSize = _maxSize(_left(node));
+		if (_right(node) && _maxSize(_right(node)) > maxSize)
+			maxSize = _maxSize(_right(node));
+		_maxSize(node) = maxSize;
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::_split(void* node, const void* key, void*& l, void*& r)
+	{
+		if (!node) {
+			l = r = nullptr;
+		} else if (node < key) {
+			_split(_right(node), key, _right(node), r);
+			_update(node);
+			l = node;
+		} else {
+			_split(_left(node), key, l, _left(node));
+			_update(node);
+			r = node;
+		}
+	}
+
+	//-----------------------------------------------------------
+	void* FreeListStorage::_merge(void* l, void* r)
+	{
+		if (!l || !r)
+			return l ? l : r;
+
+		if (_priority(l) > _priority(r)) {
+			_right(l) = _merge(_right(l), r);
+			_update(l);
+			return l;
+		}
+		_left(r) = _merge(l, _left(r));
+		_update(r);
+		return r;
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::_insert(void*& root, void* node)
+	{
+		if (!root || _priority(node) > _priority(root)) {
+			_split(root, node, _left(node), _right(node));
+			_update(node);
+			root = node;
+			return;
+		}
+
+		_insert(node < root ? _left(root) : _right(root), node);
+		_update(root);
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::_erase(void*& root, void* const seg)
+	{
+		if (root == seg) {
+			root = _merge(_left(seg), _right(seg));
+			return;
+		}
+
+		_erase(seg < root ? _left(root) : _right(root), seg);
+		_update(root);
+	}
+
+	//-----------------------------------------------------------
+	void FreeListStorage::_resize(void* root, void* const seg, CSize size)
+	{
+		if (root == seg) {
+			_segSize(seg) = size;
+		} else {
+			_resize(seg < root ? _left(root) : _right(root), seg, size);
+		}
+		_update(root);
+	}
+
+	//-----------------------------------------------------------
+	HeapStorage::HeapStorage()
+		:m_slabPagesEpoch{ 0u }
+		,m_data{ nullptr }
+		,m_currentSize{ 0u }
+		,m_maxSize{ 0u }	
+		,m_reservedSize{ 0u }
+		,m_liveIndexVersion{ 0u }
+		,m_defragIdx{ 0u }
+		,m_deferredFree{ false }
+		,m_stats{}
+	{
+	}
+
+	//-----------------------------------------------------------
+	HeapStorage::~HeapStorage()
+	{
+#if HEAP_BASED_POOL_ENABLE_CHECKED
+		pool_check::onReset(this);
+#endif// HEAP_BASED_POOL_ENABLE_CHECKED
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		_releaseGuarded();
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		_freeRegion();
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::init(CSize size)
+	{
+		if (m_data) {
+			printf_s("HeapStorage is already initialized!\n");
+			return;
+		}
+
+		m_data = _allocRegion(size, m_reservedSize);
+		if (!m_data) {
+			printf_s("Bad alloc, malloc has returned nullptr!\n");
+			return;
+		}
+
+		//segments keep pointers at their ends, so the heap ends on a word boundary
+		m_maxSize = size & ~(s_ptrSize - 1);
+		m_storage.addBLock(m_data, m_maxSize);
+	}
+
+	//-----------------------------------------------------------
+	void* HeapStorage::malloc(CSize size)
+	{
+#if HEAP_BASED_POOL_ENABLE_LATENCY
+		//includes defragmentation and growth of the heap when they are triggered by the call
+		pool_latency::Scope latency{ pool_latency::PoolKind::HEAP_STORAGE, pool_latency::Op::MALLOC, size };
+#endif// HEAP_BASED_POOL_ENABLE_LATENCY
+		if (!m_data) {
+			printf_s("Heap storage isn't initialized!\n");
+			m_stats.failedAllocations++;
+			return nullptr;
+		}
+
+#if HEAP_BASED_POOL_ENABLE_CANARY
+		char* res = static_cast<char*>(_malloc(size + HEAP_BASED_POOL_CANARY_SIZE + s_ptrSize));
+		if (res)
+			_fillCanary(res, size, _objSize(res));
+#else
+		void* res = _malloc(size);
+#endif// HEAP_BASED_POOL_ENABLE_CANARY
+		if (!res) {
+			m_stats.failedAllocations++;
+			return nullptr;
+		}
+#if HEAP_BASED_POOL_ENABLE_CHECKED
+		pool_check::onAlloc(this, res, size, POOL_CHECK_CALLER());
+#endif// HEAP_BASED_POOL_ENABLE_CHECKED
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	void* HeapStorage::_malloc(CSize size)
+	{
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		if (size >= HEAP_BASED_POOL_GUARDED_OBJECT_SIZE)
+			return _mallocGuarded(size);
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+
+#if HEAP_BASED_POOL_SMALL_OBJECT_SIZE
+		if (size != 0u && size <= HEAP_BASED_POOL_SMALL_OBJECT_SIZE) {
+			void* res = _slabMalloc(size);
+			if (res) {
+				_countAllocation(s_slabSizes[_slabClass(size)]);
+				return res;
+			}
+		}
+#endif
+
+		void* res = _mallocBlock(size);
+		if (res)
+			_countAllocation(m_storage.getObjSizeInBytes(res));
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	Size HeapStorage::_objSize(void* ptr)
+	{
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		std::map<const void*, Size>::const_iterator guarded = m_guarded.find(ptr);
+		if (guarded != m_guarded.end())
+			return guarded->second;
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+#if HEAP_BASED_POOL_SMALL_OBJECT_SIZE
+		CSize idx = _findSlabPage(ptr);
+		if (idx != m_slabPages.size())
+			return _slabPageAt(idx)->objSize;
+#endif
+		return m_storage.getObjSizeInBytes(ptr);
+	}
+
+#if HEAP_BASED_POOL_ENABLE_CANARY
+	//-----------------------------------------------------------
+	void HeapStorage::_fillCanary(char* obj, CSize size, CSize objSize)
+	{
+		pool_canary::fill(obj + size, objSize - s_ptrSize - size);
+		*reinterpret_cast<Size*>(obj + objSize - s_ptrSize) = size;
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::_checkCanary(void* ptr)
+	{
+		char* obj = static_cast<char*>(ptr);
+		CSize objSize = _objSize(ptr);
+		CSize maxSize = objSize - s_ptrSize - HEAP_BASED_POOL_CANARY_SIZE;
+		Size size = *reinterpret_cast<Size*>(obj + objSize - s_ptrSize);
+		//long overrun overwrites the size too, at least the minimal canary before it is checked then
+		if (size > maxSize)
+			size = maxSize;
+		pool_canary::check("HeapStorage", ptr, obj + size, objSize - s_ptrSize - size);
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::_moveCanary(char* obj, CSize copiedSize, CSize objSize)
+	{
+		_fillCanary(obj, *reinterpret_cast<Size*>(obj + copiedSize - s_ptrSize), objSize);
+	}
+#endif// HEAP_BASED_POOL_ENABLE_CANARY
+
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+	//-----------------------------------------------------------
+	void* HeapStorage::_mallocGuarded(CSize size)
+	{
+		//object ends right before the guard page
+		CSize objSize = (size + s_guardedAlignment - 1u) & ~(s_guardedAlignment - 1u);
+		CSize dataSize = roundUpToPage(objSize);
+		CSize rangeSize = dataSize + roundUpToPage(1u);
+
+		char* range = static_cast<char*>(reserveRange(rangeSize));
+		if (!range) {
+			printf_s("Cannot reserve guarded object with size[%zu]\n", size);
+			return nullptr;
+		}
+		if (!commitRange(range, dataSize)) {
+			printf_s("Cannot commit guarded object with size[%zu]\n", size);
+			releaseRange(range, rangeSize);
+			return nullptr;
+		}
+
+		char* res = range + dataSize - objSize;
+		m_guarded.emplace(res, objSize);
+		_countAllocation(objSize);
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	bool HeapStorage::_freeGuarded(void* ptr)
+	{
+		std::map<const void*, Size>::iterator guarded = m_guarded.find(ptr);
+		if (guarded == m_guarded.end())
+			return false;
+
+#if HEAP_BASED_POOL_ENABLE_CANARY
+		_checkCanary(ptr);
+#endif// HEAP_BASED_POOL_ENABLE_CANARY
+		m_stats.frees++;
+		m_stats.bytesInUse -= guarded->second;
+		releaseRange(guardedRange(ptr), guardedRangeSize(ptr, guarded->second));
+		m_guarded.erase(guarded);
+		return true;
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::_releaseGuarded()
+	{
+		for (const std::pair<const void* const, Size>& guarded : m_guarded)
+			releaseRange(guardedRange(guarded.first), guardedRangeSize(guarded.first, guarded.second));
+		m_guarded.clear();
+	}
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+
+	//-----------------------------------------------------------
+	void* HeapStorage::_mallocBlock(CSize size)
+	{
+		if (size + s_ptrSize > m_maxSize - m_currentSize) {
+			if (!_reinit(size + s_ptrSize + s_ptrSize)) {/*obj size + meta data about obj + metadata about FreeListStorage*/
+
+				printf_s("There isn't enough space in HeapStorage. Required spase is[%zu], and current space is[%zu], and max space is[%zu]\n",
+					size + s_ptrSize, m_currentSize, m_maxSize);
+				return nullptr;
+			}
+		}
+
+		void* res = m_storage.malloc(size);
+		if (res){
+			Size oS = m_storage.getObjSizeInBytes(res) + s_ptrSize;
+			m_currentSize += oS;
+		} else {
+			//try defragment, compaction overwrites objects in place, so it's not allowed while they can be read
+			if (!m_deferredFree && _canDefragment(size + s_ptrSize)) {
+				_defragment();
+				res = m_storage.malloc(size);
+			}
+			/*
+			free memory is too fragmented(slab pages need contiguous blocks) or metadata of the engine(sentinel of TLSF)
+			takes the bytes which the request lacks, grow the heap
+			*/
+			if (!res && _reinit(size + s_ptrSize + s_ptrSize))
+				res = m_storage.malloc(size);
+			if (!res) {
+				printf_s("Bad alloc after defragmetation, malloc has returned nullptr!\n");
+				DEBUG_DumpAllFreeMemory();
+				return res;
+			}
+			m_currentSize += m_storage.getObjSizeInBytes(res) + s_ptrSize;
+		}
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::free(void* ptr)
+	{
+#if HEAP_BASED_POOL_ENABLE_CHECKED
+		//frees after cleanAll are ignored as in unchecked mode, entries of the heap are already dropped
+		if (ptr && m_data && pool_check::onFree(this, ptr, contains(ptr), POOL_CHECK_CALLER()) != pool_check::Error::NONE)
+			return;
+#endif// HEAP_BASED_POOL_ENABLE_CHECKED
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		//guarded objects don't take memory of the heap
+		if (ptr && _freeGuarded(ptr))
+			return;
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		if (!ptr || m_currentSize == 0u) 
+			return;
+
+#if HEAP_BASED_POOL_ENABLE_LATENCY
+		//size of the object is known when it's freed
+		pool_latency::Scope latency{ pool_latency::PoolKind::HEAP_STORAGE, pool_latency::Op::FREE, 0u };
+		CSize bytesInUse = m_stats.bytesInUse;
+#endif// HEAP_BASED_POOL_ENABLE_LATENCY
+
+#if HEAP_BASED_POOL_ENABLE_CANARY
+		_checkCanary(ptr);
+#endif// HEAP_BASED_POOL_ENABLE_CANARY
+		m_stats.frees++;
+#if HEAP_BASED_POOL_SMALL_OBJECT_SIZE
+		if (!_slabFree(ptr))
+#endif
+		{
+			m_stats.bytesInUse -= m_storage.getObjSizeInBytes(ptr);
+			_freeBlock(ptr);
+		}
+
+#if HEAP_BASED_POOL_ENABLE_LATENCY
+		latency.setSize(bytesInUse - m_stats.bytesInUse);
+#endif// HEAP_BASED_POOL_ENABLE_LATENCY
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::_freeBlock(void* ptr)
+	{
+		m_currentSize -= m_storage.getObjSizeInBytes(ptr) + s_ptrSize;
+		m_storage.free(ptr);
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::DEBUG_DumpAllFreeMemory()
+	{
+#if not defined (NDEBUG)
+		void* nextHole;
+		void* start = nullptr;
+		Size holeSize;
+		printf_s("*************************************************************\n");
+		printf_s("[DEBUG] Dump all free memory\n");
+		do {
+			m_storage.getNextHole(nextHole, holeSize, start);
+			if (nextHole)
+			{
+				printf_s("[DEBUG] Memory block start [0x%p] -> memory block end [0x%p], block size [%zu]\n", 
+					nextHole, static_cast<char*>(nextHole) + holeSize, holeSize);
+				start = nextHole;
+			}
+		} while (nextHole != nullptr);
+		printf_s("[DEBUG] Current size[%zu], Max size[%zu]\n", m_currentSize, m_maxSize);
+		printf_s("*************************************************************\n");
+#endif
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::cleanAll()
+	{
+		if (m_data) {
+#if HEAP_BASED_POOL_ENABLE_CHECKED
+			pool_check::onReset(this);
+#endif// HEAP_BASED_POOL_ENABLE_CHECKED
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+			_releaseGuarded();
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+			_clearSlabs();
+			_freeRegion();
+			m_currentSize = m_maxSize = 0u;
+			m_storage.reinit(nullptr);
+			m_liveIndex.clear();
+			m_defragIdx = 0u;
+			std::vector<char>().swap(m_relocBuffer);
+			m_retired.clear();
+			m_stats = HeapStats{};
+		}
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::setDeferredFree(const bool enabled)
+	{
+		m_deferredFree = enabled;
+		if (!enabled)
+			freeRetired(m_retired.size());
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::freeRetired(CSize number)
+	{
+		CSize n = std::min(number, m_retired.size());
+		for (Size i = 0; i < n; i++)
+			_freeBlock(m_retired[i]);
+		m_retired.erase(m_retired.begin(), m_retired.begin() + n);
+	}
+
+	//-----------------------------------------------------------
+	DefragReport HeapStorage::defragmentStep(CSize byteBudget, CSize timeBudgetUs /*0*/)
+	{
+		typedef std::chrono::steady_clock Clock;
+		const Clock::time_point deadline = Clock::now() + std::chrono::microseconds(timeBudgetUs);
+
+		DefragReport report{ 0u, 0u, 0.0f, 0.0f, false };
+		if (!m_data)
+			return report;
+
+		report.fragmentationBefore = getFragmentation();
+		m_stats.defragSteps++;
+
+		if (m_liveIndex.empty() || m_liveIndexVersion != GetHandleManager().version())
+			_buildLiveIndex();
+
+		Size idx = m_defragIdx;
+		while (idx < m_liveIndex.size() && report.bytesMoved < byteBudget) {
+			if (timeBudgetUs && Clock::now() >= deadline)
+				break;
+
+			Size moved = report.bytesMoved;
+			idx = _moveObject(idx, report.bytesMoved);
+			if (moved != report.bytesMoved)
+				report.objectsMoved++;
+		}
+
+		//cached pointers of handles have to be resolved again
+		if (report.objectsMoved)
+			GetHandleManager().onRelocation();
+
+		if (idx < m_liveIndex.size()) {
+			m_defragIdx = idx;
+		} else {
+			//moved objects broke the order of the index
+			m_liveIndex.clear();
+			m_defragIdx = 0u;
+			report.passFinished = true;
+		}
+
+		m_stats.objectsMoved += report.objectsMoved;
+		m_stats.bytesMoved += report.bytesMoved;
+		report.fragmentationAfter = getFragmentation();
+		return report;
+	}
+
+	//-----------------------------------------------------------
+	DefragReport HeapStorage::compact()
+	{
+		DefragReport report{ 0u, 0u, 0.0f, 0.0f, true };
+		if (!m_data)
+			return report;
+
+		//caller guarantees that nobody reads moved objects
+		freeRetired(m_retired.size());
+
+		report.fragmentationBefore = getFragmentation();
+
+		//holes are collected in advance, because moved objects overwrite their metadata
+		std::vector<Hole> holes;
+		_collectHoles(holes);
+
+		_buildLiveIndex();
+
+		char* dst = static_cast<char*>(m_data);
+		Size newHoles = 0u;
+
+		char* end = _forEachUsedBlock(holes, [&](char* block, CSize blockSize, LiveObject* first, LiveObject* last) {
+			if (first != last && _canMove(block + s_ptrSize, first, last)) {
+				//slide object down together with all handles pointing into it
+				if (dst != block) {
+					_relocate(dst, block, blockSize, first, last);
+					for (; first != last; first++) {
+						first->ptr = dst + (static_cast<char*>(first->ptr) - block);
+						first->slot->ptr = first->ptr;
+					}
+					report.bytesMoved += blockSize;
+					report.objectsMoved++;
+				}
+				dst += blockSize;
+			} else {
+				//object isn't referenced by handles, is pinned or is a slab page with raw objects
+				if (dst != block)
+					holes[newHoles++] = Hole{ dst, static_cast<Size>(block - dst) };
+				dst = block + blockSize;
+			}
+		});
+
+		if (dst != end)
+			holes[newHoles++] = Hole{ dst, static_cast<Size>(end - dst) };
+
+		m_storage.rebuild(holes.data(), newHoles);
+		if (report.objectsMoved)
+			GetHandleManager().onRelocation();
+
+		//sliding keeps the order of objects, thus index is still valid
+		m_defragIdx = 0u;
+
+		m_stats.compactions++;
+		m_stats.objectsMoved += report.objectsMoved;
+		m_stats.bytesMoved += report.bytesMoved;
+
+		report.fragmentationAfter = getFragmentation();
+		return report;
+	}
+
+	//-----------------------------------------------------------
+	float HeapStorage::getFragmentation() const
+	{
+		CSize totalFree = m_storage.getFreeBytes();
+		return totalFree ? 1.0f - static_cast<float>(m_storage.getLargestHole()) / totalFree : 0.0f;
+	}
+
+	//-----------------------------------------------------------
+	bool HeapStorage::needsDefragmentation(const DefragTrigger& trigger) const
+	{
+		CSize totalFree = m_storage.getFreeBytes();
+		CSize largestHole = m_storage.getLargestHole();
+		//all free memory is in one hole already
+		if (largestHole == totalFree)
+			return false;
+
+		return 1.0f - static_cast<float>(largestHole) / totalFree > trigger.fragmentation
+			|| (trigger.holesNumber && m_storage.getFreeSpace().holesNumber > trigger.holesNumber)
+			|| (trigger.largestHole && largestHole < trigger.largestHole && totalFree >= trigger.largestHole);
+	}
+
+	//-----------------------------------------------------------
+	HeapStats HeapStorage::stats() const
+	{
+		HeapStats res = m_stats;
+		res.heapUsed = m_currentSize;
+		res.heapSize = m_maxSize;
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	bool HeapStorage::_reinit(CSize requestedSize)
+	{
+		//calculate new size
+		Size newMaxSize = m_maxSize;
+		constexpr CSize maxSize = std::numeric_limits<Size>::max();
+
+		//grow at least once, free space can be too fragmented for the request
+		while ((newMaxSize == m_maxSize || requestedSize > newMaxSize - m_currentSize) &&
+			maxSize - newMaxSize > newMaxSize / 2)
+		{
+			//rounding down to a word keeps tiny heaps(8 + 4 -> 8) at the same size, so they grow by a word at least
+			newMaxSize = std::max(newMaxSize + s_ptrSize, (newMaxSize + newMaxSize / 2) & ~(s_ptrSize - 1));
+		}
+		
+		if (maxSize - newMaxSize < newMaxSize / 2 ||
+			requestedSize > newMaxSize - m_currentSize) {
+			printf_s("Cannot add more memory, it will exceed limit!"
+				"Current size[%zu], MaxSize[%zu], RequestedSize[%zu]\n", 
+				m_currentSize, m_maxSize, requestedSize);
+			return false;
+		}
+
+		//cheap path, objects stay in place
+		if (newMaxSize <= m_reservedSize) {
+			if (!_grow(newMaxSize))
+				return false;
+			m_stats.reinits++;
+			return true;
+		}
+
+		if (GetHandleManager().pinsNumber()) {
+			printf_s("Cannot move objects to the new region while some of them are pinned!\n");
+			return false;
+		}
+
+		if (m_deferredFree) {
+			printf_s("Cannot move objects to the new region while they can be read, reserved size[%zu] is exhausted!\n", m_reservedSize);
+			return false;
+		}
+		
+		std::vector<Hole> holes;
+		_collectHoles(holes);
+		_buildLiveIndex();
+
+		//raw pointers to small objects can't be updated, so a page with such objects keeps the heap in place
+		bool canCopy = true;
+		_forEachUsedBlock(holes, [&](char* block, CSize, LiveObject* first, LiveObject* last) {
+			canCopy = canCopy && (!_asSlabPage(block + s_ptrSize, first, last) || _canMove(block + s_ptrSize, first, last));
+		});
+		if (!canCopy) {
+			printf_s("Cannot move objects to the new region while slab pages keep objects without handles, reserved size[%zu] is exhausted!\n", m_reservedSize);
+			return false;
+		}
 
-		Size minS = size < s_ptrSize ? s_ptrSize : size;
-		Size mod = s_ptrSize % minS;
-		Size actualSize = minS
-			+ (mod ? s_ptrSize - mod : 0)
-			+ s_ptrSize;
+		Size newReservedSize = 0u;
+		char* newData = static_cast<char*>(_allocRegion(newMaxSize, newReservedSize));
+		
+		if (!newData) {
+			printf_s("Bad alloc, malloc has returned nullptr!\n");
+			return false;
+		}
+
+		StorageEngine newStorage;
+		newStorage.addBLock(newData, newMaxSize);
 
-		void* curSeg = m_data;
-		void* prevSeg = _tryMallocN(curSeg, actualSize);
+		//copy objects referenced by handles, handles pointing inside of the object move together with it
+		Size newCurrentSize = 0u;
+		_forEachUsedBlock(holes, [&](char* block, CSize blockSize, LiveObject* first, LiveObject* last) {
+			if (first == last)
+				return;
 
-		if (curSeg) {
-			void* newBlockStart = nullptr;
-			if (_segSize(curSeg) - actualSize != 0u || 
-				_nextSeg(curSeg)) {
-				newBlockStart = static_cast<char*>(curSeg) + actualSize;
-				_segSize(newBlockStart) = _segSize(curSeg) - actualSize;
+			char* oldObj = block + s_ptrSize;
+			//slab page keeps canaries of its slots and isn't counted in use, new block can be bigger only for an object
+			const bool isObject = !_asSlabPage(oldObj, first, last);
+			char* obj = static_cast<char*>(newStorage.malloc(blockSize - s_ptrSize));
+			_relocate(obj, oldObj, blockSize - s_ptrSize, first, last);
+			if (isObject) {
+#if HEAP_BASED_POOL_ENABLE_CANARY
+				_moveCanary(obj, blockSize - s_ptrSize, newStorage.getObjSizeInBytes(obj));
+#endif// HEAP_BASED_POOL_ENABLE_CANARY
+				m_stats.bytesInUse += newStorage.getObjSizeInBytes(obj) - (blockSize - s_ptrSize);
 			}
-			if (prevSeg && prevSeg != curSeg) {
-				_nextSeg(prevSeg) = newBlockStart;
-			} else if (curSeg == m_data) {
-				m_data = newBlockStart;
+			for (; first != last; first++) {
+				first->ptr = obj + (static_cast<char*>(first->ptr) - oldObj);
+				first->slot->ptr = first->ptr;
 			}
-			_segSize(curSeg) = actualSize;
+			newCurrentSize += newStorage.getObjSizeInBytes(obj) + s_ptrSize;
+		});
+		
+		_freeRegion();
+		m_data = newData;
+		m_reservedSize = newReservedSize;
 
-#if HEAP_BASED_POOL_ENABLE_MEM_LOG
-			_log(static_cast<char*>(curSeg) + s_ptrSize, actualSize , true);
-#endif
+		m_storage.reinit(&newStorage);
+		GetHandleManager().onRelocation();
 
-			return static_cast<char*>(curSeg) + s_ptrSize;
-		}
+		m_maxSize = newMaxSize;
+		m_currentSize = newCurrentSize;
 
-		return nullptr;
+		m_liveIndex.clear();
+		m_defragIdx = 0u;
+		m_stats.reinits++;
+		return true;
 	}
-	
+
 	//-----------------------------------------------------------
-	void FreeListStorage::free(void* ptr)
+	bool HeapStorage::_grow(CSize newMaxSize)
 	{
-		if (!ptr)
-			return;
+		//pages of the old end are committed already
+		CSize committed = roundUpToPage(m_maxSize);
+		if (newMaxSize > committed &&
+			!commitRange(static_cast<char*>(m_data) + committed, roundUpToPage(newMaxSize) - committed)) {
+			printf_s("Cannot commit memory, requested size[%zu]\n", newMaxSize);
+			return false;
+		}
 
-		void* actualAddres = static_cast<char*>(ptr) - s_ptrSize;
-#if HEAP_BASED_POOL_ENABLE_MEM_LOG
-		_log(static_cast<char*>(ptr), *static_cast<size_t*>(actualAddres), false);
-#endif
-		addBLock(actualAddres, _segSize(actualAddres));
+		m_storage.addBLock(static_cast<char*>(m_data) + m_maxSize, newMaxSize - m_maxSize);
+		m_maxSize = newMaxSize;
+		return true;
 	}
 
 	//-----------------------------------------------------------
-	void FreeListStorage::addBLock(void* ptr, CSize size)
+	void* HeapStorage::_allocRegion(CSize size, Size& reservedSize) const
 	{
-		void* pos = _findPrev(ptr);
-		if (!pos)
-			m_data = _makeList(ptr, m_data, size);
-		else {
-			void* nextSeg = _makeList(ptr, _nextSeg(pos), size);
-			if (static_cast<char*>(pos) + _segSize(pos) == nextSeg) {
-				_segSize(pos) += _segSize(nextSeg);
-			} else {
-				_nextSeg(pos) = nextSeg;
+		reservedSize = 0u;
+
+		//every next reservation is twice bigger, so the copying path is rare
+		Size toReserve = HEAP_BASED_POOL_RESERVE_SIZE;
+		if (toReserve && toReserve < m_reservedSize * 2)
+			toReserve = m_reservedSize * 2;
+
+		if (toReserve >= size) {
+			toReserve = roundUpToPage(toReserve);
+			void* ptr = reserveRange(toReserve);
+			if (ptr && commitRange(ptr, roundUpToPage(size))) {
+				reservedSize = toReserve;
+				return ptr;
 			}
+			if (ptr)
+				releaseRange(ptr, toReserve);
 		}
+
+		return std::malloc(size);
 	}
 
 	//-----------------------------------------------------------
-	void* FreeListStorage::_findPrev(void* const ptr) const
+	void HeapStorage::_freeRegion()
 	{
-		if (!m_data || ptr < m_data)
-			return nullptr;
+		if (!m_data)
+			return;
 
-		void* iter = m_data;
-		void* next = nullptr;
-		while (true) {
-			next = _nextSeg(iter);
-			if (!next || ptr < next)
-				return iter;
-			iter = next;
+		if (m_reservedSize) {
+			releaseRange(m_data, m_reservedSize);
+		} else {
+			std::free(m_data);
 		}
+		m_data = nullptr;
+		m_reservedSize = 0u;
 	}
 
 	//-----------------------------------------------------------
-	void FreeListStorage::reinit(FreeListStorage* ptr)
+	bool HeapStorage::_hasRelocateFn(const LiveObject* first, const LiveObject* last)
 	{
-		m_data = ptr ? ptr->m_data : nullptr;
+		for (; first != last; first++) {
+			if (first->slot->relocate)
+				return true;
+		}
+		return false;
 	}
 
-	//defragmentation functionality
-	
 	//-----------------------------------------------------------
-	void FreeListStorage::getNextHole(void*& nextHole, Size& holeSize, void* start /*nullptr*/) const
+	bool HeapStorage::_isPinned(const LiveObject* first, const LiveObject* last)
 	{
-		nextHole = start != nullptr ? _nextSeg(start) : m_data;
-		if (nextHole)
-			holeSize = _segSize(nextHole);
+		for (; first != last; first++) {
+			if (first->slot->pins)
+				return true;
+		}
+		return false;
 	}
 
-#if  HEAP_BASED_POOL_ENABLE_MEM_LOG
 	//-----------------------------------------------------------
-	void FreeListStorage::_log(const void* const ptr, CSize blockNum, const bool isAllocation)
+	bool HeapStorage::_canMove(const char* obj, const LiveObject* first, const LiveObject* last) const
 	{
-		//memory location
-		//size of allocated memory in blocks
-		printf_s("*************************************************************\n");
-		printf_s("At memory location[%p] has been %s [%zu] bytes of memory\n",
-			ptr,
-			isAllocation ? "allocated" : "freed",
-			blockNum);
+		if (_isPinned(first, last))
+			return false;
+
+		const SlabPage* page = _asSlabPage(obj, first, last);
+		if (!page)
+			return true;
+
+		//raw pointers can't be updated, so every used slot of the page has to be referenced by a handle
+		Size referenced = 0u;
+		Size prevSlot = s_invalidId;
+		for (first++; first != last; first++) {
+			CSize slot = (static_cast<const char*>(first->ptr) - obj - sizeof(SlabPage)) / page->objSize;
+			if (slot != prevSlot) {
+				referenced++;
+				prevSlot = slot;
+			}
+		}
+		return referenced >= page->used;
 	}
-#endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
 
 	//-----------------------------------------------------------
-	void* FreeListStorage::_makeList(void* const begin, void* const end, CSize size)
+	void HeapStorage::_relocate(char* dst, char* src, CSize size, const LiveObject* first, const LiveObject* last)
 	{
-		Size totalSize = size;
-		void* nextSeg = end;
-		if (static_cast<char*>(begin) + size == end) {
-			totalSize += _segSize(end);
-			nextSeg = _nextSeg(end);
+#if HEAP_BASED_POOL_ENABLE_CHECKED
+		//only objects referenced by handles are moved, objects of a slab page are tracked, the page itself isn't
+		const void* prevTracked = nullptr;
+		for (const LiveObject* tracked = first; tracked != last; tracked++) {
+			if (tracked->ptr != prevTracked) {
+				pool_check::onMove(this, tracked->ptr, dst + (static_cast<char*>(tracked->ptr) - src));
+				prevTracked = tracked->ptr;
+			}
+		}
+#endif// HEAP_BASED_POOL_ENABLE_CHECKED
+		const LiveObject* obj = first;
+		while (obj != last && !obj->slot->relocate)
+			obj++;
+
+		//fast path, all objects are trivially copyable
+		if (obj == last) {
+			std::memmove(dst, src, size);
+			return;
+		}
+
+		//bytes which don't belong to relocatable objects(headers, POD elements) are copied as is
+		auto move = [&](char* to, char* from) {
+			std::memcpy(to, from, size);
+			const void* prev = nullptr;
+			for (obj = first; obj != last; obj++) {
+				if (obj->slot->relocate && obj->ptr != prev) {
+					CSize offset = static_cast<char*>(obj->ptr) - src;
+					obj->slot->relocate(to + offset, from + offset);
+					prev = obj->ptr;
+				}
+			}
+		};
+
+		if (dst < src + size && src < dst + size) {
+			//overlapping objects can't be move constructed in place, move them twice via buffer
+			if (m_relocBuffer.size() < size)
+				m_relocBuffer.resize(size);
+			move(m_relocBuffer.data(), src);
+			move(dst, m_relocBuffer.data());
+		} else {
+			move(dst, src);
 		}
-		_segSize(begin) = totalSize;
-		_nextSeg(begin) = nextSeg;
-		return begin;
 	}
 
 	//-----------------------------------------------------------
-	void* FreeListStorage::_tryMallocN(void*& begin, Size n)
+	void HeapStorage::_collectHoles(std::vector<Hole>& holes) const
 	{
-		Size segSize = 0u;
-		void* prev = nullptr;
-		while(begin) {
-			segSize = _segSize(begin);
-			if (segSize >= n)
-				break;
-			prev = begin;
-			begin = _nextSeg(begin);
-		}
-		return prev;
+		Hole hole{ nullptr, 0u };
+		while (m_storage.getNextHole(hole.ptr, hole.size, hole.ptr), hole.ptr != nullptr)
+			holes.push_back(hole);
 	}
 
 	//-----------------------------------------------------------
-	HeapStorage::HeapStorage()
-		:m_data{ nullptr }
-		,m_currentSize{ 0u }
-		,m_maxSize{ 0u }	
+	template<typename Func>
+	char* HeapStorage::_forEachUsedBlock(const std::vector<Hole>& holes, Func func)
 	{
+		char* const end = static_cast<char*>(m_data) + m_maxSize;
+		char* block = static_cast<char*>(m_data);
+		Size holeIdx = 0u;
+		Size idx = 0u;
+
+		while (block < end) {
+			if (holeIdx < holes.size() && holes[holeIdx].ptr == block) {
+				block += holes[holeIdx++].size;
+				continue;
+			}
+
+			char* obj = block + s_ptrSize;
+			CSize blockSize = m_storage.getObjSizeInBytes(obj) + s_ptrSize;
+			//end of the region marker
+			if (blockSize == 0u)
+				break;
+
+			while (idx < m_liveIndex.size() && m_liveIndex[idx].ptr < obj)
+				idx++;
+			Size last = idx;
+			while (last < m_liveIndex.size() && m_liveIndex[last].ptr < block + blockSize)
+				last++;
+
+			func(block, blockSize, m_liveIndex.data() + idx, m_liveIndex.data() + last);
+
+			idx = last;
+			block += blockSize;
+		}
+		return block;
 	}
 
 	//-----------------------------------------------------------
-	HeapStorage::~HeapStorage()
+	void HeapStorage::_defragment()
 	{
-		if (m_data) {
-			std::free(m_data);
-			m_data = nullptr;
-		}
+		compact();
 	}
 
 	//-----------------------------------------------------------
-	void HeapStorage::init(CSize size)
+	void HeapStorage::_buildLiveIndex()
 	{
-		if (m_data) {
-			printf_s("HeapStorage is already initialized!\n");
-			return;
-		}
+		const char* begin = static_cast<char*>(m_data);
+		const char* end = begin + m_maxSize;
 
-		m_data = std::malloc(size);
-		if (!m_data) {
-			printf_s("Bad alloc, malloc has returned nullptr!\n");
-			return;
+		m_liveIndex.clear();
+		HandleManager::iterator b = GetHandleManager().begin();
+		HandleManager::iterator e = GetHandleManager().end();
+		for (; b != e; b++) {
+			void* ptr = b->ptr.load(std::memory_order_acquire);
+			if (ptr >= begin && ptr < end)
+				m_liveIndex.push_back(LiveObject{ ptr, &*b });
 		}
 
-		m_storage.addBLock(m_data, size);
-		m_maxSize = size;
+		std::sort(m_liveIndex.begin(), m_liveIndex.end(), 
+			[](const LiveObject& l, const LiveObject& r) { return l.ptr < r.ptr; });
+
+		m_liveIndexVersion = GetHandleManager().version();
+
+		/*
+		pass starts again, since handles have changed, the entry at the place where previous step has stopped
+		can point inside of a block(element of an array, slot of a slab page), which has no header
+		*/
+		m_defragIdx = 0u;
 	}
 
 	//-----------------------------------------------------------
-	void* HeapStorage::malloc(CSize size)
+	/*
+	moves object to the lowest hole which fits it, handles pointing inside of the object
+	(elements of an array) are moved together with it.
+	returns index of the next object
+	*/
+	Size HeapStorage::_moveObject(Size idx, Size& bytesMoved)
 	{
-		if (!m_data) {
-			printf_s("Heap storage isn't initialized!\n");
-			return nullptr;
-		} else if (size + s_ptrSize > m_maxSize - m_currentSize) {
-			if (!_reinit(size + s_ptrSize + s_ptrSize)) {/*obj size + meta data about obj + metadata about FreeListStorage*/
+		char* oldPtr = static_cast<char*>(m_liveIndex[idx].ptr);
+		CSize objSize = m_storage.getObjSizeInBytes(oldPtr);
 
-				printf_s("There isn't enough space in HeapStorage. Required spase is[%zu], and current space is[%zu], and max space is[%zu]\n",
-					size + s_ptrSize, m_currentSize, m_maxSize);
-				return nullptr;
-			}
+		Size last = idx + 1;
+		while (last < m_liveIndex.size() && m_liveIndex[last].ptr < oldPtr + objSize)
+			last++;
+
+		if (!_canMove(oldPtr, m_liveIndex.data() + idx, m_liveIndex.data() + last))
+			return last;
+
+		//relocation hook destroys the source, which can still be read
+		if (m_deferredFree && _hasRelocateFn(m_liveIndex.data() + idx, m_liveIndex.data() + last))
+			return last;
+
+		//placement policy of the engine can choose a higher hole, so the hole below the object is asked explicitly
+		char* newPtr = static_cast<char*>(m_storage.mallocFromHole(m_storage.getHoleBelow(oldPtr, objSize), objSize));
+		if (!newPtr)
+			return last;
+
+		//handles are pinned without locks, so pins wait from the last check till the new place is published
+		Size marked = idx;
+		while (marked < last && HandleManager::beginMove(*m_liveIndex[marked].slot))
+			marked++;
+		if (marked != last) {
+			for (Size i = idx; i < marked; i++)
+				HandleManager::endMove(*m_liveIndex[i].slot);
+			m_storage.free(newPtr);
+			return last;
 		}
 
-		void* res = m_storage.malloc(size);
-		if (res){
-			Size oS = m_storage.getObjSizeInBytes(res) + s_ptrSize;
-			m_currentSize += oS;
-		} else if (_canDefragment(size + s_ptrSize)) {
-			//try defragment
-			_defragment();
-			res = m_storage.malloc(size);
-			if (!res) {
-				printf_s("Bad alloc after defragmetation, malloc has returned nullptr!\n");
-				DEBUG_DumpAllFreeMemory();
-				return res;
-			}
-			m_currentSize += m_storage.getObjSizeInBytes(res) + s_ptrSize;
+		//slab page keeps canaries of its slots and isn't counted in use, new block can be bigger only for an object
+		const bool isObject = !_asSlabPage(oldPtr, m_liveIndex.data() + idx, m_liveIndex.data() + last);
+		_relocate(newPtr, oldPtr, objSize, m_liveIndex.data() + idx, m_liveIndex.data() + last);
+		if (isObject) {
+#if HEAP_BASED_POOL_ENABLE_CANARY
+			_moveCanary(newPtr, objSize, m_storage.getObjSizeInBytes(newPtr));
+#endif// HEAP_BASED_POOL_ENABLE_CANARY
+			//remainder of the hole which can't be a hole is taken by the object, free subtracts the new size
+			m_stats.bytesInUse += m_storage.getObjSizeInBytes(newPtr) - objSize;
 		}
-		return res;
+		for (Size i = idx; i < last; i++) {
+			LiveObject& obj = m_liveIndex[i];
+			obj.ptr = newPtr + (static_cast<char*>(obj.ptr) - oldPtr);
+			obj.slot->ptr = obj.ptr;
+			HandleManager::endMove(*obj.slot);
+		}
+
+		m_currentSize += m_storage.getObjSizeInBytes(newPtr) + s_ptrSize;
+		if (m_deferredFree) {
+			m_retired.push_back(oldPtr);
+		} else {
+			//slab pages index isn't updated yet, thus the old place of a page would be taken for it
+			_freeBlock(oldPtr);
+		}
+
+		bytesMoved += objSize;
+		return last;
 	}
 
 	//-----------------------------------------------------------
-	void HeapStorage::free(void* ptr)
+	Size HeapStorage::_slabClass(CSize size)
 	{
-		if (!ptr || m_currentSize == 0u) 
-			return;
-		
-		m_currentSize -= m_storage.getObjSizeInBytes(ptr) + s_ptrSize;
-		m_storage.free(ptr);
+		CSize units = (size + 7u) / 8u;
+		if (units <= 8u)
+			return units - 1u;
+		if (units <= 16u)
+			return 8u + (units - 9u) / 2u;
+		return 12u + (units - 17u) / 4u;
 	}
 
 	//-----------------------------------------------------------
-	void HeapStorage::DEBUG_DumpAllFreeMemory()
+	HeapStorage::SlabPage* HeapStorage::_slabPage(IHandle* handle)
 	{
-#if not defined (NDEBUG)
-		void* nextHole;
-		void* start = nullptr;
-		Size holeSize;
-		printf_s("*************************************************************\n");
-		printf_s("[DEBUG] Dump all free memory\n");
-		do {
-			m_storage.getNextHole(nextHole, holeSize, start);
-			if (nextHole)
-			{
-				printf_s("[DEBUG] Memory block start [0x%p] -> memory block end [0x%p], block size [%zu]\n", 
-					nextHole, static_cast<char*>(nextHole) + holeSize, holeSize);
-				start = nextHole;
-			}
-		} while (nextHole != nullptr);
-		printf_s("[DEBUG] Current size[%zu], Max size[%zu]\n", m_currentSize, m_maxSize);
-		printf_s("*************************************************************\n");
-#endif
+		return helpers::hPtr(static_cast<Handle<SlabPage>*>(handle));
 	}
 
 	//-----------------------------------------------------------
-	void HeapStorage::cleanAll()
+	const HeapStorage::SlabPage* HeapStorage::_asSlabPage(const char* obj, const LiveObject* first, const LiveObject* last)
 	{
-		if (m_data) {
-			std::free(m_data);
-			m_data = nullptr;
-			m_currentSize = m_maxSize = 0u;
-			m_storage.reinit(nullptr);
-		}
+		//handle of the page points to its beginning, thus it's the first one of the block
+		if (first == last || first->ptr != obj)
+			return nullptr;
+
+		const SlabPage* page = reinterpret_cast<const SlabPage*>(obj);
+		if (page->magic != s_slabMagic || _slabPage(page->handle) != page)
+			return nullptr;
+		return page;
 	}
 
 	//-----------------------------------------------------------
-	bool HeapStorage::_reinit(CSize requestedSize)
+	void* HeapStorage::_slabMalloc(CSize size)
 	{
-		//calculate new size
-		Size newMaxSize = m_maxSize;
-		constexpr CSize maxSize = std::numeric_limits<Size>::max();
+		if (m_slabPagesEpoch != GetHandleManager().relocationEpoch())
+			_rebuildSlabMap();
 
-		while (requestedSize > newMaxSize - m_currentSize &&
-			maxSize - newMaxSize > newMaxSize / 2)
-		{
-			newMaxSize = newMaxSize + newMaxSize / 2;
+		CSize classIdx = _slabClass(size);
+		std::vector<Size>& available = m_slabAvailable[classIdx];
+
+		SlabPage* page = available.empty() ? _newSlabPage(classIdx) : _slabPageAt(available.back());
+		if (!page)
+			return nullptr;
+
+		char* base = reinterpret_cast<char*>(page);
+		Size offset = page->freeHead;
+		if (offset) {
+			page->freeHead = *reinterpret_cast<Size*>(base + offset);
+		} else {
+			offset = page->bumpOffset;
+			page->bumpOffset += page->objSize;
 		}
-		
-		void* newData = nullptr;
 
-		if (maxSize - newMaxSize < newMaxSize / 2 ||
-			requestedSize > newMaxSize - m_currentSize) {
-			printf_s("Cannot add more memory, it will exceed limit!"
-				"Current size[%zu], MaxSize[%zu], RequestedSize[%zu]\n", 
-				m_currentSize, m_maxSize, requestedSize);
-			return false;
+		if (++page->used == page->capacity) {
+			available.pop_back();
+			page->availableIdx = s_invalidId;
 		}
-		
-		newData = std::malloc(newMaxSize);
-		
-		if (!newData) {
-			printf_s("Bad alloc, malloc has returned nullptr!\n");
+		return base + offset;
+	}
+
+	//-----------------------------------------------------------
+	bool HeapStorage::_slabFree(void* ptr)
+	{
+		CSize idx = _findSlabPage(ptr);
+		if (idx == m_slabPages.size())
 			return false;
+
+		SlabPage* page = _slabPageAt(idx);
+		m_stats.bytesInUse -= page->objSize;
+		*static_cast<Size*>(ptr) = page->freeHead;
+		page->freeHead = static_cast<char*>(ptr) - reinterpret_cast<char*>(page);
+
+		std::vector<Size>& available = m_slabAvailable[page->classIdx];
+		if (page->used-- == page->capacity) {
+			page->availableIdx = available.size();
+			available.push_back(idx);
 		}
 
-		FreeListStorage newStorage;
-		newStorage.addBLock(newData, newMaxSize);
-		
-		HandleManager::iterator b = GetHandleManager().begin();
-		HandleManager::iterator e = GetHandleManager().end();
+		//one empty page per class is kept, so alternating malloc/free doesn't create pages again and again
+		if (page->used == 0u && available.size() > 1u)
+			_releaseSlabPage(page, idx);
+		return true;
+	}
+
+	//-----------------------------------------------------------
+	HeapStorage::SlabPage* HeapStorage::_newSlabPage(CSize classIdx)
+	{
+		CSize objSize = s_slabSizes[classIdx];
+		CSize minPageSize = Size(1) << s_slabGranuleLog2;
+		CSize pageSize = std::max(minPageSize, sizeof(SlabPage) + objSize * s_slabObjectsPerPage);
 
-		for (; b != e; b++)	{
+		//page is bigger than any small object, so it's a regular block, it isn't counted as an allocation
+		void* mem = _mallocBlock(pageSize);
+		if (!mem)
+			return nullptr;
 
-			Size bytes = m_storage.getObjSizeInBytes(b->second);
-			void* obj = newStorage.malloc(bytes);
-			std::memcpy(obj, b->second, bytes);
-			b->second = obj;
-		}
-		
-		if (m_data) {
-			std::free(m_data);
-			m_data = newData;
+		//malloc could have moved other pages
+		if (m_slabPagesEpoch != GetHandleManager().relocationEpoch())
+			_rebuildSlabMap();
+
+		//page can be moved only together with its handle
+		IHandle* handle = helpers::makeHandle(mem);
+		if (!handle) {
+			_freeBlock(mem);
+			return nullptr;
 		}
 
-		m_storage.reinit(&newStorage);
+		std::vector<Size>& available = m_slabAvailable[classIdx];
+		SlabPage* page = static_cast<SlabPage*>(mem);
+		page->magic = s_slabMagic;
+		page->handle = handle;
+		page->classIdx = classIdx;
+		page->objSize = objSize;
+		page->capacity = (pageSize - sizeof(SlabPage)) / objSize;
+		page->used = 0u;
+		page->freeHead = 0u;
+		page->bumpOffset = sizeof(SlabPage);
+		page->availableIdx = available.size();
+		available.push_back(m_slabPages.size());
 
-		m_maxSize = newMaxSize;
-		return true;
+		CSize end = sizeof(SlabPage) + page->objSize * page->capacity;
+		m_slabPages.push_back(SlabRange{ static_cast<char*>(mem), static_cast<char*>(mem) + end, page->handle });
+		_markSlabPage(m_slabPages.size() - 1u, m_slabPages.size());
+		return page;
 	}
 
 	//-----------------------------------------------------------
-	void HeapStorage::_defragment()
+	void HeapStorage::_releaseSlabPage(SlabPage* page, CSize idx)
 	{
-		//1. find hole
-		void* hole;
-		void* start = nullptr;
-		Size holeSize = 0u;
+		std::vector<Size>& available = m_slabAvailable[page->classIdx];
+		CSize lastAvailable = available.back();
+		available[page->availableIdx] = lastAvailable;
+		_slabPageAt(lastAvailable)->availableIdx = page->availableIdx;
+		available.pop_back();
+
+		//the last page takes place of the released one
+		CSize lastIdx = m_slabPages.size() - 1u;
+		_markSlabPage(idx, 0u);
+		if (idx != lastIdx) {
+			_markSlabPage(lastIdx, 0u);
+			m_slabPages[idx] = m_slabPages[lastIdx];
+			_markSlabPage(idx, idx + 1u);
+
+			const SlabPage* moved = _slabPageAt(idx);
+			if (moved->availableIdx != s_invalidId)
+				m_slabAvailable[moved->classIdx][moved->availableIdx] = idx;
+		}
+		m_slabPages.pop_back();
 
-		while (m_storage.getNextHole(hole, holeSize, start), hole != nullptr) {
+		page->magic = 0u;
+		_freeBlock(helpers::destroyHandle(page->handle));
+	}
 
-			//2. find allocated block to the rigth of the hole
-			void* obj = nullptr;
-			Size objSize = 0u;
+	//-----------------------------------------------------------
+	Size HeapStorage::_findSlabPage(const void* ptr)
+	{
+		if (m_slabPages.empty() || !contains(ptr))
+			return m_slabPages.size();
 
-			HandleManager::iterator b = GetHandleManager().begin();
-			HandleManager::iterator e = GetHandleManager().end();
+		if (m_slabPagesEpoch != GetHandleManager().relocationEpoch())
+			_rebuildSlabMap();
 
-			for (; b != e; b++) {
-				if (b->second > hole && 
-					(objSize = m_storage.getObjSizeInBytes(b->second)) <= holeSize) {
-					obj = b->second;
-					break;
-				}
-			}
+		const char* p = static_cast<const char*>(ptr);
+		CSize granule = static_cast<Size>(p - static_cast<char*>(m_data)) >> s_slabGranuleLog2;
+		if (granule >= m_slabMap.size())
+			return m_slabPages.size();
 
-			if (b == e)
-			{
-				start = hole;
-				continue;
-			}
+		//page which starts inside of the granule before ptr contains it, since page isn't smaller than a granule
+		const SlabGranule& g = m_slabMap[granule];
+		if (g.starting && p >= m_slabPages[g.starting - 1u].begin)
+			return g.starting - 1u;
+		if (g.covering && p < m_slabPages[g.covering - 1u].end)
+			return g.covering - 1u;
+		return m_slabPages.size();
+	}
 
-			//3. swap hole with object
-			if (obj) {
-				void* newObj = m_storage.malloc(objSize);
-				::memcpy(newObj, obj, objSize);
-				b->second = newObj;
-				m_storage.free(obj);
-			}
+	//-----------------------------------------------------------
+	void HeapStorage::_markSlabPage(CSize idx, CSize value)
+	{
+		const SlabRange& range = m_slabPages[idx];
+		CSize begin = static_cast<Size>(range.begin - static_cast<char*>(m_data));
+		CSize end = static_cast<Size>(range.end - static_cast<char*>(m_data));
+		CSize first = begin >> s_slabGranuleLog2;
+		CSize last = (end - 1u) >> s_slabGranuleLog2;
+
+		if (m_slabMap.size() <= last)
+			m_slabMap.resize(last + 1u, SlabGranule{ 0u, 0u });
+
+		if (begin & ((Size(1) << s_slabGranuleLog2) - 1u)) {
+			m_slabMap[first].starting = value;
+		} else {
+			m_slabMap[first].covering = value;
+		}
+		for (Size i = first + 1u; i <= last; i++)
+			m_slabMap[i].covering = value;
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::_rebuildSlabMap()
+	{
+		std::fill(m_slabMap.begin(), m_slabMap.end(), SlabGranule{ 0u, 0u });
+		for (Size i = 0; i < m_slabPages.size(); i++) {
+			SlabRange& range = m_slabPages[i];
+			char* begin = reinterpret_cast<char*>(_slabPage(range.handle));
+			range.end = begin + (range.end - range.begin);
+			range.begin = begin;
+			_markSlabPage(i, i + 1u);
 		}
+		m_slabPagesEpoch = GetHandleManager().relocationEpoch();
+	}
+
+	//-----------------------------------------------------------
+	void HeapStorage::_clearSlabs()
+	{
+		for (const SlabRange& range : m_slabPages)
+			helpers::destroyHandle(range.handle);
+		m_slabPages.clear();
+		m_slabMap.clear();
+		for (std::vector<Size>& available : m_slabAvailable)
+			available.clear();
 	}
 
 	HeapStorage g_heapStorage{};
@@ -377,15 +1643,25 @@ namespace hbp
 	//-----------------------------------------------------------
 	IHandle* HeapStorageHandles::malloc(CSize size)
 	{
-		void* res = HeapStorage::malloc(size);
-		return helpers::makeHandle(res);
+		return malloc_n(size, 1u);
 	}
 
 	//-----------------------------------------------------------
 	IHandle* HeapStorageHandles::malloc_n(CSize size, CSize handlesNumber)
 	{
+		if (handlesNumber == 0u)
+			return nullptr;
+
 		void* res = HeapStorage::malloc(size * handlesNumber);
-		return helpers::makeHandle(res, handlesNumber, size);
+		if (!res)
+			return nullptr;
+
+		IHandle* h = helpers::makeHandle(res, handlesNumber, size);
+		if (!h) {
+			HeapStorage::free(res);
+			return nullptr;
+		}
+		return h;
 	}
 
 	//-----------------------------------------------------------
@@ -393,7 +1669,7 @@ namespace hbp
 	{
 		if (!ptr)
 			return;
-//		HeapStorage::free(helpers::destroyHandle(ptr));
+		HeapStorage::free(helpers::destroyHandle(ptr));
 	}
 
 	//-----------------------------------------------------------
@@ -405,10 +1681,8 @@ namespace hbp
 	{
 		if (!ptr)
 			return;
-		for (Size i = 0; i < handlesNumber; i++)
-		{
-			//HeapStorage::free(helpers::destroyHandle(ptr + i));
-		}
+		//first handle points to the beginning of the block
+		HeapStorage::free(helpers::destroyHandle(ptr, handlesNumber));
 	}
 
 	//-----------------------------------------------------------
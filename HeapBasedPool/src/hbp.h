@@ -1,12 +1,81 @@
 #ifndef HEAP_BASED_POOL_SRC_HBP
 #define HEAP_BASED_POOL_SRC_HBP
 
+//allocations and frees of storage engines are recorded into the trace ring of the thread(utils/trace.h)
 #if defined(NDEBUG) || defined(DISABLE_LOG)
 #define HEAP_BASED_POOL_ENABLE_MEM_LOG 0
 #else
 #define HEAP_BASED_POOL_ENABLE_MEM_LOG  1
 #endif
 
+//latency of every malloc and free of HeapStorage is recorded into histograms(utils/latency.h)
+#ifndef HEAP_BASED_POOL_ENABLE_LATENCY
+#define HEAP_BASED_POOL_ENABLE_LATENCY 0
+#endif
+
+//every allocation of HeapStorage is tracked in the side table, bad frees are rejected, leaks are reported(utils/checked.h)
+#ifndef HEAP_BASED_POOL_ENABLE_CHECKED
+#define HEAP_BASED_POOL_ENABLE_CHECKED 0
+#endif
+
+/*
+every object of HeapStorage is followed by canary bytes, which are checked when it's freed,
+so an overrun into the neighbour object is reported(utils/canary.h)
+*/
+#ifndef HEAP_BASED_POOL_ENABLE_CANARY
+#define HEAP_BASED_POOL_ENABLE_CANARY 0
+#endif
+
+/*
+minimal number of canary bytes after every object, the rest of the block or slot after the object is a canary too,
+besides its last word, which keeps the requested size of the object
+*/
+#ifndef HEAP_BASED_POOL_CANARY_SIZE
+#define HEAP_BASED_POOL_CANARY_SIZE 16
+#endif
+
+/*
+objects not smaller than this size are placed outside of the heap at the end of own pages
+followed by an inaccessible page, so an overrun faults right away. 0 - disabled.
+Such objects take at least two pages of address space and aren't moved by defragmentation
+*/
+#ifndef HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+#define HEAP_BASED_POOL_GUARDED_OBJECT_SIZE 0
+#endif
+
+/*
+allocation engine used by HeapStorage
+0 - FreeListStorage, first fit over address ordered list of holes
+1 - TlsfStorage, two-level segregated fit with O(1) malloc/free
+*/
+#ifndef HEAP_BASED_POOL_USE_TLSF
+#define HEAP_BASED_POOL_USE_TLSF 0
+#endif
+
+/*
+size of address space reserved by HeapStorage, heap grows inside of it without moving objects,
+when it's exhausted objects are copied into the new region. 0 - always copy
+*/
+#ifndef HEAP_BASED_POOL_RESERVE_SIZE
+#define HEAP_BASED_POOL_RESERVE_SIZE (sizeof(void*) == 8 ? (size_t(1) << 32) : (size_t(1) << 26))
+#endif
+
+/*
+objects up to this size are served by HeapStorage from slab pages without per object header,
+0 - every object is a separate block of the heap. Can't exceed 256
+*/
+#ifndef HEAP_BASED_POOL_SMALL_OBJECT_SIZE
+#define HEAP_BASED_POOL_SMALL_OBJECT_SIZE 256
+#endif
+
+#include <vector>
+#include <set>
+#include <map>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 namespace hbp
 {
 	typedef size_t Size;
@@ -14,11 +83,88 @@ namespace hbp
 	
 	constexpr static size_t s_ptrSize = sizeof(void*);
 
+	//-----------------------------------------------------------
+	//index of the most significant set bit, value has to be non zero
+	inline Size highestBit(CSize value)
+	{
+#if defined(_MSC_VER)
+		unsigned long idx;
+#if defined(_WIN64)
+		_BitScanReverse64(&idx, value);
+#else
+		_BitScanReverse(&idx, value);
+#endif
+		return idx;
+#else
+		return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(value);
+#endif
+	}
+
+	//-----------------------------------------------------------
+	//index of the least significant set bit, value has to be non zero
+	inline Size lowestBit(CSize value)
+	{
+#if defined(_MSC_VER)
+		unsigned long idx;
+#if defined(_WIN64)
+		_BitScanForward64(&idx, value);
+#else
+		_BitScanForward(&idx, value);
+#endif
+		return idx;
+#else
+		return __builtin_ctzll(value);
+#endif
+	}
+
+	struct Hole
+	{
+		void*	ptr;
+		Size	size;
+	};
+
+	/*
+	free memory of a storage engine, engine updates it with every change of its holes,
+	thus it's read in O(1) instead of walking holes with getNextHole
+	*/
+	struct FreeSpaceStats
+	{
+		constexpr static Size s_bucketsNumber = sizeof(Size) * 8;
+
+		//bucket i counts holes with size in [2^i, 2^(i+1))
+		Size			holes[s_bucketsNumber];
+		Size			holesNumber;
+		Size			freeBytes;
+		//isn't kept in the histogram, it's taken from the index of the engine when stats are returned
+		Size			largestHole;
+	};
+
+	//how the storage chooses a hole for a new object
+	enum class PlacementPolicy
+	{
+		//lowest address hole which fits
+		FIRST_FIT = 0,
+		//first hole which fits after the hole of the previous allocation, wraps around
+		NEXT_FIT,
+		//smallest hole which fits, holes are indexed by size
+		BEST_FIT,
+		//lowest address hole of the first power of two bin which surely fits
+		GOOD_FIT,
+	};
+
+	/*
+	free segments form an intrusive treap ordered by address, every node keeps the biggest segment
+	size in its subtree, so fit search and lookup of neighbours are O(log holes).
+	Node priority is a hash of its address, so it isn't stored
+	*/
 	class FreeListStorage
 	{
 	public:
 								FreeListStorage() 
 									: m_data{ nullptr }
+									, m_rover{ nullptr }
+									, m_policy{ PlacementPolicy::FIRST_FIT }
+									, m_freeSpace{}
 								{}
 								~FreeListStorage() {}
 
@@ -28,6 +174,10 @@ namespace hbp
 		void					addBLock(void* ptr, CSize size);
 		void					reinit(FreeListStorage* ptr);
 
+		//BEST_FIT and GOOD_FIT keep additional index of holes, it's built when policy is set
+		void					setPolicy(const PlacementPolicy policy);
+		PlacementPolicy			getPolicy() const { return m_policy; }
+
 		inline CSize			getObjSizeInBlocks(void* ptr) const 
 		{
 			return getObjSizeInBytes(ptr) / s_ptrSize;
@@ -41,6 +191,18 @@ namespace hbp
 	public:
 		//defragmentation functionality
 		void					getNextHole(void*& nextHole, Size& holeSize, void* start = nullptr) const;
+		//allocates object of given size at the beginning of the hole returned by getNextHole
+		void*					mallocFromHole(void* hole, CSize size);
+		//lowest address hole which is below the object obj and fits object of given size, O(log holes)
+		void*					getHoleBelow(const void* obj, CSize size) const;
+		//replaces all free memory with address ordered holes, used blocks are left as is
+		void					rebuild(const Hole* holes, CSize holesNumber);
+
+		//free memory metrics, O(1)
+		FreeSpaceStats			getFreeSpace() const;
+		Size					getFreeBytes() const { return m_freeSpace.freeBytes; }
+		//root of the treap keeps the biggest segment
+		Size					getLargestHole() const { return m_data ? _maxSize(m_data) : 0u; }
 		
 	private:
 
@@ -48,29 +210,267 @@ namespace hbp
 		void					_log(const void* const ptr, CSize blockNum, const bool isAllocation);
 #endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
 
-		void*					_findPrev(void* const ptr) const;
+		void*					_takeFromSegment(void* curSeg, Size actualSize);
 
-		static void*			_makeList(void* const begin, void* const end, CSize size);
+		static Size				_actualSize(CSize size);
 
-		static void*			_tryMallocN(void*& begin, Size n);
-		
-		inline static void*&	_nextOf(void* const p)
-		{
-			return *static_cast<void**>(p);
-		}
+		//returns segment chosen by the policy or nullptr
+		void*					_findFit(CSize actualSize) const;
+		void*					_findIndexedFit(CSize actualSize) const;
+
+		/*
+		free space histogram and index of holes used by BEST_FIT and GOOD_FIT,
+		have to be updated before size of segment is changed
+		*/
+		void					_index(void* const seg);
+		void					_unindex(void* const seg);
+		void					_rebuildIndex();
+		static Size				_bin(CSize size);
+
+		//last segment which starts before ptr / first segment which starts after ptr
+		void*					_lower(const void* ptr) const;
+		void*					_upper(const void* ptr) const;
+		//lowest address segment which starts not before from and fits size
+		static void*			_firstFit(void* node, CSize size, const void* from);
+
+		//treap
+		static Size				_priority(const void* node);
+		static void				_update(void* node);
+		//nodes before key go to l, the rest to r
+		static void				_split(void* node, const void* key, void*& l, void*& r);
+		static void*			_merge(void* l, void* r);
+		static void				_insert(void*& root, void* node);
+		static void				_erase(void*& root, void* const seg);
+		static void				_resize(void* root, void* const seg, CSize size);
 
 		inline static Size&		_segSize(void* const p)
 		{
 			return *static_cast<Size*>(p);
 		}
 
-		inline static void*&	_nextSeg(void* const p)
+		inline static void*&	_left(void* const p)
 		{
-			return _nextOf(static_cast<char*>(p) + _segSize(p) - s_ptrSize);
+			return *(static_cast<void**>(p) + 1);
+		}
+
+		inline static void*&	_right(void* const p)
+		{
+			return *(static_cast<void**>(p) + 2);
+		}
+
+		//biggest segment of the subtree
+		inline static Size&		_maxSize(void* const p)
+		{
+			return *(static_cast<Size*>(p) + 3);
 		}
 
 	private:
+			//root of the treap
 			void* m_data;
+			//NEXT_FIT continues search from this address, nullptr - from the beginning
+			void* m_rover;
+
+			PlacementPolicy m_policy;
+			std::set<std::pair<Size, void*>> m_bySize;
+			//bin i keeps address ordered holes with size in [2^i, 2^(i+1))
+			std::set<void*> m_bins[sizeof(Size) * 8];
+			//histogram of all segments, kept for every policy
+			FreeSpaceStats m_freeSpace;
+
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+			//id of the storage in trace events, assigned by the first event
+			unsigned int m_traceId = 0u;
+#endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
+
+			//free segment keeps its size, children and the biggest size of its subtree
+			constexpr static Size s_minSegSize = 4 * s_ptrSize;
+	};
+
+	/*
+	Two-Level Segregated Fit allocation engine
+	every block has one word header: size of the block(including header) and two flags,
+	free block additionally keeps links to the neighbours in its segregated list 
+	and pointer to itself in the last word, which is used for merging with physical neighbours.
+	The end of the region is marked with zero sized used sentinel block.
+	*/
+	class TlsfStorage
+	{
+	public:
+								TlsfStorage();
+								~TlsfStorage() {}
+
+		void*					malloc(CSize size);
+		void					free(void* ptr);
+
+		void					addBLock(void* ptr, CSize size);
+		void					reinit(TlsfStorage* ptr);
+
+		//segregated lists are a good fit by design, other policies aren't supported
+		void					setPolicy(const PlacementPolicy policy);
+		PlacementPolicy			getPolicy() const { return PlacementPolicy::GOOD_FIT; }
+
+		inline CSize			getObjSizeInBlocks(void* ptr) const
+		{
+			return getObjSizeInBytes(ptr) / s_ptrSize;
+		}
+
+		inline CSize			getObjSizeInBytes(void* ptr) const
+		{
+			return _blockSize(static_cast<char*>(ptr) - s_ptrSize) - s_ptrSize;
+		}
+
+	public:
+		//defragmentation functionality
+		void					getNextHole(void*& nextHole, Size& holeSize, void* start = nullptr) const;
+		void*					mallocFromHole(void* hole, CSize size);
+		/*
+		lowest block below the object obj among heads of the lists which fit object of given size and the hole
+		right before obj. Lists aren't address ordered, so it isn't always the lowest hole, but lookup is bounded by the bitmaps
+		*/
+		void*					getHoleBelow(const void* obj, CSize size) const;
+		void					rebuild(const Hole* holes, CSize holesNumber);
+
+		//free memory metrics, O(1) besides the largest hole, which walks the last non-empty list only
+		FreeSpaceStats			getFreeSpace() const;
+		Size					getFreeBytes() const { return m_freeSpace.freeBytes; }
+		Size					getLargestHole() const;
+
+	private:
+		constexpr static Size	s_alignLog2 = s_ptrSize == 8 ? 3 : 2;
+		constexpr static Size	s_slIndexCountLog2 = 4;
+		constexpr static Size	s_slIndexCount = 1 << s_slIndexCountLog2;
+		constexpr static Size	s_flIndexShift = s_slIndexCountLog2 + s_alignLog2;
+		constexpr static Size	s_flIndexMax = s_ptrSize == 8 ? 40 : 30;
+		constexpr static Size	s_flIndexCount = s_flIndexMax - s_flIndexShift + 1;
+		constexpr static Size	s_smallBlockSize = Size(1) << s_flIndexShift;
+
+		//header + links to the neighbours + pointer to itself at the end
+		constexpr static Size	s_minBlockSize = 4 * s_ptrSize;
+
+		constexpr static Size	s_freeBit = 1;
+		constexpr static Size	s_prevFreeBit = 2;
+		constexpr static Size	s_flagsMask = s_freeBit | s_prevFreeBit;
+
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+		void					_log(const void* const ptr, CSize blockNum, const bool isAllocation);
+#endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
+
+		void*					_findSuitable(Size& fl, Size& sl) const;
+		void					_insert(void* block);
+		void					_remove(void* block);
+		void*					_use(void* block, CSize blockSize);
+		void*					_merge(void* block);
+
+		static void				_mapping(CSize size, Size& fl, Size& sl);
+		static Size				_blockSizeFor(CSize size);
+
+		inline static Size&		_header(void* const p)
+		{
+			return *static_cast<Size*>(p);
+		}
+
+		inline static Size		_blockSize(void* const p)
+		{
+			return _header(p) & ~s_flagsMask;
+		}
+
+		inline static bool		_isFree(void* const p)
+		{
+			return (_header(p) & s_freeBit) != 0;
+		}
+
+		inline static bool		_isPrevFree(void* const p)
+		{
+			return (_header(p) & s_prevFreeBit) != 0;
+		}
+
+		inline static void*&	_nextFree(void* const p)
+		{
+			return *(static_cast<void**>(p) + 1);
+		}
+
+		inline static void*&	_prevFree(void* const p)
+		{
+			return *(static_cast<void**>(p) + 2);
+		}
+
+		inline static void*		_nextPhys(void* const p)
+		{
+			return static_cast<char*>(p) + _blockSize(p);
+		}
+
+		inline static void*		_prevPhys(void* const p)
+		{
+			return *reinterpret_cast<void**>(static_cast<char*>(p) - s_ptrSize);
+		}
+
+	private:
+		void*			m_begin;
+		void*			m_sentinel;
+		Size			m_flBitmap;
+		Size			m_slBitmap[s_flIndexCount];
+		void*			m_blocks[s_flIndexCount][s_slIndexCount];
+		FreeSpaceStats	m_freeSpace;
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+		//id of the storage in trace events, assigned by the first event
+		unsigned int	m_traceId = 0u;
+#endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
+	};
+
+#if HEAP_BASED_POOL_USE_TLSF
+	typedef TlsfStorage		StorageEngine;
+#else
+	typedef FreeListStorage	StorageEngine;
+#endif
+
+	struct HandleSlot;
+	class IHandle;
+
+	struct DefragReport
+	{
+		Size			bytesMoved;
+		Size			objectsMoved;
+		float			fragmentationBefore;
+		float			fragmentationAfter;
+		//whole heap has been walked, next step starts from the beginning
+		bool			passFinished;
+	};
+
+	/*
+	conditions on free memory under which defragmentation pays off, any of them triggers it.
+	Used by callers of defragmentStep from idle time and by the background compactor
+	*/
+	struct DefragTrigger
+	{
+		//external fragmentation score(HeapStorage::getFragmentation) is above, 1 - never
+		float			fragmentation;
+		//free memory is split into more holes, 0 - never
+		Size			holesNumber;
+		//largest hole is smaller, while there is enough free memory for such hole, 0 - never
+		Size			largestHole;
+	};
+
+	/*
+	counters of HeapStorage, they are kept in release builds too.
+	Objects are counted with the size they really take: block without header or slot of the size class
+	*/
+	struct HeapStats
+	{
+		Size			allocations;
+		Size			frees;
+		Size			failedAllocations;
+		Size			bytesInUse;
+		Size			peakBytesInUse;
+		//used and total size of the heap, used size includes headers and whole slab pages
+		Size			heapUsed;
+		Size			heapSize;
+		//growths of the heap, in place or by copying into the new region
+		Size			reinits;
+		Size			defragSteps;
+		//explicit and implicit(failed malloc) compactions
+		Size			compactions;
+		Size			objectsMoved;
+		Size			bytesMoved;
 	};
 
 	class HeapStorage 
@@ -80,8 +480,9 @@ namespace hbp
 		virtual					~HeapStorage();
 
 		/*
-		Take into account that memory overhead is up to 2 in the worse case(for types
-		which size is equal or less than sizeof(void*))
+		Objects up to HEAP_BASED_POOL_SMALL_OBJECT_SIZE are placed into slab pages of their size class,
+		bigger ones take a block with one word header, thus memory overhead is up to 2 in the worse case
+		only when small object front end is disabled
 		*/
 		void					init(CSize size);
 		void*					malloc(CSize size);
@@ -91,18 +492,224 @@ namespace hbp
 
 		void					cleanAll();
 
+		/*
+		Incremental defragmentation, which can be called from idle time.
+		Walks objects referenced by handles in address order starting where the previous step
+		has stopped and moves each of them to the lowest hole which fits it.
+		Stops when byteBudget bytes are moved or timeBudgetUs microseconds elapsed(0 - no time limit)
+		*/
+		DefragReport			defragmentStep(CSize byteBudget, CSize timeBudgetUs = 0u);
+
+		/*
+		Full compaction, slides all objects referenced by handles towards the beginning of the heap
+		in one linear pass, objects which aren't referenced by any handle or are pinned stay in place.
+		Free memory after the last such object becomes one hole.
+		*/
+		DefragReport			compact();
+
+		/*
+		external fragmentation score: 1 - largest hole / total free memory,
+		0 means that all free memory is in one hole. O(1)
+		*/
+		float					getFragmentation() const;
+		//histogram of holes, largest hole and total free memory, O(1)
+		FreeSpaceStats			getFreeSpace() const { return m_storage.getFreeSpace(); }
+		//true if free space satisfies any condition of the trigger
+		bool					needsDefragmentation(const DefragTrigger& trigger) const;
+
+		HeapStats				stats() const;
+
+		void					setPlacementPolicy(const PlacementPolicy policy) { m_storage.setPolicy(policy); }
+		PlacementPolicy			getPlacementPolicy() const { return m_storage.getPolicy(); }
+
+		//reserved range doesn't change while heap grows in place, so it can be checked without locks
+		bool					contains(const void* ptr) const 
+									{ return ptr >= m_data && ptr < static_cast<char*>(m_data) + (m_reservedSize ? m_reservedSize : m_maxSize); }
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		//object is placed against a guard page outside of the heap
+		bool					isGuarded(const void* ptr) const { return m_guarded.count(ptr) != 0u; }
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+
+		/*
+		When enabled, blocks left behind by defragmentStep aren't freed but retired,
+		so other threads can still read moved objects through old pointers.
+		Retired blocks are freed by freeRetired, oldest first.
+		compact() and copying of objects into a new region overwrite objects in place,
+		thus they aren't used implicitly in this mode.
+		*/
+		void					setDeferredFree(const bool enabled);
+		Size					retiredNumber() const { return m_retired.size(); }
+		void					freeRetired(CSize number);
+
 	private:
 
+		//malloc without padding, stats of failed allocations and checks
+		void*					_malloc(CSize size);
+		//size of the block or slot of the object, which the object can use
+		Size					_objSize(void* ptr);
+#if HEAP_BASED_POOL_ENABLE_CANARY
+		//objSize - size of the block or slot of the object
+		void					_fillCanary(char* obj, CSize size, CSize objSize);
+		void					_checkCanary(void* ptr);
+		//copiedSize bytes of the object have been moved into the block of objSize, canary is moved to its end
+		void					_moveCanary(char* obj, CSize copiedSize, CSize objSize);
+#endif// HEAP_BASED_POOL_ENABLE_CANARY
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		void*					_mallocGuarded(CSize size);
+		//false if ptr isn't a guarded object
+		bool					_freeGuarded(void* ptr);
+		void					_releaseGuarded();
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+
 		bool					_reinit(CSize requestedSize);
+		bool					_grow(CSize newMaxSize);
+
+		inline void				_countAllocation(CSize bytes)
+		{
+			m_stats.allocations++;
+			m_stats.bytesInUse += bytes;
+			m_stats.peakBytesInUse = m_stats.peakBytesInUse > m_stats.bytesInUse ? m_stats.peakBytesInUse : m_stats.bytesInUse;
+		}
+
+		//reserves address space when it's possible, otherwise uses malloc
+		void*					_allocRegion(CSize size, Size& reservedSize) const;
+		void					_freeRegion();
+
+		/*
+		calls func(block, blockSize, first, last) for every used block in address order,
+		where [first, last) are live index entries pointing into the block,
+		returns end of the last block
+		*/
+		template<typename Func>
+		char*					_forEachUsedBlock(const std::vector<Hole>& holes, Func func);
+		void					_collectHoles(std::vector<Hole>& holes) const;
 		
-		inline bool				_canDefragment(CSize size) const { return m_maxSize - m_currentSize >= size; }
+		//compaction joins all free memory into one hole
+		inline bool				_canDefragment(CSize size) const { return m_storage.getFreeBytes() >= size; }
 		void					_defragment();
 
+		//address ordered index of objects referenced by handles
+		void					_buildLiveIndex();
+		Size					_moveObject(Size idx, Size& bytesMoved);
+
 	private:
-		FreeListStorage m_storage;
+		struct LiveObject
+		{
+			void*		ptr;
+			HandleSlot*	slot;
+		};
+
+		//true if any handle of the object is pinned, such object can't be moved
+		static bool				_isPinned(const LiveObject* first, const LiveObject* last);
+		static bool				_hasRelocateFn(const LiveObject* first, const LiveObject* last);
+
+		/*
+		moves size bytes from src to dst, objects of [first, last) which have relocate function
+		are moved by it, the rest is copied, ranges can overlap
+		*/
+		void					_relocate(char* dst, char* src, CSize size, const LiveObject* first, const LiveObject* last);
+
+		//false if block is pinned or it's a slab page with objects which aren't referenced by handles
+		bool					_canMove(const char* obj, const LiveObject* first, const LiveObject* last) const;
+
+	private:
+		/*
+		small object front end, slab page is an ordinary block of the heap referenced by its own handle,
+		thus defragmentation moves it like any other object. Page keeps offsets only, so it can be copied as is
+		*/
+		struct SlabPage
+		{
+			Size		magic;
+			IHandle*	handle;
+			Size		classIdx;
+			Size		objSize;
+			Size		capacity;
+			Size		used;
+			//offset of the first free slot from the beginning of the page, 0 - none
+			Size		freeHead;
+			//offset of the first slot which has never been used
+			Size		bumpOffset;
+			//position in the list of pages with free slots of the class, s_invalidId if page is full
+			Size		availableIdx;
+		};
+
+		//address range of the page, free() looks it up without resolving handles
+		struct SlabRange
+		{
+			char*		begin;
+			char*		end;
+			IHandle*	handle;
+		};
+
+		/*
+		heap is split into granules, page isn't smaller than a granule, thus a granule intersects at most two pages:
+		the one which covers its first byte and the one which starts inside of it. Indices are 1 based, 0 - none
+		*/
+		struct SlabGranule
+		{
+			Size		covering;
+			Size		starting;
+		};
+
+		constexpr static Size	s_slabClassesNumber = 16u;
+		constexpr static Size	s_slabObjectsPerPage = 32u;
+		constexpr static Size	s_slabGranuleLog2 = 12u;
+		constexpr static Size	s_slabMagic = static_cast<Size>(0x51AB9A6E51AB9A6Eull);
+
+		static Size				_slabClass(CSize size);
+		static SlabPage*		_slabPage(IHandle* handle);
+		inline SlabPage*		_slabPageAt(CSize idx) const { return reinterpret_cast<SlabPage*>(m_slabPages[idx].begin); }
+		//page which starts at obj, nullptr if obj is a regular block
+		static const SlabPage*	_asSlabPage(const char* obj, const LiveObject* first, const LiveObject* last);
+
+		void*					_slabMalloc(CSize size);
+		bool					_slabFree(void* ptr);
+		SlabPage*				_newSlabPage(CSize classIdx);
+		void					_releaseSlabPage(SlabPage* page, CSize idx);
+		//index of the page in m_slabPages which contains ptr, or m_slabPages.size()
+		Size					_findSlabPage(const void* ptr);
+		//sets(idx + 1) or clears(0) granules of the page
+		void					_markSlabPage(CSize idx, CSize value);
+		//pages have been moved, ranges and granules are refreshed from handles
+		void					_rebuildSlabMap();
+		void					_clearSlabs();
+
+		//takes block of the heap from the storage engine, grows or defragments the heap when needed
+		void*					_mallocBlock(CSize size);
+		//returns block of the heap to the storage engine, ptr can't be a slab object
+		void					_freeBlock(void* ptr);
+
+		//indices of pages with free slots per class
+		std::vector<Size>		m_slabAvailable[s_slabClassesNumber];
+		std::vector<SlabRange>	m_slabPages;
+		std::vector<SlabGranule> m_slabMap;
+		//relocation epoch for which ranges of pages are valid
+		Size					m_slabPagesEpoch;
+
+		StorageEngine	m_storage;
 		void*			m_data;
 		Size			m_currentSize;
 		Size			m_maxSize;
+		//0 if region isn't reserved, otherwise size of reserved address space
+		Size			m_reservedSize;
+
+		std::vector<LiveObject> m_liveIndex;
+		Size			m_liveIndexVersion;
+		//object from which next defragmentation step starts
+		Size			m_defragIdx;
+
+		//intermediate storage for overlapping moves of non trivially copyable objects
+		std::vector<char> m_relocBuffer;
+
+		bool			m_deferredFree;
+		std::vector<void*> m_retired;
+
+#if HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+		//objects outside of the heap and their sizes
+		std::map<const void*, Size> m_guarded;
+#endif// HEAP_BASED_POOL_GUARDED_OBJECT_SIZE
+
+		HeapStats		m_stats;
 	};
 
 	HeapStorage& GetHeapStorage();
@@ -112,24 +719,50 @@ namespace hbp
 	template<typename T>
 	class Handle;
 
+	typedef void (*RelocateFn)(void* dst, void* src);
+	namespace helpers {
+		template<typename T>
+		constexpr RelocateFn getRelocateFn();
+	}
+
 	class HeapStorageHandles : public HeapStorage
 	{
 	public:
 								HeapStorageHandles();
 		virtual					~HeapStorageHandles();
 
+		//frees object and its handle, destructor of the object isn't called
 		void					free(IHandle* ptr);
+		//ptr has to be the first handle returned by allocHandle
 		void					free_n(IHandle* ptr, CSize handlesNumber);
 
+		/*
+		allocates storage for handlesNumber objects of type T in one block and a handle per object,
+		handles are contiguous, objects aren't constructed, so they are moved with memcpy till setRelocate is called
+		*/
 		template<typename T>
 		Handle<T>*				allocHandle(CSize handlesNumber = 1)
 		{
-			IHandle* h = HeapStorageHandles::malloc(sizeof(T));
+			IHandle* h = handlesNumber == 1 
+				? HeapStorageHandles::malloc(sizeof(T))
+				: HeapStorageHandles::malloc_n(sizeof(T), handlesNumber);
 			return static_cast<Handle<T>*>(h);
 		}
+
+		/*
+		objects of handles returned by allocHandle are moved by their move constructor from now on,
+		has to be called after objects are constructed, relocation hook would move garbage otherwise
+		*/
+		template<typename T>
+		void					setRelocate(Handle<T>* handle, CSize handlesNumber = 1)
+		{
+			constexpr RelocateFn relocate = helpers::getRelocateFn<T>();
+			for (Size i = 0; relocate && i < handlesNumber; i++)
+				handle[i].setRelocate(relocate);
+		}
 	private:
 		IHandle*				malloc(CSize size);
-		IHandle*				malloc_n(CSize size, CSize handleNumber);
+		IHandle*				malloc_n(CSize size, CSize handlesNumber);
 	};
 }//namespace hbp
 #endif //HEAP_BASED_POOL_SRC_HBP
\ No newline at end of file
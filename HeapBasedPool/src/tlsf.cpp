@@ -0,0 +1,388 @@
+#include <memory>
+#include <cstring>
+
+#include "hbp.h"
+
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+#include "../../utils/trace.h"
+#endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
+
+namespace hbp
+{
+	//-----------------------------------------------------------
+	TlsfStorage::TlsfStorage()
+	{
+		reinit(nullptr);
+	}
+
+	//-----------------------------------------------------------
+	void* TlsfStorage::malloc(CSize size)
+	{
+		if (size == 0u)
+			return nullptr;
+
+		Size blockSize = _blockSizeFor(size);
+		Size fl = 0u, sl = 0u;
+
+		//round up to the next list, so every block in it is big enough
+		Size searchSize = blockSize;
+		if (searchSize >= s_smallBlockSize)
+			searchSize += (Size(1) << (highestBit(searchSize) - s_slIndexCountLog2)) - 1;
+		_mapping(searchSize, fl, sl);
+
+		void* block = _findSuitable(fl, sl);
+		if (!block)
+			return nullptr;
+
+		_remove(block);
+		void* res = _use(block, blockSize);
+
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+		_log(res, _blockSize(block), true);
+#endif
+
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	void TlsfStorage::free(void* ptr)
+	{
+		if (!ptr)
+			return;
+
+		void* block = static_cast<char*>(ptr) - s_ptrSize;
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+		_log(ptr, _blockSize(block), false);
+#endif
+		_insert(_merge(block));
+	}
+
+	//-----------------------------------------------------------
+	/*
+	first call sets the region, the last word of the region is reserved for the sentinel,
+	following calls can only extend the region at its end
+	*/
+	void TlsfStorage::addBLock(void* ptr, CSize size)
+	{
+		if (!ptr)
+			return;
+
+		void* block = ptr;
+		char* end = static_cast<char*>(ptr) + size;
+		Size flags = 0u;
+
+		if (m_begin) {
+			//sentinel becomes the header of the new block
+			char* oldEnd = static_cast<char*>(m_sentinel) + s_ptrSize;
+			if (static_cast<char*>(ptr) < oldEnd || static_cast<char*>(ptr) - oldEnd >= static_cast<std::ptrdiff_t>(s_ptrSize)) {
+				printf_s("TlsfStorage can only grow at the end of region[%p]\n", m_begin);
+				return;
+			}
+			block = m_sentinel;
+			flags = _header(m_sentinel) & s_prevFreeBit;
+		}
+
+		Size blockSize = (end - static_cast<char*>(block) - s_ptrSize) & ~(s_ptrSize - 1);
+		if (end < static_cast<char*>(block) + s_ptrSize + s_minBlockSize) {
+			printf_s("TlsfStorage: region of size[%zu] is too small\n", size);
+			return;
+		}
+
+		if (!m_begin)
+			m_begin = ptr;
+		_header(block) = blockSize | flags;
+
+		m_sentinel = _nextPhys(block);
+		_header(m_sentinel) = 0u;
+
+		_insert(_merge(block));
+	}
+
+	//-----------------------------------------------------------
+	void TlsfStorage::reinit(TlsfStorage* ptr)
+	{
+		//trace id is copied too, objects were copied by the new storage, further events continue its trace
+		if (ptr) {
+			std::memcpy(this, ptr, sizeof(TlsfStorage));
+		} else {
+			m_begin = nullptr;
+			m_sentinel = nullptr;
+			m_flBitmap = 0u;
+			std::memset(m_slBitmap, 0, sizeof(m_slBitmap));
+			std::memset(m_blocks, 0, sizeof(m_blocks));
+			m_freeSpace = FreeSpaceStats{};
+		}
+	}
+
+	//-----------------------------------------------------------
+	void TlsfStorage::setPolicy(const PlacementPolicy policy)
+	{
+		if (policy != PlacementPolicy::GOOD_FIT)
+			printf_s("TlsfStorage supports only good fit placement policy\n");
+	}
+
+	//defragmentation functionality
+
+	//-----------------------------------------------------------
+	/*
+	walks blocks in address order, thus holes are returned in the same order as FreeListStorage does
+	*/
+	void TlsfStorage::getNextHole(void*& nextHole, Size& holeSize, void* start /*nullptr*/) const
+	{
+		nextHole = start != nullptr ? _nextPhys(start) : m_begin;
+		while (nextHole && !_isFree(nextHole)) {
+			nextHole = _blockSize(nextHole) ? _nextPhys(nextHole) : nullptr;
+		}
+		if (nextHole)
+			holeSize = _blockSize(nextHole);
+	}
+
+	//-----------------------------------------------------------
+	void* TlsfStorage::mallocFromHole(void* hole, CSize size)
+	{
+		Size blockSize = _blockSizeFor(size);
+		if (!hole || !_isFree(hole) || _blockSize(hole) < blockSize)
+			return nullptr;
+
+		_remove(hole);
+		void* res = _use(hole, blockSize);
+
+#if HEAP_BASED_POOL_ENABLE_MEM_LOG
+		_log(res, _blockSize(hole), true);
+#endif
+
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	void* TlsfStorage::getHoleBelow(const void* obj, CSize size) const
+	{
+		CSize blockSize = _blockSizeFor(size);
+		Size fl = 0u, sl = 0u;
+		_mapping(blockSize, fl, sl);
+		if (fl >= s_flIndexCount)
+			return nullptr;
+
+		//heads are the latest freed blocks, the hole right before the object lets it slide down anyway
+		void* block = static_cast<char*>(const_cast<void*>(obj)) - s_ptrSize;
+		void* res = _isPrevFree(block) && _blockSize(_prevPhys(block)) >= blockSize ? _prevPhys(block) : nullptr;
+
+		//list of the size itself can keep smaller blocks, so sizes of heads are checked too
+		for (Size flMap = m_flBitmap & (~Size(0) << fl); flMap; flMap &= flMap - 1) {
+			CSize f = lowestBit(flMap);
+			for (Size slMap = m_slBitmap[f] & (f == fl ? ~Size(0) << sl : ~Size(0)); slMap; slMap &= slMap - 1) {
+				void* head = m_blocks[f][lowestBit(slMap)];
+				if (head < block && _blockSize(head) >= blockSize && (!res || head < res))
+					res = head;
+			}
+		}
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	void TlsfStorage::rebuild(const Hole* holes, CSize holesNumber)
+	{
+		void* begin = m_begin;
+		void* sentinel = m_sentinel;
+		reinit(nullptr);
+		m_begin = begin;
+		m_sentinel = sentinel;
+
+		for (Size i = 0; i < holesNumber; i++)
+			_header(holes[i].ptr) = holes[i].size;
+
+		//moved blocks still have flags of their old neighbours
+		for (void* block = m_begin; ; block = _nextPhys(block)) {
+			_header(block) &= ~s_flagsMask;
+			if (!_blockSize(block))
+				break;
+		}
+
+		for (Size i = 0; i < holesNumber; i++)
+			_insert(holes[i].ptr);
+	}
+
+	//-----------------------------------------------------------
+	FreeSpaceStats TlsfStorage::getFreeSpace() const
+	{
+		FreeSpaceStats res = m_freeSpace;
+		res.largestHole = getLargestHole();
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	/*
+	the largest hole is in the last non-empty list, blocks of the list differ by less than its step,
+	so it's usually one block long
+	*/
+	Size TlsfStorage::getLargestHole() const
+	{
+		if (!m_flBitmap)
+			return 0u;
+
+		CSize fl = highestBit(m_flBitmap);
+		CSize sl = highestBit(m_slBitmap[fl]);
+		Size res = 0u;
+		for (void* block = m_blocks[fl][sl]; block; block = _nextFree(block))
+			res = res > _blockSize(block) ? res : _blockSize(block);
+		return res;
+	}
+
+#if  HEAP_BASED_POOL_ENABLE_MEM_LOG
+	//-----------------------------------------------------------
+	void TlsfStorage::_log(const void* const ptr, CSize blockNum, const bool isAllocation)
+	{
+		if (!m_traceId)
+			m_traceId = pool_trace::newPoolId(pool_trace::PoolKind::TLSF_STORAGE);
+		pool_trace::record(isAllocation ? pool_trace::EventOp::ALLOC : pool_trace::EventOp::FREE, m_traceId, ptr, blockNum);
+	}
+#endif// HEAP_BASED_POOL_ENABLE_MEM_LOG
+
+	//-----------------------------------------------------------
+	/*
+	returns first block from the list [fl, sl] or from the next non-empty one,
+	fl and sl are updated to the indices of the found list
+	*/
+	void* TlsfStorage::_findSuitable(Size& fl, Size& sl) const
+	{
+		if (fl >= s_flIndexCount)
+			return nullptr;
+
+		Size slMap = m_slBitmap[fl] & (~Size(0) << sl);
+		if (!slMap) {
+			Size flMap = fl + 1 < s_flIndexCount ? m_flBitmap & (~Size(0) << (fl + 1)) : 0u;
+			if (!flMap)
+				return nullptr;
+
+			fl = lowestBit(flMap);
+			slMap = m_slBitmap[fl];
+		}
+		sl = lowestBit(slMap);
+		return m_blocks[fl][sl];
+	}
+
+	//-----------------------------------------------------------
+	void TlsfStorage::_insert(void* block)
+	{
+		Size fl = 0u, sl = 0u;
+		_mapping(_blockSize(block), fl, sl);
+
+		void* head = m_blocks[fl][sl];
+		_nextFree(block) = head;
+		_prevFree(block) = nullptr;
+		if (head)
+			_prevFree(head) = block;
+		m_blocks[fl][sl] = block;
+
+		m_flBitmap |= Size(1) << fl;
+		m_slBitmap[fl] |= Size(1) << sl;
+
+		CSize size = _blockSize(block);
+		m_freeSpace.holes[highestBit(size)]++;
+		m_freeSpace.holesNumber++;
+		m_freeSpace.freeBytes += size;
+
+		//mark as free and let physical neighbour know about it
+		_header(block) |= s_freeBit;
+		*reinterpret_cast<void**>(static_cast<char*>(block) + _blockSize(block) - s_ptrSize) = block;
+		_header(_nextPhys(block)) |= s_prevFreeBit;
+	}
+
+	//-----------------------------------------------------------
+	void TlsfStorage::_remove(void* block)
+	{
+		Size fl = 0u, sl = 0u;
+		_mapping(_blockSize(block), fl, sl);
+
+		void* next = _nextFree(block);
+		void* prev = _prevFree(block);
+		if (next)
+			_prevFree(next) = prev;
+		if (prev) {
+			_nextFree(prev) = next;
+		} else {
+			m_blocks[fl][sl] = next;
+			if (!next) {
+				m_slBitmap[fl] &= ~(Size(1) << sl);
+				if (!m_slBitmap[fl])
+					m_flBitmap &= ~(Size(1) << fl);
+			}
+		}
+
+		CSize size = _blockSize(block);
+		m_freeSpace.holes[highestBit(size)]--;
+		m_freeSpace.holesNumber--;
+		m_freeSpace.freeBytes -= size;
+
+		_header(block) &= ~s_freeBit;
+		_header(_nextPhys(block)) &= ~s_prevFreeBit;
+	}
+
+	//-----------------------------------------------------------
+	/*
+	block has to be removed from the lists already,
+	splits it when remainder is big enough to be a free block
+	*/
+	void* TlsfStorage::_use(void* block, CSize blockSize)
+	{
+		Size flags = _header(block) & s_prevFreeBit;
+		Size rest = _blockSize(block) - blockSize;
+
+		if (rest >= s_minBlockSize) {
+			_header(block) = blockSize | flags;
+			void* remainder = _nextPhys(block);
+			_header(remainder) = rest;
+			_insert(remainder);
+		}
+
+		return static_cast<char*>(block) + s_ptrSize;
+	}
+
+	//-----------------------------------------------------------
+	/*
+	merges block with free physical neighbours, returned block isn't in any list
+	*/
+	void* TlsfStorage::_merge(void* block)
+	{
+		Size size = _blockSize(block);
+
+		void* next = _nextPhys(block);
+		if (_isFree(next)) {
+			_remove(next);
+			size += _blockSize(next);
+		}
+
+		Size flags = _header(block) & s_prevFreeBit;
+		if (flags) {
+			void* prev = _prevPhys(block);
+			_remove(prev);
+			size += _blockSize(prev);
+			block = prev;
+			flags = _header(prev) & s_prevFreeBit;
+		}
+
+		_header(block) = size | flags;
+		return block;
+	}
+
+	//-----------------------------------------------------------
+	void TlsfStorage::_mapping(CSize size, Size& fl, Size& sl)
+	{
+		if (size < s_smallBlockSize) {
+			fl = 0u;
+			sl = size / (s_smallBlockSize / s_slIndexCount);
+		} else {
+			Size f = highestBit(size);
+			sl = (size >> (f - s_slIndexCountLog2)) ^ s_slIndexCount;
+			fl = f - (s_flIndexShift - 1);
+		}
+	}
+
+	//-----------------------------------------------------------
+	Size TlsfStorage::_blockSizeFor(CSize size)
+	{
+		Size aligned = (size + s_ptrSize - 1) & ~(s_ptrSize - 1);
+		Size blockSize = aligned + s_ptrSize;
+		return blockSize < s_minBlockSize ? s_minBlockSize : blockSize;
+	}
+}//namespace hbp
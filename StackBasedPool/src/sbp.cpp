@@ -2,6 +2,18 @@
 #include <memory>
 #include <iostream>
 
+#if STACK_BASED_POOL_ENABLE_MEM_LOG
+#include "../../utils/trace.h"
+#endif//STACK_BASED_POOL_ENABLE_MEM_LOG
+
+#if STACK_BASED_POOL_ENABLE_LATENCY
+#include "../../utils/latency.h"
+#endif//STACK_BASED_POOL_ENABLE_LATENCY
+
+#if STACK_BASED_POOL_ENABLE_CHECKED
+#include "../../utils/checked.h"
+#endif//STACK_BASED_POOL_ENABLE_CHECKED
+
 namespace sbp
 {
 	//-----------------------------------------------------------
@@ -9,7 +21,8 @@ namespace sbp
 		:
 		m_stack{nullptr},
 		m_stackSize{0},
-		m_curSize{0}
+		m_curSize{0},
+		m_stats{}
 	{
 		_init(MEBIBYTE);
 	}
@@ -19,7 +32,8 @@ namespace sbp
 		:
 		m_stack{nullptr},
 		m_stackSize{0},
-		m_curSize{0}
+		m_curSize{0},
+		m_stats{}
 	{
 		_init(size);
 	}
@@ -35,7 +49,10 @@ namespace sbp
 	{
 		if (m_stack)
 		{
-			m_stack = static_cast<char*>(m_stack) - m_curSize;
+			m_stack = _getBase();
+#if STACK_BASED_POOL_ENABLE_CHECKED
+			pool_check::onReset(m_stack);
+#endif//STACK_BASED_POOL_ENABLE_CHECKED
 			std::free(m_stack);
 		}
 	}
@@ -51,12 +68,22 @@ namespace sbp
 		
 		p.m_stackSize = p.m_curSize = 0;
 
+		this->m_stats = p.m_stats;
+		p.m_stats = PoolStats{};
+
+#if STACK_BASED_POOL_ENABLE_MEM_LOG
+		this->m_traceId = p.m_traceId;
+#endif//STACK_BASED_POOL_ENABLE_MEM_LOG
+
 		return *this;
 	}
 
 	//-----------------------------------------------------------
 	void* StackBasedPool::malloc(const size_t size)
 	{
+#if STACK_BASED_POOL_ENABLE_LATENCY
+		pool_latency::Scope latency{ pool_latency::PoolKind::STACK_BASED_POOL, pool_latency::Op::MALLOC, size };
+#endif//STACK_BASED_POOL_ENABLE_LATENCY
 		void* ptr = nullptr;
 
 		if (m_stackSize > m_curSize + size + ptrSize)
@@ -75,8 +102,15 @@ namespace sbp
 			
 			m_curSize = m_curSize + size + ptrSize;
 
+			m_stats.allocations++;
+			m_stats.bytesInUse += size;
+			m_stats.peakBytesInUse = m_stats.peakBytesInUse > m_stats.bytesInUse ? m_stats.peakBytesInUse : m_stats.bytesInUse;
+
+#if STACK_BASED_POOL_ENABLE_CHECKED
+			pool_check::onAlloc(_getBase(), ptr, size, POOL_CHECK_CALLER());
+#endif//STACK_BASED_POOL_ENABLE_CHECKED
 #if STACK_BASED_POOL_ENABLE_MEM_LOG
-			_log(ptr, size, MemHint::ALLOC);
+			pool_trace::record(pool_trace::EventOp::ALLOC, m_traceId, ptr, size);
 #endif//STACK_BASED_POOL_ENABLE_MEM_LOG
 
 		}
@@ -84,6 +118,10 @@ namespace sbp
 		{
 			std::cout << "Not enough memory for allocation of size [" << size << "]\n"
 				<< "Currently available amount of memory is [" << m_stackSize - m_curSize << "]\n";
+			m_stats.failedAllocations++;
+#if STACK_BASED_POOL_ENABLE_MEM_LOG
+			pool_trace::record(pool_trace::EventOp::FAIL, m_traceId, nullptr, size);
+#endif//STACK_BASED_POOL_ENABLE_MEM_LOG
 		}
 		return ptr;
 	} 
@@ -91,9 +129,17 @@ namespace sbp
 	//-----------------------------------------------------------
 	void StackBasedPool::free(void* ptr)
 	{
+#if STACK_BASED_POOL_ENABLE_LATENCY
+		//size is known only after the block is found, rejected frees are counted with size 0
+		pool_latency::Scope latency{ pool_latency::PoolKind::STACK_BASED_POOL, pool_latency::Op::FREE, 0u };
+#endif//STACK_BASED_POOL_ENABLE_LATENCY
 		if (m_curSize <= 0)
 		{
+#if STACK_BASED_POOL_ENABLE_CHECKED
+			pool_check::onRejectedFree(_getBase(), ptr, _isFrom(ptr), POOL_CHECK_CALLER());
+#endif//STACK_BASED_POOL_ENABLE_CHECKED
 			std::cout << "Trying to free from empty stack!\n";
+			m_stats.failedFrees++;
 			return;
 		}
 		
@@ -102,19 +148,33 @@ namespace sbp
 
 		if (_getPrev(fPtr) != ptr)
 		{
+#if STACK_BASED_POOL_ENABLE_CHECKED
+			//the side table tells whether it's a double free, a foreign pointer or a live block freed too early
+			pool_check::onRejectedFree(_getBase(), ptr, _isFrom(ptr), POOL_CHECK_CALLER());
+#endif//STACK_BASED_POOL_ENABLE_CHECKED
 			std::cout << "Error trying to free: [0x" << ptr << "] in wrong order. Memory is not freed.\n";
+			m_stats.failedFrees++;
 			return;
 		}
+#if STACK_BASED_POOL_ENABLE_CHECKED
+		pool_check::onFree(_getBase(), ptr, true, POOL_CHECK_CALLER());
+#endif//STACK_BASED_POOL_ENABLE_CHECKED
 		//move back free block 
 		m_stack = _getPrev(fPtr);
 
 		//calculate size of freed block
 		size_t ps = static_cast<char*>(fPtr) - static_cast<char*>(m_stack);
+#if STACK_BASED_POOL_ENABLE_LATENCY
+		latency.setSize(ps);
+#endif//STACK_BASED_POOL_ENABLE_LATENCY
 
 		m_curSize = m_curSize - ps - ptrSize;
 
+		m_stats.frees++;
+		m_stats.bytesInUse -= ps;
+
 #if STACK_BASED_POOL_ENABLE_MEM_LOG
-		_log(static_cast<char*>(fPtr) + ptrSize, ps, MemHint::FREE);
+		pool_trace::record(pool_trace::EventOp::FREE, m_traceId, ptr, ps);
 #endif//STACK_BASED_POOL_ENABLE_MEM_LOG
 	}
 
@@ -132,34 +192,13 @@ namespace sbp
 		{
 			m_stack = std::malloc(s);
 			m_stackSize = s;
-		}
-	}
-
+			m_stats.capacity = s;
 #if STACK_BASED_POOL_ENABLE_MEM_LOG
-	//-----------------------------------------------------------
-	void StackBasedPool::_log(const void* const p, const size_t s, const MemHint h) const
-	{
-		std::cout << "#--------------------------------------------------------------------#\n";
-		if (h != MemHint::INFO)
-		{
-			if (h == MemHint::ALLOC)
-			{
-				std::cout << "At memory location [0x" << p << "] has been allocated [" << s << "] bytes of memory\n";
-			}
-			else if (h == MemHint::FREE)
-			{
-				std::cout << "At memory location [0x" << p << "] has been freed [" << s << "] bytes of memory\n";
-			}
-
-			std::cout << "New available amount of memory is [" << m_stackSize - m_curSize << "]\n"
-				<< "New addres of free memory block is [0x" << m_stack << "]\n";
+			m_traceId = pool_trace::newPoolId(pool_trace::PoolKind::STACK_BASED_POOL);
+			pool_trace::record(pool_trace::EventOp::INIT, m_traceId, m_stack, s);
+#endif//STACK_BASED_POOL_ENABLE_MEM_LOG
 		}
-
-		std::cout << "Current occupied size: [" << m_curSize << "]\n" << "Total size: [" << m_stackSize << "]\n";
-		std::cout << "Memory occupied: [" << static_cast<float>(m_curSize) / static_cast<float>(m_stackSize) * 100.0f << "%]\n";
-		std::cout << "#--------------------------------------------------------------------#\n\n";
 	}
-#endif//STACK_BASED_POOL_ENABLE_MEM_LOG
 
 	//-----------------------------------------------------------
 	StackBasedPool& GetInstance(const size_t s)
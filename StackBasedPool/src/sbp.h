@@ -1,12 +1,23 @@
 #ifndef MP_SRC_STACKBASEDPOOL
 #define MP_SRC_STACKBASEDPOOL
 
+//allocations and frees are recorded into the trace ring of the thread(utils/trace.h)
 #if defined(NDEBUG) || defined(DISABLE_LOG)
 #define STACK_BASED_POOL_ENABLE_MEM_LOG 0
 #else
 #define STACK_BASED_POOL_ENABLE_MEM_LOG 1
 #endif
 
+//latency of every malloc and free is recorded into histograms(utils/latency.h)
+#ifndef STACK_BASED_POOL_ENABLE_LATENCY
+#define STACK_BASED_POOL_ENABLE_LATENCY 0
+#endif
+
+//every allocation is tracked in the side table, frees in wrong order are told from double and foreign frees, leaks are reported(utils/checked.h)
+#ifndef STACK_BASED_POOL_ENABLE_CHECKED
+#define STACK_BASED_POOL_ENABLE_CHECKED 0
+#endif
+
 #pragma warning(disable:26495)
 
 namespace sbp
@@ -14,6 +25,19 @@ namespace sbp
 	constexpr unsigned int KIBIBYTE = 1024;//initial stack size;
 	constexpr unsigned int MEBIBYTE = KIBIBYTE * KIBIBYTE;//initial stack size;
 
+	//counters are kept in release builds too, bytes don't include metadata of blocks
+	struct PoolStats
+	{
+		size_t				allocations;
+		size_t				frees;
+		size_t				failedAllocations;
+		//frees in wrong order(double and foreign frees in checked mode), which were rejected
+		size_t				failedFrees;
+		size_t				bytesInUse;
+		size_t				peakBytesInUse;
+		size_t				capacity;
+	};
+
 	struct StackBasedPool
 	{
 		explicit				StackBasedPool();
@@ -32,6 +56,8 @@ namespace sbp
 		void*					malloc(const size_t size);
 		void					free(void* ptr);
 
+		PoolStats				stats() const { return m_stats; }
+
 		inline bool				isEmpty() const {
 													return m_curSize > 0;
 												};
@@ -42,22 +68,24 @@ namespace sbp
 												{
 													return *(static_cast<void**>(p));
 												}
-#if STACK_BASED_POOL_ENABLE_MEM_LOG
-	private:
-		enum class MemHint
-		{
-			INFO = 0,
-			ALLOC = 1 << INFO,
-			FREE = 1 << ALLOC,
-		};
-
-		void					_log(const void* const p, const size_t s, const MemHint h = MemHint::INFO) const;
-#endif//STACK_BASED_POOL_ENABLE_MEM_LOG
-
+		//beginning of the memory, it doesn't change when the pool is moved
+		inline void*			_getBase() const
+												{
+													return static_cast<char*>(m_stack) - m_curSize;
+												}
+		inline bool				_isFrom(const void* ptr) const
+												{
+													return ptr >= _getBase() && ptr < static_cast<char*>(_getBase()) + m_stackSize;
+												}
 	private:
 		void*					m_stack;//pointer to all memory
 		unsigned long long		m_stackSize;//max size 
 		unsigned long long		m_curSize;
+		PoolStats				m_stats;
+#if STACK_BASED_POOL_ENABLE_MEM_LOG
+		//id of the pool in trace events
+		unsigned int			m_traceId;
+#endif//STACK_BASED_POOL_ENABLE_MEM_LOG
 
 		//implementation detail, thus make it private
 		static constexpr size_t ptrSize = sizeof(void*);
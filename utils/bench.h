@@ -0,0 +1,255 @@
+#ifndef MEM_POOL_UTILS_BENCH
+#define MEM_POOL_UTILS_BENCH
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+/*
+1 - time is read from the time stamp counter of x86 cpu, which is calibrated against steady_clock once,
+0 - steady_clock. TSC has to be invariant, otherwise results are wrong on frequency scaling
+*/
+#ifndef POOL_BENCH_USE_TSC
+#define POOL_BENCH_USE_TSC 0
+#endif
+
+#if POOL_BENCH_USE_TSC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif//POOL_BENCH_USE_TSC
+
+/*
+benchmark harness shared by all projects. Measured function runs warmup times unmeasured,
+then every repetition is one sample, sample time is divided by number of operations of the function.
+Results are printed and can be written into CSV or JSON to compare releases
+*/
+namespace pool_bench
+{
+	struct Config
+	{
+		size_t		warmup;
+		size_t		repetitions;
+	};
+
+	//nanoseconds per operation, percentiles are taken over samples, tails which samples can't support are NaN
+	struct Result
+	{
+		std::string	suite;
+		std::string	name;
+		size_t		repetitions;
+		size_t		opsPerSample;
+		double		minNs;
+		double		medianNs;
+		double		meanNs;
+		double		p99Ns;
+		double		p999Ns;
+		double		maxNs;
+	};
+
+	//-----------------------------------------------------------
+	inline int64_t nowNs()
+	{
+#if POOL_BENCH_USE_TSC
+		typedef std::chrono::steady_clock Clock;
+		//ticks per nanosecond, measured on the first call
+		static const double s_ticksPerNs = []() {
+			const Clock::time_point start = Clock::now();
+			const uint64_t startTicks = __rdtsc();
+			while (Clock::now() - start < std::chrono::milliseconds(20)) {}
+			const uint64_t ticks = __rdtsc() - startTicks;
+			return ticks / static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+		}();
+		return static_cast<int64_t>(__rdtsc() / s_ticksPerNs);
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	//-----------------------------------------------------------
+	//nearest rank percentile of sorted samples
+	inline double percentile(const std::vector<double>& sorted, const double p)
+	{
+		if (sorted.empty())
+			return 0.0;
+		const size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+		return sorted[rank ? rank - 1 : 0];
+	}
+
+	//-----------------------------------------------------------
+	//percentile of the tail, NaN when it would be the largest sample, e.g. p99.9 of less than 1000 samples
+	inline double tailPercentile(const std::vector<double>& sorted, const double p)
+	{
+		const size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+		return rank < sorted.size() ? sorted[rank ? rank - 1 : 0] : NAN;
+	}
+
+	class Report
+	{
+	public:
+		//p99.9 needs at least 1000 samples
+		Report()
+			: m_config{ 100u, 5000u }
+			, m_suite{ "" }
+		{
+		}
+
+		/*
+		"--bench-warmup <n>", "--bench-repetitions <n>", "--bench-csv <file>", "--bench-json <file>",
+		unknown arguments are skipped
+		*/
+		void					parseArguments(int argc, char** argv)
+		{
+			for (int i = 1; i + 1 < argc; i++) {
+				if (std::strcmp(argv[i], "--bench-warmup") == 0)
+					m_config.warmup = std::strtoul(argv[++i], nullptr, 10);
+				else if (std::strcmp(argv[i], "--bench-repetitions") == 0)
+					m_config.repetitions = std::max<size_t>(1u, std::strtoul(argv[++i], nullptr, 10));
+				else if (std::strcmp(argv[i], "--bench-csv") == 0)
+					m_csvPath = argv[++i];
+				else if (std::strcmp(argv[i], "--bench-json") == 0)
+					m_jsonPath = argv[++i];
+			}
+		}
+
+		const Config&			config() const { return m_config; }
+
+		//results added after the call belong to the suite, e.g. "Aligned Pool, size 64"
+		void					setSuite(const std::string& suite) { m_suite = suite; }
+
+		/*
+		func makes opsPerSample operations per call and leaves the pool in the same state,
+		storage for samples is taken before measuring, thus pools which replace operator new aren't disturbed
+		*/
+		template<typename Func>
+		const Result&			measure(const char* name, const size_t opsPerSample, Func func)
+		{
+			return measure(name, opsPerSample, m_config, func);
+		}
+
+		//for long samples, e.g. runs of several threads, which need fewer repetitions than the arguments set
+		template<typename Func>
+		const Result&			measure(const char* name, const size_t opsPerSample, const Config& config, Func func)
+		{
+			std::vector<double> samples(config.repetitions);
+
+			for (size_t i = 0; i < config.warmup; i++)
+				func();
+
+			for (size_t i = 0; i < config.repetitions; i++) {
+				const int64_t start = nowNs();
+				func();
+				samples[i] = static_cast<double>(nowNs() - start) / opsPerSample;
+			}
+
+			std::sort(samples.begin(), samples.end());
+			double sum = 0.0;
+			for (const double s : samples)
+				sum += s;
+
+			m_results.push_back(Result{ m_suite, name, samples.size(), opsPerSample,
+				samples.front(), percentile(samples, 0.5), sum / samples.size(),
+				tailPercentile(samples, 0.99), tailPercentile(samples, 0.999), samples.back() });
+
+			const Result& res = m_results.back();
+			char p99[16];
+			char p999[16];
+			std::printf("%-48s median[%9.2f ns] p99[%9s ns] p99.9[%9s ns] min[%9.2f ns] max[%9.2f ns]\n",
+				name, res.medianNs, _format(p99, res.p99Ns, 2, "n/a"), _format(p999, res.p999Ns, 2, "n/a"), res.minNs, res.maxNs);
+			return res;
+		}
+
+		//writes files requested by the arguments
+		void					write(const char* target) const
+		{
+			if (!m_csvPath.empty())
+				writeCsv(m_csvPath.c_str(), target);
+			if (!m_jsonPath.empty())
+				writeJson(m_jsonPath.c_str(), target);
+		}
+
+		bool					writeCsv(const char* path, const char* target) const
+		{
+			FILE* file = _open(path);
+			if (!file)
+				return false;
+
+			std::fprintf(file, "target,suite,name,repetitions,ops_per_sample,min_ns,median_ns,mean_ns,p99_ns,p999_ns,max_ns\n");
+			for (const Result& r : m_results) {
+				char p99[16];
+				char p999[16];
+				std::fprintf(file, "\"%s\",\"%s\",\"%s\",%zu,%zu,%.3f,%.3f,%.3f,%s,%s,%.3f\n",
+					target, r.suite.c_str(), r.name.c_str(), r.repetitions, r.opsPerSample,
+					r.minNs, r.medianNs, r.meanNs, _format(p99, r.p99Ns, 3, ""), _format(p999, r.p999Ns, 3, ""), r.maxNs);
+			}
+			std::fclose(file);
+			std::printf("[%zu] benchmark results are written into %s\n", m_results.size(), path);
+			return true;
+		}
+
+		bool					writeJson(const char* path, const char* target) const
+		{
+			FILE* file = _open(path);
+			if (!file)
+				return false;
+
+			std::fprintf(file, "{\n  \"target\": \"%s\",\n  \"warmup\": %zu,\n  \"repetitions\": %zu,\n  \"results\": [",
+				target, m_config.warmup, m_config.repetitions);
+			for (size_t i = 0; i < m_results.size(); i++) {
+				const Result& r = m_results[i];
+				char p99[16];
+				char p999[16];
+				std::fprintf(file, "%s\n    {\"suite\": \"%s\", \"name\": \"%s\", \"ops_per_sample\": %zu, \"repetitions\": %zu, "
+					"\"min_ns\": %.3f, \"median_ns\": %.3f, \"mean_ns\": %.3f, \"p99_ns\": %s, \"p999_ns\": %s, \"max_ns\": %.3f}",
+					i ? "," : "", r.suite.c_str(), r.name.c_str(), r.opsPerSample, r.repetitions,
+					r.minNs, r.medianNs, r.meanNs, _format(p99, r.p99Ns, 3, "null"), _format(p999, r.p999Ns, 3, "null"), r.maxNs);
+			}
+			std::fprintf(file, "\n  ]\n}\n");
+			std::fclose(file);
+			std::printf("[%zu] benchmark results are written into %s\n", m_results.size(), path);
+			return true;
+		}
+
+	private:
+		//missing is written for NaN
+		static const char*		_format(char (&buf)[16], const double ns, const int precision, const char* missing)
+		{
+			if (std::isnan(ns))
+				return missing;
+			std::snprintf(buf, sizeof(buf), "%.*f", precision, ns);
+			return buf;
+		}
+
+		static FILE*			_open(const char* path)
+		{
+			FILE* file = nullptr;
+#if defined(_MSC_VER)
+			if (fopen_s(&file, path, "w"))
+				file = nullptr;
+#else
+			file = std::fopen(path, "w");
+#endif
+			if (!file)
+				std::printf("Can't open benchmark output file[%s]\n", path);
+			return file;
+		}
+
+	private:
+		Config					m_config;
+		std::string				m_suite;
+		std::string				m_csvPath;
+		std::string				m_jsonPath;
+		std::vector<Result>		m_results;
+	};
+}//namespace pool_bench
+
+#endif//MEM_POOL_UTILS_BENCH
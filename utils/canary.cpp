@@ -0,0 +1,46 @@
+#include "canary.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+namespace pool_canary
+{
+	namespace
+	{
+		std::atomic<size_t> g_overruns{ 0u };
+	}
+
+	//-----------------------------------------------------------
+	void fill(void* canary, const size_t size)
+	{
+		std::memset(canary, s_pattern, size);
+	}
+
+	//-----------------------------------------------------------
+	bool check(const char* pool, const void* obj, const void* canary, const size_t size)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(canary);
+		size_t idx = 0u;
+		while (idx < size && bytes[idx] == s_pattern)
+			idx++;
+		if (idx == size)
+			return true;
+
+		g_overruns.fetch_add(1u, std::memory_order_relaxed);
+		//bytes after the first overwritten one show how far the overrun has gone
+		size_t last = size;
+		while (last > idx && bytes[last - 1u] == s_pattern)
+			last--;
+		printf_s("[pool_canary] %s: overrun of object[0x%p] is detected when it's freed, bytes [+%zu, +%zu) of the object are overwritten, first of them is[0x%02x]\n",
+			pool, obj, static_cast<size_t>(bytes + idx - static_cast<const uint8_t*>(obj)),
+			static_cast<size_t>(bytes + last - static_cast<const uint8_t*>(obj)), static_cast<unsigned int>(bytes[idx]));
+		return false;
+	}
+
+	//-----------------------------------------------------------
+	size_t overrunsNumber()
+	{
+		return g_overruns.load(std::memory_order_relaxed);
+	}
+}//namespace pool_canary
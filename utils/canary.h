@@ -0,0 +1,28 @@
+#ifndef MEM_POOL_UTILS_CANARY
+#define MEM_POOL_UTILS_CANARY
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+canary bytes shared by pools in canary mode(*_ENABLE_CANARY macro of the pool).
+Pool pads every block with bytes of a known pattern when it's allocated and checks them when it's freed,
+so an overrun into the neighbour block is reported with the overrun object instead of corrupting the neighbour silently
+*/
+namespace pool_canary
+{
+	//same as "no man's land" of MSVC debug heap
+	constexpr uint8_t s_pattern = 0xFDu;
+
+	void		fill(void* canary, const size_t size);
+	/*
+	true if all canary bytes of the object are intact, otherwise the first overwritten byte is reported.
+	pool - name of the pool for the report
+	*/
+	bool		check(const char* pool, const void* obj, const void* canary, const size_t size);
+
+	//number of overruns detected since start
+	size_t		overrunsNumber();
+}//namespace pool_canary
+
+#endif//MEM_POOL_UTILS_CANARY
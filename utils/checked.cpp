@@ -0,0 +1,562 @@
+#include "checked.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <dbghelp.h>
+#pragma comment(lib, "dbghelp.lib")
+#elif defined(__GLIBC__)
+#include <execinfo.h>
+#endif
+
+/*
+StackBasedPool replaces global operator new, thus the table is taken from calloc.
+Shards are never destroyed, so pools which are destroyed after the exit report can still call hooks
+*/
+namespace pool_check
+{
+	namespace
+	{
+		constexpr size_t s_shardsLog2 = 6u;
+		constexpr size_t s_shardsNumber = size_t(1) << s_shardsLog2;
+		constexpr size_t s_minCapacity = 1024u;
+		constexpr size_t s_siteDepth = POOL_CHECK_SITE_DEPTH;
+		//frames of the checker and of the pool above the caller of the pool
+		constexpr size_t s_maxSkippedFrames = 8u;
+		constexpr size_t s_maxReportedSites = 32u;
+		constexpr size_t s_errorsNumber = static_cast<size_t>(Error::COUNT);
+
+		constexpr uint32_t s_liveEntry = ~0u;
+		//site of allocations above POOL_CHECK_MAX_SITES
+		constexpr uint32_t s_unknownSite = 0u;
+
+		static_assert(POOL_CHECK_SITE_DEPTH >= 1, "site has at least the caller of the pool");
+		static_assert(POOL_CHECK_MAX_SITES >= 2, "one site is reserved for the unknown site");
+
+		//open addressing with linear probing, entries are erased by backward shift
+		struct Entry
+		{
+			//0 - empty slot
+			uintptr_t	ptr;
+			const void*	pool;
+			uint64_t	size;
+			uint32_t	allocSite;
+			//s_liveEntry while the allocation is live
+			uint32_t	freeSite;
+		};
+
+		struct Shard
+		{
+			std::mutex	lock;
+			Entry*		entries;
+			size_t		mask;
+			//live and freed entries
+			size_t		used;
+			size_t		freed;
+		};
+
+		struct State
+		{
+			Shard		shards[s_shardsNumber];
+			//reports aren't interleaved, symbol lookup isn't thread safe on Windows
+			std::mutex	reportLock;
+		};
+
+		struct Site
+		{
+			//hash of frames, 0 - free slot
+			std::atomic<uint64_t>	key;
+			//frames are written after the key is taken
+			std::atomic<bool>		ready;
+			void*					frames[s_siteDepth];
+		};
+
+		Site g_sites[POOL_CHECK_MAX_SITES];
+		std::atomic<size_t> g_errors[s_errorsNumber];
+		//table couldn't grow, unknown pointers can't be told from foreign ones
+		std::atomic<bool> g_incomplete{ false };
+
+		//-----------------------------------------------------------
+		State& state()
+		{
+			alignas(State) static unsigned char storage[sizeof(State)];
+			static State* res = new (storage) State{};
+			return *res;
+		}
+
+		//-----------------------------------------------------------
+		uint64_t mix(uint64_t value)
+		{
+			value ^= value >> 33;
+			value *= 0xff51afd7ed558ccdull;
+			value ^= value >> 33;
+			value *= 0xc4ceb9fe1a85ec53ull;
+			value ^= value >> 33;
+			return value;
+		}
+
+		//-----------------------------------------------------------
+		//high bits of the hash select the shard, low bits - the slot
+		Shard& shardOf(const uint64_t hash)
+		{
+			return state().shards[hash >> (64u - s_shardsLog2)];
+		}
+
+		//-----------------------------------------------------------
+		//slot of ptr or the empty slot where it has to be inserted
+		size_t findSlot(const Shard& shard, const uintptr_t ptr, const uint64_t hash)
+		{
+			size_t idx = hash & shard.mask;
+			while (shard.entries[idx].ptr && shard.entries[idx].ptr != ptr)
+				idx = (idx + 1u) & shard.mask;
+			return idx;
+		}
+
+		//-----------------------------------------------------------
+		Entry* find(Shard& shard, const void* ptr, const uint64_t hash)
+		{
+			if (!shard.entries)
+				return nullptr;
+			Entry& entry = shard.entries[findSlot(shard, reinterpret_cast<uintptr_t>(ptr), hash)];
+			return entry.ptr ? &entry : nullptr;
+		}
+
+		//-----------------------------------------------------------
+		/*
+		rebuilds the shard without entries of the pool(nullptr - of all pools) and without freed entries
+		when there are too many of them, so the table doesn't grow with every address ever used
+		*/
+		bool rebuild(Shard& shard, const void* droppedPool, const bool dropAll)
+		{
+			const bool dropFreed = shard.freed * 2u >= shard.used;
+			size_t kept = 0u;
+			for (size_t i = 0; shard.entries && i <= shard.mask; i++) {
+				const Entry& entry = shard.entries[i];
+				if (entry.ptr && !dropAll && entry.pool != droppedPool && !(dropFreed && entry.freeSite != s_liveEntry))
+					kept++;
+			}
+
+			size_t capacity = s_minCapacity;
+			while (capacity < (kept + 1u) * 3u)
+				capacity *= 2u;
+
+			Entry* entries = static_cast<Entry*>(std::calloc(capacity, sizeof(Entry)));
+			if (!entries)
+				return false;
+
+			Shard res{};
+			res.entries = entries;
+			res.mask = capacity - 1u;
+			for (size_t i = 0; shard.entries && i <= shard.mask; i++) {
+				const Entry& entry = shard.entries[i];
+				if (!entry.ptr || dropAll || entry.pool == droppedPool || (dropFreed && entry.freeSite != s_liveEntry))
+					continue;
+				res.entries[findSlot(res, entry.ptr, mix(entry.ptr))] = entry;
+				res.used++;
+				res.freed += entry.freeSite != s_liveEntry;
+			}
+
+			std::free(shard.entries);
+			shard.entries = res.entries;
+			shard.mask = res.mask;
+			shard.used = res.used;
+			shard.freed = res.freed;
+			return true;
+		}
+
+		//-----------------------------------------------------------
+		//replaces the entry of the same address
+		void insert(Shard& shard, const Entry& entry, const uint64_t hash)
+		{
+			//load factor is kept below 3/4
+			if (!shard.entries || (shard.used + 1u) * 4u > (shard.mask + 1u) * 3u) {
+				if (!rebuild(shard, nullptr, false)) {
+					if (!g_incomplete.exchange(true))
+						printf_s("[pool_check] side table can't grow, new allocations aren't checked\n");
+					return;
+				}
+			}
+
+			Entry& slot = shard.entries[findSlot(shard, entry.ptr, hash)];
+			if (!slot.ptr)
+				shard.used++;
+			else if (slot.freeSite != s_liveEntry)
+				shard.freed--;
+			slot = entry;
+		}
+
+		//-----------------------------------------------------------
+		void erase(Shard& shard, Entry& entry)
+		{
+			shard.used--;
+			if (entry.freeSite != s_liveEntry)
+				shard.freed--;
+
+			//entries after the hole move into it, unless the hole is before their home slot
+			size_t hole = static_cast<size_t>(&entry - shard.entries);
+			size_t next = (hole + 1u) & shard.mask;
+			while (shard.entries[next].ptr) {
+				const size_t home = mix(shard.entries[next].ptr) & shard.mask;
+				if (((next - home) & shard.mask) >= ((next - hole) & shard.mask)) {
+					shard.entries[hole] = shard.entries[next];
+					hole = next;
+				}
+				next = (next + 1u) & shard.mask;
+			}
+			shard.entries[hole] = Entry{};
+		}
+
+		//-----------------------------------------------------------
+		uint32_t internSite(void* const* frames, const size_t number)
+		{
+			uint64_t key = 0u;
+			for (size_t i = 0; i < number; i++)
+				key = mix(key ^ reinterpret_cast<uintptr_t>(frames[i]));
+			key |= 1u;
+
+			constexpr size_t sitesNumber = POOL_CHECK_MAX_SITES - 1u;
+			size_t idx = static_cast<size_t>(key % sitesNumber);
+			for (size_t probe = 0; probe < sitesNumber; probe++) {
+				Site& site = g_sites[idx + 1u];
+				uint64_t cur = site.key.load(std::memory_order_acquire);
+				if (cur == 0u && site.key.compare_exchange_strong(cur, key, std::memory_order_acq_rel)) {
+					for (size_t i = 0; i < s_siteDepth; i++)
+						site.frames[i] = i < number ? frames[i] : nullptr;
+					site.ready.store(true, std::memory_order_release);
+					return static_cast<uint32_t>(idx + 1u);
+				}
+				if (cur == key)
+					return static_cast<uint32_t>(idx + 1u);
+				idx = (idx + 1u) % sitesNumber;
+			}
+			return s_unknownSite;
+		}
+
+		//-----------------------------------------------------------
+		//site starts at the caller of the pool, frames of the checker and of the pool are skipped
+		uint32_t captureSite(const void* caller)
+		{
+			void* frames[s_siteDepth + s_maxSkippedFrames];
+			size_t number = 0u;
+#if POOL_CHECK_SITE_DEPTH > 1
+#if defined(_WIN32)
+			number = CaptureStackBackTrace(0, static_cast<DWORD>(s_siteDepth + s_maxSkippedFrames), frames, nullptr);
+#elif defined(__GLIBC__)
+			const int captured = backtrace(frames, static_cast<int>(s_siteDepth + s_maxSkippedFrames));
+			number = captured > 0 ? static_cast<size_t>(captured) : 0u;
+#endif
+#endif//POOL_CHECK_SITE_DEPTH > 1
+
+			size_t first = 0u;
+			while (first < number && frames[first] != caller)
+				first++;
+			if (first == number) {
+				//stack can't be walked on the platform or the caller is inlined
+				frames[0] = const_cast<void*>(caller);
+				first = 0u;
+				number = 1u;
+			}
+			return internSite(frames + first, std::min(number - first, s_siteDepth));
+		}
+
+		//-----------------------------------------------------------
+		void symbolName(void* frame, char* name, const size_t nameSize)
+		{
+			name[0] = '\0';
+#if defined(_WIN32)
+			static const bool initialized = SymInitialize(GetCurrentProcess(), nullptr, TRUE) != FALSE;
+			if (!initialized)
+				return;
+
+			alignas(SYMBOL_INFO) char storage[sizeof(SYMBOL_INFO) + MAX_SYM_NAME];
+			SYMBOL_INFO* symbol = reinterpret_cast<SYMBOL_INFO*>(storage);
+			symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+			symbol->MaxNameLen = MAX_SYM_NAME;
+			DWORD64 displacement = 0u;
+			if (!SymFromAddr(GetCurrentProcess(), reinterpret_cast<DWORD64>(frame), &displacement, symbol))
+				return;
+
+			IMAGEHLP_LINE64 line{};
+			line.SizeOfStruct = sizeof(line);
+			DWORD lineDisplacement = 0u;
+			if (SymGetLineFromAddr64(GetCurrentProcess(), reinterpret_cast<DWORD64>(frame), &lineDisplacement, &line))
+				std::snprintf(name, nameSize, "%s %s:%lu", symbol->Name, line.FileName, line.LineNumber);
+			else
+				std::snprintf(name, nameSize, "%s+0x%llx", symbol->Name, static_cast<unsigned long long>(displacement));
+#elif defined(__GLIBC__)
+			char** symbols = backtrace_symbols(&frame, 1);
+			if (symbols) {
+				std::snprintf(name, nameSize, "%s", symbols[0]);
+				std::free(symbols);
+			}
+#else
+			(void)frame;
+			(void)nameSize;
+#endif
+		}
+
+		//-----------------------------------------------------------
+		//caller holds reportLock
+		void printSite(const char* title, const uint32_t siteIdx)
+		{
+			const Site& site = g_sites[siteIdx];
+			if (siteIdx == s_unknownSite || !site.ready.load(std::memory_order_acquire)) {
+				printf_s("[pool_check]   %s unknown site\n", title);
+				return;
+			}
+
+			printf_s("[pool_check]   %s\n", title);
+			char name[512];
+			for (size_t i = 0; i < s_siteDepth && site.frames[i]; i++) {
+				symbolName(site.frames[i], name, sizeof(name));
+				printf_s("[pool_check]     #%zu 0x%p %s\n", i, site.frames[i], name);
+			}
+		}
+
+		//-----------------------------------------------------------
+		Error classify(const Entry* entry, const void* pool)
+		{
+			if (!entry)
+				return Error::FOREIGN_POINTER;
+			if (entry->freeSite != s_liveEntry)
+				return Error::DOUBLE_FREE;
+			return entry->pool == pool ? Error::NONE : Error::WRONG_POOL;
+		}
+
+		//-----------------------------------------------------------
+		//entry - copy of the entry of ptr, nullptr if there is none
+		void reportError(const Error error, const void* pool, const void* ptr, const bool owned, const uint32_t site, const Entry* entry)
+		{
+			g_errors[static_cast<size_t>(error)].fetch_add(1u, std::memory_order_relaxed);
+
+			std::lock_guard<std::mutex> lock(state().reportLock);
+			switch (error) {
+			case Error::DOUBLE_FREE:
+				printf_s("[pool_check] double free of [0x%p] of size[%llu] in pool[0x%p]\n",
+					ptr, static_cast<unsigned long long>(entry->size), pool);
+				break;
+			case Error::WRONG_POOL:
+				printf_s("[pool_check] free of [0x%p] of size[%llu] in pool[0x%p], but it's allocated by pool[0x%p]\n",
+					ptr, static_cast<unsigned long long>(entry->size), pool, entry->pool);
+				break;
+			case Error::FOREIGN_POINTER:
+				printf_s(owned ? "[pool_check] free of [0x%p] in pool[0x%p], which points inside of the pool, but isn't an allocation\n"
+					: "[pool_check] free of [0x%p] in pool[0x%p], which isn't allocated by any pool\n", ptr, pool);
+				break;
+			case Error::WRONG_ORDER:
+				printf_s("[pool_check] free of [0x%p] of size[%llu] in pool[0x%p] in wrong order, only the last allocation can be freed\n",
+					ptr, static_cast<unsigned long long>(entry->size), pool);
+				break;
+			default:
+				return;
+			}
+
+			printSite("freed at:", site);
+			if (entry) {
+				printSite("allocated at:", entry->allocSite);
+				if (error == Error::DOUBLE_FREE)
+					printSite("previously freed at:", entry->freeSite);
+			}
+		}
+
+		//-----------------------------------------------------------
+		/*
+		prints live allocations of the pool(nullptr - of all pools) grouped by site, largest sites first.
+		drop - entries of the pool are removed, both live and freed ones
+		*/
+		size_t reportLeaks(const void* pool, const bool drop, const char* when)
+		{
+			uint64_t* counts = static_cast<uint64_t*>(std::calloc(POOL_CHECK_MAX_SITES * 2u, sizeof(uint64_t)));
+			uint64_t* bytes = counts ? counts + POOL_CHECK_MAX_SITES : nullptr;
+
+			size_t leaks = 0u;
+			uint64_t leakedBytes = 0u;
+			for (Shard& shard : state().shards) {
+				std::lock_guard<std::mutex> lock(shard.lock);
+				for (size_t i = 0; shard.entries && i <= shard.mask; i++) {
+					const Entry& entry = shard.entries[i];
+					if (!entry.ptr || (pool && entry.pool != pool) || entry.freeSite != s_liveEntry)
+						continue;
+					leaks++;
+					leakedBytes += entry.size;
+					if (counts) {
+						counts[entry.allocSite]++;
+						bytes[entry.allocSite] += entry.size;
+					}
+				}
+				if (drop && shard.entries && !rebuild(shard, pool, !pool)) {
+					//table stays as it is, entries of the dropped pool are forgotten one by one
+					for (size_t i = 0; i <= shard.mask; i++) {
+						while (shard.entries[i].ptr && (!pool || shard.entries[i].pool == pool))
+							erase(shard, shard.entries[i]);
+					}
+				}
+			}
+
+			if (leaks) {
+				std::lock_guard<std::mutex> lock(state().reportLock);
+				if (pool)
+					printf_s("[pool_check] pool[0x%p] leaks [%zu] allocations, [%llu] bytes %s\n", pool, leaks, static_cast<unsigned long long>(leakedBytes), when);
+				else
+					printf_s("[pool_check] [%zu] allocations, [%llu] bytes are live %s\n", leaks, static_cast<unsigned long long>(leakedBytes), when);
+
+				uint32_t* sites = counts ? static_cast<uint32_t*>(std::malloc(POOL_CHECK_MAX_SITES * sizeof(uint32_t))) : nullptr;
+				size_t sitesNumber = 0u;
+				for (size_t i = 0; sites && i < POOL_CHECK_MAX_SITES; i++) {
+					if (counts[i])
+						sites[sitesNumber++] = static_cast<uint32_t>(i);
+				}
+				std::sort(sites, sites + sitesNumber, [bytes](const uint32_t l, const uint32_t r) { return bytes[l] > bytes[r]; });
+
+				char title[128];
+				for (size_t i = 0; i < sitesNumber && i < s_maxReportedSites; i++) {
+					std::snprintf(title, sizeof(title), "[%llu] allocations, [%llu] bytes allocated at:",
+						static_cast<unsigned long long>(counts[sites[i]]), static_cast<unsigned long long>(bytes[sites[i]]));
+					printSite(title, sites[i]);
+				}
+				if (sitesNumber > s_maxReportedSites)
+					printf_s("[pool_check]   ... and [%zu] more sites\n", sitesNumber - s_maxReportedSites);
+				std::free(sites);
+			}
+			std::free(counts);
+			return leaks;
+		}
+
+		//leaks of pools which are still alive at exit, e.g. global ones
+		struct ExitReport
+		{
+			~ExitReport() { reportLeaks(nullptr, true, "at exit"); }
+		} g_exitReport;
+	}
+
+	//-----------------------------------------------------------
+	void onAlloc(const void* pool, const void* ptr, const size_t size, const void* caller)
+	{
+		if (!ptr)
+			return;
+
+		const uint32_t site = captureSite(caller);
+		const uint64_t hash = mix(reinterpret_cast<uintptr_t>(ptr));
+		Shard& shard = shardOf(hash);
+		std::lock_guard<std::mutex> lock(shard.lock);
+		insert(shard, Entry{ reinterpret_cast<uintptr_t>(ptr), pool, size, site, s_liveEntry }, hash);
+	}
+
+	//-----------------------------------------------------------
+	Error onFree(const void* pool, const void* ptr, const bool owned, const void* caller)
+	{
+		const uint32_t site = captureSite(caller);
+		const uint64_t hash = mix(reinterpret_cast<uintptr_t>(ptr));
+		Shard& shard = shardOf(hash);
+
+		Entry entry{};
+		Error res = Error::NONE;
+		{
+			std::lock_guard<std::mutex> lock(shard.lock);
+			Entry* cur = find(shard, ptr, hash);
+			res = classify(cur, pool);
+			if (cur)
+				entry = *cur;
+			if (res == Error::NONE) {
+				cur->freeSite = site;
+				shard.freed++;
+			}
+		}
+
+		if (res == Error::FOREIGN_POINTER && owned && g_incomplete.load(std::memory_order_relaxed))
+			return Error::NONE;
+		if (res != Error::NONE)
+			reportError(res, pool, ptr, owned, site, res == Error::FOREIGN_POINTER ? nullptr : &entry);
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	Error onRejectedFree(const void* pool, const void* ptr, const bool owned, const void* caller)
+	{
+		const uint32_t site = captureSite(caller);
+		const uint64_t hash = mix(reinterpret_cast<uintptr_t>(ptr));
+		Shard& shard = shardOf(hash);
+
+		Entry entry{};
+		Error res = Error::NONE;
+		{
+			std::lock_guard<std::mutex> lock(shard.lock);
+			const Entry* cur = find(shard, ptr, hash);
+			res = classify(cur, pool);
+			if (cur)
+				entry = *cur;
+		}
+
+		if (res == Error::NONE)
+			res = Error::WRONG_ORDER;
+		reportError(res, pool, ptr, owned, site, res == Error::FOREIGN_POINTER ? nullptr : &entry);
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	void onMove(const void* pool, const void* from, const void* to)
+	{
+		if (from == to)
+			return;
+
+		const uint64_t fromHash = mix(reinterpret_cast<uintptr_t>(from));
+		Entry entry{};
+		{
+			Shard& shard = shardOf(fromHash);
+			std::lock_guard<std::mutex> lock(shard.lock);
+			Entry* cur = find(shard, from, fromHash);
+			//handles can point inside of an allocation, such pointers aren't tracked
+			if (!cur || cur->pool != pool || cur->freeSite != s_liveEntry)
+				return;
+			entry = *cur;
+			erase(shard, *cur);
+		}
+
+		entry.ptr = reinterpret_cast<uintptr_t>(to);
+		const uint64_t toHash = mix(entry.ptr);
+		Shard& shard = shardOf(toHash);
+		std::lock_guard<std::mutex> lock(shard.lock);
+		insert(shard, entry, toHash);
+	}
+
+	//-----------------------------------------------------------
+	void onReset(const void* pool)
+	{
+		if (pool)
+			reportLeaks(pool, true, "when it's destroyed or cleaned");
+	}
+
+	//-----------------------------------------------------------
+	size_t errorsNumber(const Error error)
+	{
+		const size_t idx = static_cast<size_t>(error);
+		return idx < s_errorsNumber ? g_errors[idx].load(std::memory_order_relaxed) : 0u;
+	}
+
+	//-----------------------------------------------------------
+	size_t liveNumber()
+	{
+		size_t res = 0u;
+		for (Shard& shard : state().shards) {
+			std::lock_guard<std::mutex> lock(shard.lock);
+			res += shard.used - shard.freed;
+		}
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	size_t reportLeaks()
+	{
+		return reportLeaks(nullptr, false, "now");
+	}
+}//namespace pool_check
@@ -0,0 +1,80 @@
+#ifndef MEM_POOL_UTILS_CHECKED
+#define MEM_POOL_UTILS_CHECKED
+
+#include <cstdint>
+#include <cstddef>
+
+//return address of the current function, i.e. the call site of the pool
+#if defined(_MSC_VER)
+#include <intrin.h>
+#pragma intrinsic(_ReturnAddress)
+#define POOL_CHECK_CALLER() _ReturnAddress()
+#else
+#define POOL_CHECK_CALLER() __builtin_return_address(0)
+#endif
+
+/*
+number of frames which identify the allocation site, starting at the caller of the pool.
+1 - only the return address of the pool, which is free, but it's usually a wrapper of the pool
+(AlignedPoolManager, operator new, HeapStorageHandles), deeper sites take a stack walk per allocation and free
+*/
+#ifndef POOL_CHECK_SITE_DEPTH
+#define POOL_CHECK_SITE_DEPTH 4
+#endif
+
+//sites are kept till exit, allocations from sites above the limit are counted as one unknown site
+#ifndef POOL_CHECK_MAX_SITES
+#define POOL_CHECK_MAX_SITES 4096
+#endif
+
+/*
+checked mode shared by all pools(*_ENABLE_CHECKED macro of the pool).
+Pool registers every allocation with its owner and site in a side table, frees are validated before
+the pool touches own metadata, so double frees, frees of pointers of other pools or of no pool at all
+and frees of StackBasedPool in wrong order are reported and rejected instead of corrupting the pool.
+Freed entries are kept till the address is reused, so a double free reports where the object has been freed.
+Allocations which are still live when the pool is destroyed are reported as leaks grouped by site,
+the rest of them is reported at exit.
+Table is sharded by address, 32 bytes per entry, so it's cheap enough to be kept on in canary builds
+*/
+namespace pool_check
+{
+	enum class Error : uint8_t
+	{
+		NONE = 0,
+		DOUBLE_FREE,
+		//pointer is a live allocation of another pool
+		WRONG_POOL,
+		//pointer isn't an allocation of any pool, e.g. it points inside of an allocation
+		FOREIGN_POINTER,
+		//StackBasedPool can free only the last allocation
+		WRONG_ORDER,
+		COUNT,
+	};
+
+	/*
+	pool is an address which identifies the pool while it's alive and doesn't change when the pool is moved,
+	e.g. its memory. caller - POOL_CHECK_CALLER() of the pool function
+	*/
+	void		onAlloc(const void* pool, const void* ptr, const size_t size, const void* caller);
+	/*
+	NONE if ptr is a live allocation of the pool, it's marked as freed then.
+	Otherwise the error is reported and the pool mustn't free ptr. owned - ptr is inside of the memory of the pool
+	*/
+	Error		onFree(const void* pool, const void* ptr, const bool owned, const void* caller);
+	//reports the free which the pool has rejected itself(StackBasedPool in wrong order), returns the reported error
+	Error		onRejectedFree(const void* pool, const void* ptr, const bool owned, const void* caller);
+	//live allocation is moved by the pool(HeapStorage defragmentation)
+	void		onMove(const void* pool, const void* from, const void* to);
+	//pool is destroyed or cleaned, its live allocations are reported as leaks and all its entries are dropped
+	void		onReset(const void* pool);
+
+	//number of errors of the kind detected since start
+	size_t		errorsNumber(const Error error);
+	//number of live allocations of all pools
+	size_t		liveNumber();
+	//prints live allocations of all pools grouped by site, returns their number
+	size_t		reportLeaks();
+}//namespace pool_check
+
+#endif//MEM_POOL_UTILS_CHECKED
@@ -0,0 +1,269 @@
+#include "latency.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+/*
+StackBasedPool replaces global operator new, thus histograms are taken from calloc,
+otherwise measuring of the pool would recurse into the pool
+*/
+namespace pool_latency
+{
+	namespace
+	{
+		constexpr size_t s_subBucketsLog2 = POOL_LATENCY_SUB_BUCKETS_LOG2;
+		constexpr size_t s_subBuckets = size_t(1) << s_subBucketsLog2;
+		//latency from 2^(s_maxLog2 + 1) ns(~36 minutes) goes to the last bucket
+		constexpr size_t s_maxLog2 = 40u;
+		constexpr size_t s_bucketsNumber = (s_maxLog2 - s_subBucketsLog2 + 2) * s_subBuckets;
+
+		constexpr size_t s_kindsNumber = static_cast<size_t>(PoolKind::COUNT);
+		constexpr size_t s_opsNumber = static_cast<size_t>(Op::COUNT);
+
+		struct Histogram
+		{
+			std::atomic<uint64_t>	buckets[s_bucketsNumber];
+			std::atomic<uint64_t>	count;
+			std::atomic<uint64_t>	sum;
+			std::atomic<uint64_t>	min;
+			std::atomic<uint64_t>	max;
+		};
+
+		//histograms are created by the first record of the key
+		std::atomic<Histogram*> g_histograms[s_kindsNumber][s_opsNumber][s_sizeClassesNumber];
+
+		//-----------------------------------------------------------
+		size_t highestBit(uint64_t value)
+		{
+			size_t res = 0u;
+			while (value >>= 1)
+				res++;
+			return res;
+		}
+
+		//-----------------------------------------------------------
+		//values below 2 * s_subBuckets have own buckets, every next power of two is split into s_subBuckets
+		size_t bucketIdx(const uint64_t value)
+		{
+			if (value < s_subBuckets)
+				return static_cast<size_t>(value);
+
+			const uint64_t v = value >> (s_maxLog2 + 1) ? (uint64_t(2) << s_maxLog2) - 1u : value;
+			const size_t log2 = highestBit(v);
+			const size_t sub = static_cast<size_t>(v >> (log2 - s_subBucketsLog2)) & (s_subBuckets - 1);
+			return (log2 - s_subBucketsLog2 + 1) * s_subBuckets + sub;
+		}
+
+		//-----------------------------------------------------------
+		//last value of the bucket
+		uint64_t bucketUpperBound(const size_t idx)
+		{
+			if (idx < s_subBuckets)
+				return idx;
+
+			const size_t log2 = idx / s_subBuckets + s_subBucketsLog2 - 1;
+			const uint64_t step = uint64_t(1) << (log2 - s_subBucketsLog2);
+			return ((s_subBuckets + idx % s_subBuckets) << (log2 - s_subBucketsLog2)) + step - 1;
+		}
+
+		//-----------------------------------------------------------
+		uint64_t bucketLowerBound(const size_t idx)
+		{
+			if (idx < s_subBuckets)
+				return idx;
+
+			const size_t log2 = idx / s_subBuckets + s_subBucketsLog2 - 1;
+			return (s_subBuckets + idx % s_subBuckets) << (log2 - s_subBucketsLog2);
+		}
+
+		//-----------------------------------------------------------
+		size_t sizeClass(const size_t size)
+		{
+			const size_t res = size ? highestBit(size) + 1u : 0u;
+			return res < s_sizeClassesNumber ? res : s_sizeClassesNumber - 1u;
+		}
+
+		//-----------------------------------------------------------
+		Histogram* getHistogram(const PoolKind kind, const Op op, const size_t size)
+		{
+			std::atomic<Histogram*>& slot = g_histograms[static_cast<size_t>(kind)][static_cast<size_t>(op)][sizeClass(size)];
+			Histogram* res = slot.load(std::memory_order_acquire);
+			if (res)
+				return res;
+
+			void* mem = std::calloc(1, sizeof(Histogram));
+			if (!mem)
+				return nullptr;
+			Histogram* created = new (mem) Histogram{};
+			created->min.store(~uint64_t(0), std::memory_order_relaxed);
+
+			//another thread could have created it first
+			if (!slot.compare_exchange_strong(res, created, std::memory_order_acq_rel)) {
+				created->~Histogram();
+				std::free(mem);
+				return res;
+			}
+			return created;
+		}
+
+		//-----------------------------------------------------------
+		uint64_t percentile(const Histogram& h, const uint64_t count, const double p)
+		{
+			const uint64_t rank = static_cast<uint64_t>(p * count + 0.999999);
+			uint64_t accum = 0u;
+			for (size_t i = 0; i < s_bucketsNumber; i++) {
+				accum += h.buckets[i].load(std::memory_order_relaxed);
+				if (accum >= rank)
+					return bucketUpperBound(i);
+			}
+			return bucketUpperBound(s_bucketsNumber - 1u);
+		}
+
+		//-----------------------------------------------------------
+		FILE* openFile(const char* path, const char* mode)
+		{
+			FILE* file = nullptr;
+#if defined(_MSC_VER)
+			if (fopen_s(&file, path, mode))
+				file = nullptr;
+#else
+			file = std::fopen(path, mode);
+#endif
+			return file;
+		}
+
+		const char* s_kindNames[s_kindsNumber] = { "Aligned Pool", "Stack Based Pool", "Heap Storage" };
+		const char* s_opNames[s_opsNumber] = { "malloc", "malloc_n", "free", "free_n" };
+	}
+
+	//-----------------------------------------------------------
+	uint64_t now()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	//-----------------------------------------------------------
+	void record(const PoolKind kind, const Op op, const size_t size, const uint64_t latencyNs)
+	{
+		Histogram* h = getHistogram(kind, op, size);
+		if (!h)
+			return;
+
+		h->buckets[bucketIdx(latencyNs)].fetch_add(1u, std::memory_order_relaxed);
+		h->count.fetch_add(1u, std::memory_order_relaxed);
+		h->sum.fetch_add(latencyNs, std::memory_order_relaxed);
+
+		uint64_t cur = h->min.load(std::memory_order_relaxed);
+		while (latencyNs < cur && !h->min.compare_exchange_weak(cur, latencyNs, std::memory_order_relaxed)) {}
+		cur = h->max.load(std::memory_order_relaxed);
+		while (latencyNs > cur && !h->max.compare_exchange_weak(cur, latencyNs, std::memory_order_relaxed)) {}
+	}
+
+	//-----------------------------------------------------------
+	bool summary(const PoolKind kind, const Op op, const size_t sizeClass, Summary& res)
+	{
+		if (sizeClass >= s_sizeClassesNumber)
+			return false;
+
+		const Histogram* h = g_histograms[static_cast<size_t>(kind)][static_cast<size_t>(op)][sizeClass].load(std::memory_order_acquire);
+		const uint64_t count = h ? h->count.load(std::memory_order_relaxed) : 0u;
+		if (!count)
+			return false;
+
+		res.count = count;
+		res.minNs = h->min.load(std::memory_order_relaxed);
+		res.maxNs = h->max.load(std::memory_order_relaxed);
+		res.meanNs = static_cast<double>(h->sum.load(std::memory_order_relaxed)) / count;
+		//bound of the last bucket can be above the max
+		res.p50Ns = std::min(percentile(*h, count, 0.5), res.maxNs);
+		res.p99Ns = std::min(percentile(*h, count, 0.99), res.maxNs);
+		res.p999Ns = std::min(percentile(*h, count, 0.999), res.maxNs);
+		return true;
+	}
+
+	//-----------------------------------------------------------
+	void print()
+	{
+		printf_s("#--------------------------------------------------------------------#\n");
+		for (size_t k = 0; k < s_kindsNumber; k++) {
+			for (size_t o = 0; o < s_opsNumber; o++) {
+				for (size_t c = 0; c < s_sizeClassesNumber; c++) {
+					Summary s{};
+					if (!summary(static_cast<PoolKind>(k), static_cast<Op>(o), c, s))
+						continue;
+
+					printf_s("%s %s size[%llu, %llu): count[%llu] mean[%.1f ns] p50[%llu ns] p99[%llu ns] p99.9[%llu ns] min[%llu ns] max[%llu ns]\n",
+						s_kindNames[k], s_opNames[o],
+						static_cast<unsigned long long>(c ? uint64_t(1) << (c - 1) : 0u),
+						static_cast<unsigned long long>(uint64_t(1) << c),
+						static_cast<unsigned long long>(s.count), s.meanNs,
+						static_cast<unsigned long long>(s.p50Ns), static_cast<unsigned long long>(s.p99Ns),
+						static_cast<unsigned long long>(s.p999Ns), static_cast<unsigned long long>(s.minNs),
+						static_cast<unsigned long long>(s.maxNs));
+				}
+			}
+		}
+		printf_s("#--------------------------------------------------------------------#\n");
+	}
+
+	//-----------------------------------------------------------
+	bool dump(const char* path)
+	{
+		FILE* file = openFile(path, "w");
+		if (!file) {
+			printf_s("Can't open latency file[%s]\n", path);
+			return false;
+		}
+
+		std::fprintf(file, "pool,op,size_from,size_to,latency_from_ns,latency_to_ns,count\n");
+		for (size_t k = 0; k < s_kindsNumber; k++) {
+			for (size_t o = 0; o < s_opsNumber; o++) {
+				for (size_t c = 0; c < s_sizeClassesNumber; c++) {
+					const Histogram* h = g_histograms[k][o][c].load(std::memory_order_acquire);
+					if (!h)
+						continue;
+
+					for (size_t i = 0; i < s_bucketsNumber; i++) {
+						const uint64_t count = h->buckets[i].load(std::memory_order_relaxed);
+						if (!count)
+							continue;
+						std::fprintf(file, "\"%s\",%s,%llu,%llu,%llu,%llu,%llu\n", s_kindNames[k], s_opNames[o],
+							static_cast<unsigned long long>(c ? uint64_t(1) << (c - 1) : 0u),
+							static_cast<unsigned long long>(uint64_t(1) << c),
+							static_cast<unsigned long long>(bucketLowerBound(i)),
+							static_cast<unsigned long long>(bucketUpperBound(i)),
+							static_cast<unsigned long long>(count));
+					}
+				}
+			}
+		}
+		std::fclose(file);
+		return true;
+	}
+
+	//-----------------------------------------------------------
+	void reset()
+	{
+		for (size_t k = 0; k < s_kindsNumber; k++) {
+			for (size_t o = 0; o < s_opsNumber; o++) {
+				for (size_t c = 0; c < s_sizeClassesNumber; c++) {
+					Histogram* h = g_histograms[k][o][c].load(std::memory_order_acquire);
+					if (!h)
+						continue;
+
+					for (std::atomic<uint64_t>& bucket : h->buckets)
+						bucket.store(0u, std::memory_order_relaxed);
+					h->count.store(0u, std::memory_order_relaxed);
+					h->sum.store(0u, std::memory_order_relaxed);
+					h->min.store(~uint64_t(0), std::memory_order_relaxed);
+					h->max.store(0u, std::memory_order_relaxed);
+				}
+			}
+		}
+	}
+}//namespace pool_latency
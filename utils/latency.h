@@ -0,0 +1,97 @@
+#ifndef MEM_POOL_UTILS_LATENCY
+#define MEM_POOL_UTILS_LATENCY
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+latency of every power of two of nanoseconds is split into 2^POOL_LATENCY_SUB_BUCKETS_LOG2 linear buckets,
+thus relative error of percentiles is below 1 / 2^POOL_LATENCY_SUB_BUCKETS_LOG2
+*/
+#ifndef POOL_LATENCY_SUB_BUCKETS_LOG2
+#define POOL_LATENCY_SUB_BUCKETS_LOG2 3
+#endif
+
+/*
+log-bucketed(HDR style) histograms of latency of pool operations shared by all pools.
+Pool records a call when its latency instrumentation is on(*_ENABLE_LATENCY macro of the pool),
+histograms are kept per kind of the pool, operation and power of two size class of the request.
+Recording is lock free, so concurrent pools can be measured too
+*/
+namespace pool_latency
+{
+	enum class PoolKind : uint8_t
+	{
+		ALIGNED_POOL = 0,
+		STACK_BASED_POOL,
+		HEAP_STORAGE,
+		COUNT,
+	};
+
+	enum class Op : uint8_t
+	{
+		MALLOC = 0,
+		MALLOC_N,
+		FREE,
+		FREE_N,
+		COUNT,
+	};
+
+	//size class c keeps requests with size in [2^(c-1), 2^c), class 0 - size 0(e.g. failed free)
+	constexpr size_t s_sizeClassesNumber = 32u;
+
+	//nanoseconds of the steady clock
+	uint64_t	now();
+
+	void		record(const PoolKind kind, const Op op, const size_t size, const uint64_t latencyNs);
+
+	struct Summary
+	{
+		uint64_t	count;
+		uint64_t	minNs;
+		uint64_t	maxNs;
+		double		meanNs;
+		//upper bounds of buckets which contain the percentile
+		uint64_t	p50Ns;
+		uint64_t	p99Ns;
+		uint64_t	p999Ns;
+	};
+
+	//false if nothing has been recorded for the key
+	bool		summary(const PoolKind kind, const Op op, const size_t sizeClass, Summary& res);
+
+	//prints summary of every non-empty histogram
+	void		print();
+
+	//writes non-empty buckets as CSV: kind, op, size class range, bucket range and count
+	bool		dump(const char* path);
+
+	//clears all histograms, calls which are being recorded at the same time can be lost or kept
+	void		reset();
+
+	//records latency of the scope, size can be set later when it's known only at the end of the call
+	class Scope
+	{
+	public:
+					Scope(const PoolKind kind, const Op op, const size_t size)
+						: m_start{ now() }
+						, m_size{ size }
+						, m_kind{ kind }
+						, m_op{ op }
+					{}
+					~Scope() { record(m_kind, m_op, m_size, now() - m_start); }
+
+					Scope(const Scope&) = delete;
+		Scope&		operator=(const Scope&) = delete;
+
+		void		setSize(const size_t size) { m_size = size; }
+
+	private:
+		uint64_t	m_start;
+		size_t		m_size;
+		PoolKind	m_kind;
+		Op			m_op;
+	};
+}//namespace pool_latency
+
+#endif//MEM_POOL_UTILS_LATENCY
@@ -2,22 +2,40 @@
 
 #if defined(PROJ_ALIGNED_POOL)
 
-int main()
+int main(int argc, char** argv)
 {
+	if (pool_utils::decodeTraceArgument(argc, argv))
+		return 0;
+
+	pool_bench::Report report;
+	report.parseArguments(argc, argv);
+
 	align_pool::setupPoolManager();
 
-	pool_utils::timingTest<4>();
-	pool_utils::timingTest<16>();
-	pool_utils::timingTest<64>();
-	pool_utils::timingTest<128>();
-	pool_utils::timingTest<256>();
+	if (pool_utils::replayTraceArgument(argc, argv))
+		return 0;
+	if (pool_utils::soakTestArgument(argc, argv))
+		return 0;
+	pool_utils::recordTraceArgument(argc, argv);
+
+	pool_utils::timingTest<4>(report);
+	pool_utils::timingTest<16>(report);
+	pool_utils::timingTest<64>(report);
+	pool_utils::timingTest<128>(report);
+	pool_utils::timingTest<256>(report);
+
+	pool_utils::timingTest2<8>(report);
+	pool_utils::timingTest2<16>(report);
+	pool_utils::timingTest2<64>(report);
+	pool_utils::timingTest2<128>(report);
+	pool_utils::timingTest2<512>(report);
 
-	pool_utils::timingTest2<8>();
-	pool_utils::timingTest2<16>();
-	pool_utils::timingTest2<64>();
-	pool_utils::timingTest2<128>();
-	pool_utils::timingTest2<512>();
+	pool_utils::latencyTestFragmentedMallocN();
 
+	report.write(g_poolName);
+	pool_utils::stopTraceRecording();
+	pool_utils::dumpTrace();
+	pool_utils::dumpLatency();
 	return 0;
 }
 
@@ -25,30 +43,83 @@ int main()
 
 int main(int argc, char** arvg)
 {
+	if (pool_utils::decodeTraceArgument(argc, arvg))
+		return 0;
+	if (pool_utils::replayTraceArgument(argc, arvg))
+		return 0;
+	pool_utils::recordTraceArgument(argc, arvg);
+
+	pool_bench::Report report;
+	report.parseArguments(argc, arvg);
+
 	//pool_utils::timingTest<4>();
 	//pool_utils::timingTest<400>();
 	//pool_utils::timingTest<4000>();
 
-	pool_utils::timingTest2<12>();
-	pool_utils::timingTest2<16>();
-	pool_utils::timingTest2<64>();
-	pool_utils::timingTest2<128>();
-	pool_utils::timingTest2<512>();
+	pool_utils::timingTest2<12>(report);
+	pool_utils::timingTest2<16>(report);
+	pool_utils::timingTest2<64>(report);
+	pool_utils::timingTest2<128>(report);
+	pool_utils::timingTest2<512>(report);
 
+	report.write(g_poolName);
+	pool_utils::printLatency();
+	pool_utils::stopTraceRecording();
+	pool_utils::dumpTrace();
+	pool_utils::dumpLatency();
 	return 0;
 }
 
 #elif defined(PROJ_HEAP_BASED_POOL)
 
-int main()
+int main(int argc, char** argv)
 {
-	pool_utils::timingTestHandle<4>();
-	pool_utils::timingTestHandle<16>();
-	pool_utils::timingTestHandle<64>();
-	pool_utils::timingTestHandle<256>();
+	if (pool_utils::decodeTraceArgument(argc, argv))
+		return 0;
+	if (pool_utils::replayTraceArgument(argc, argv))
+		return 0;
+	if (pool_utils::soakTestArgument(argc, argv))
+		return 0;
+	pool_utils::recordTraceArgument(argc, argv);
+
+	pool_bench::Report report;
+	report.parseArguments(argc, argv);
+
+	pool_utils::timingTestHandle<4>(report);
+	pool_utils::timingTestHandle<16>(report);
+	pool_utils::timingTestHandle<64>(report);
+	pool_utils::timingTestHandle<256>(report);
 
 	pool_utils::HandleTestReinitFeature();
 	pool_utils::HandleTestDefragmentationFeature();
+	pool_utils::HandleTestIncrementalDefragmentation();
+	pool_utils::HandleTestRelocation();
+	pool_utils::HandleTestConcurrentHeapStorage();
+	pool_utils::timingTestBackgroundCompactor();
+
+	pool_utils::timingTestHeapStorageHandles<16>(report);
+	pool_utils::timingTestHeapStorageHandles<64>(report);
+
+	pool_utils::timingTest2<16>(report);
+	pool_utils::timingTest2<64>(report);
+	pool_utils::timingTest2<512>(report);
+
+	pool_utils::timingTestSmallObjects<16>(report);
+	pool_utils::timingTestSmallObjects<200>(report);
+
+	pool_utils::timingTestPlacementPolicy();
+
+	pool_utils::timingTestPinnedHandle<16>(report);
+	pool_utils::timingTestPinnedHandle<64>(report);
+
+	pool_utils::latencyTestHeapStorage();
+
+	pool_utils::scalingTest(report);
+
+	report.write(g_poolName);
+	pool_utils::stopTraceRecording();
+	pool_utils::dumpTrace();
+	pool_utils::dumpLatency();
 	return 0;
 }
 
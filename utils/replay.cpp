@@ -0,0 +1,247 @@
+#include "replay.h"
+#include "trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#endif
+
+/*
+StackBasedPool replaces global operator new, thus requests and buffers of the loader
+are taken from malloc, otherwise loading of the trace would allocate from the pool
+*/
+namespace pool_replay
+{
+	namespace
+	{
+		constexpr uint32_t s_noId = ~0u;
+		constexpr uint8_t s_maxAlignLog2 = 4u;
+
+		//-----------------------------------------------------------
+		FILE* openFile(const char* path, const char* mode)
+		{
+			FILE* file = nullptr;
+#if defined(_MSC_VER)
+			if (fopen_s(&file, path, mode))
+				file = nullptr;
+#else
+			file = std::fopen(path, mode);
+#endif
+			return file;
+		}
+
+		//-----------------------------------------------------------
+		uint8_t naturalAlignLog2(uint64_t size)
+		{
+			uint8_t res = 0u;
+			while (size && !(size & 1u) && res < s_maxAlignLog2) {
+				size >>= 1;
+				res++;
+			}
+			return res;
+		}
+	}
+
+	//-----------------------------------------------------------
+	Trace::Trace()
+		: m_requests{ nullptr }
+		, m_size{ 0u }
+		, m_objectsNumber{ 0u }
+	{
+	}
+
+	//-----------------------------------------------------------
+	Trace::~Trace()
+	{
+		_release();
+	}
+
+	//-----------------------------------------------------------
+	void Trace::_release()
+	{
+		std::free(m_requests);
+		m_requests = nullptr;
+		m_size = 0u;
+		m_objectsNumber = 0u;
+	}
+
+	//-----------------------------------------------------------
+	bool Trace::load(const char* path)
+	{
+		using pool_trace::Event;
+		using pool_trace::EventOp;
+
+		_release();
+
+		FILE* file = openFile(path, "rb");
+		if (!file) {
+			printf_s("Can't open trace file[%s]\n", path);
+			return false;
+		}
+
+		pool_trace::FileHeader header{};
+		if (std::fread(&header, sizeof(header), 1u, file) != 1u || std::memcmp(header.magic, "PTRC", 4u)
+			|| header.version != pool_trace::s_fileVersion || header.eventSize != sizeof(Event)) {
+			printf_s("File[%s] isn't a trace of this version\n", path);
+			std::fclose(file);
+			return false;
+		}
+
+		std::fseek(file, 0, SEEK_END);
+		const long fileSize = std::ftell(file);
+		std::fseek(file, sizeof(header), SEEK_SET);
+
+		const size_t eventsNumber = (static_cast<size_t>(fileSize) - sizeof(header)) / sizeof(Event);
+		Event* events = static_cast<Event*>(std::malloc(eventsNumber * sizeof(Event) + 1u));
+		size_t* order = static_cast<size_t*>(std::malloc(eventsNumber * sizeof(size_t) + 1u));
+		size_t* byAddress = static_cast<size_t*>(std::malloc(eventsNumber * sizeof(size_t) + 1u));
+		Request* requests = static_cast<Request*>(std::malloc(eventsNumber * sizeof(Request) + 1u));
+		if (!events || !order || !byAddress || !requests) {
+			printf_s("Not enough memory to load [%zu] events\n", eventsNumber);
+			std::free(events);
+			std::free(order);
+			std::free(byAddress);
+			std::free(requests);
+			std::fclose(file);
+			return false;
+		}
+		const size_t readNumber = std::fread(events, sizeof(Event), eventsNumber, file);
+		std::fclose(file);
+
+		//rings are written in chunks one after another, merge them by time keeping order of events with the same time
+		size_t opsNumber = 0u;
+		for (size_t i = 0; i < readNumber; i++) {
+			const EventOp op = static_cast<EventOp>(events[i].op);
+			if (op == EventOp::ALLOC || op == EventOp::FREE)
+				order[opsNumber++] = i;
+		}
+		std::sort(order, order + opsNumber, [events](const size_t l, const size_t r) {
+			return events[l].timestamp != events[r].timestamp ? events[l].timestamp < events[r].timestamp : l < r; });
+
+		/*
+		lifetime of an object is the allocation and the next free of the same address in the same pool,
+		requests[rank] is filled for the event with the rank in time order, timestamp keeps the rank meanwhile
+		*/
+		for (size_t i = 0; i < opsNumber; i++) {
+			events[order[i]].timestamp = i;
+			byAddress[i] = order[i];
+		}
+		std::sort(byAddress, byAddress + opsNumber, [events](const size_t l, const size_t r) {
+			if (events[l].poolId != events[r].poolId)
+				return events[l].poolId < events[r].poolId;
+			return events[l].ptr != events[r].ptr ? events[l].ptr < events[r].ptr : events[l].timestamp < events[r].timestamp; });
+
+		uint32_t nextId = 0u;
+		for (size_t i = 0; i < opsNumber; i++) {
+			const Event& event = events[byAddress[i]];
+			Request& request = requests[event.timestamp];
+			request.thread = event.thread;
+
+			const bool sameObject = i && events[byAddress[i - 1]].poolId == event.poolId && events[byAddress[i - 1]].ptr == event.ptr;
+			const Request* prev = sameObject ? &requests[events[byAddress[i - 1]].timestamp] : nullptr;
+			if (static_cast<EventOp>(event.op) == EventOp::ALLOC) {
+				request.op = Op::ALLOC;
+				request.id = nextId++;
+				request.size = event.size;
+				request.alignLog2 = naturalAlignLog2(event.size);
+			} else if (prev && prev->op == Op::ALLOC && prev->id != s_noId) {
+				request.op = Op::FREE;
+				request.id = prev->id;
+				request.size = prev->size;
+				request.alignLog2 = prev->alignLog2;
+			} else {
+				//allocation has been made before recording or it's a double free
+				request.op = Op::FREE;
+				request.id = s_noId;
+			}
+		}
+
+		m_size = 0u;
+		for (size_t i = 0; i < opsNumber; i++) {
+			if (requests[i].id != s_noId)
+				requests[m_size++] = requests[i];
+		}
+		m_requests = requests;
+		m_objectsNumber = nextId;
+
+		std::free(events);
+		std::free(order);
+		std::free(byAddress);
+		return true;
+	}
+
+	//-----------------------------------------------------------
+	bool Trace::assign(const Request* requests, const size_t size)
+	{
+		_release();
+
+		Request* copy = static_cast<Request*>(std::malloc(size * sizeof(Request) + 1u));
+		if (!copy) {
+			printf_s("Not enough memory for [%zu] requests\n", size);
+			return false;
+		}
+		std::memcpy(copy, requests, size * sizeof(Request));
+
+		uint32_t objectsNumber = 0u;
+		for (size_t i = 0; i < size; i++)
+			objectsNumber = std::max(objectsNumber, requests[i].id + 1u);
+
+		m_requests = copy;
+		m_size = size;
+		m_objectsNumber = objectsNumber;
+		return true;
+	}
+
+	//-----------------------------------------------------------
+	bool Trace::isLifo() const
+	{
+		uint32_t* stack = static_cast<uint32_t*>(std::malloc(m_objectsNumber * sizeof(uint32_t) + 1u));
+		if (!stack)
+			return false;
+
+		size_t top = 0u;
+		bool res = true;
+		for (const Request* r = begin(); r != end() && res; r++) {
+			if (r->op == Op::ALLOC)
+				stack[top++] = r->id;
+			else if (top && stack[top - 1] == r->id)
+				top--;
+			else
+				res = false;
+		}
+		std::free(stack);
+		return res;
+	}
+
+	//-----------------------------------------------------------
+	size_t currentRss()
+	{
+#if defined(_WIN32)
+		PROCESS_MEMORY_COUNTERS counters{};
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return counters.WorkingSetSize;
+		return 0u;
+#elif defined(__linux__)
+		FILE* file = openFile("/proc/self/statm", "r");
+		if (!file)
+			return 0u;
+		unsigned long long pages = 0u;
+		unsigned long long resident = 0u;
+		const int read = std::fscanf(file, "%llu %llu", &pages, &resident);
+		std::fclose(file);
+		return read == 2 ? static_cast<size_t>(resident * sysconf(_SC_PAGESIZE)) : 0u;
+#else
+		return 0u;
+#endif
+	}
+}//namespace pool_replay
@@ -0,0 +1,74 @@
+#ifndef MEM_POOL_UTILS_REPLAY
+#define MEM_POOL_UTILS_REPLAY
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+deterministic replay of recorded allocations. Trace is recorded by pool_trace::startRecording from allocator
+entry points of pools and turned into requests with lifetime ids, then the same requests can be fed into
+any pool or system malloc to compare their throughput, memory and fragmentation
+*/
+namespace pool_replay
+{
+	enum class Op : uint8_t
+	{
+		ALLOC = 0,
+		FREE,
+	};
+
+	struct Request
+	{
+		//free keeps size of its allocation
+		uint64_t	size;
+		//lifetime id, index of the object in the replay table
+		uint32_t	id;
+		//thread which made the request in the recorded program, requests are replayed by one thread in time order
+		uint16_t	thread;
+		//pools don't receive alignment, natural alignment of the size is assumed, up to 16
+		uint8_t		alignLog2;
+		Op			op;
+	};
+	static_assert(sizeof(Request) == 16, "requests are kept compact");
+
+	/*
+	requests of a trace file, frees are matched with allocations by the pool and the address.
+	Frees of objects allocated before recording are dropped, objects which are never freed stay live
+	till the end of the trace(also objects moved by HeapStorage, as the move isn't recorded)
+	*/
+	class Trace
+	{
+	public:
+						Trace();
+						~Trace();
+
+						Trace(const Trace&) = delete;
+		Trace&			operator=(const Trace&) = delete;
+
+		bool			load(const char* path);
+		//takes requests made by a program instead of a recorded file, ids of objects have to be dense
+		bool			assign(const Request* requests, const size_t size);
+
+		const Request*	begin() const { return m_requests; }
+		const Request*	end() const { return m_requests + m_size; }
+		size_t			size() const { return m_size; }
+		//number of lifetime ids
+		size_t			objectsNumber() const { return m_objectsNumber; }
+
+		//every free releases the last live allocation, so the trace can be replayed on StackBasedPool
+		bool			isLifo() const;
+
+	private:
+		void			_release();
+
+	private:
+		Request*		m_requests;
+		size_t			m_size;
+		size_t			m_objectsNumber;
+	};
+
+	//resident memory of the process in bytes, 0 if it's unknown on the platform
+	size_t		currentRss();
+}//namespace pool_replay
+
+#endif//MEM_POOL_UTILS_REPLAY
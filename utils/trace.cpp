@@ -0,0 +1,391 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+
+/*
+StackBasedPool replaces global operator new, thus rings and buffers of the decoder
+are taken from malloc, otherwise tracing of the pool would recurse into the pool
+*/
+namespace pool_trace
+{
+	namespace
+	{
+		static_assert((POOL_TRACE_RING_SIZE & (POOL_TRACE_RING_SIZE - 1)) == 0, "size of the ring has to be a power of two");
+
+		constexpr uint32_t s_kindShift = 24u;
+		constexpr uint64_t s_ringMask = POOL_TRACE_RING_SIZE - 1;
+
+		/*
+		single writer ring, head is published after the event is written.
+		Slot of event idx is overwritten once head reaches idx + POOL_TRACE_RING_SIZE
+		*/
+		struct Ring
+		{
+			std::atomic<uint64_t>	head;
+			//events before it are written into the recording file
+			std::atomic<uint64_t>	recorded;
+			Event					events[POOL_TRACE_RING_SIZE];
+		};
+
+		std::atomic<Ring*>	g_rings[POOL_TRACE_MAX_THREADS];
+		std::atomic<bool>	g_owned[POOL_TRACE_MAX_THREADS];
+		std::atomic<uint32_t> g_nextPoolNumber{ 0u };
+
+		//file of startRecording, rings are written into it under the lock
+		std::atomic<FILE*>	g_recordFile{ nullptr };
+		std::mutex			g_recordLock;
+		size_t				g_recordedEvents = 0u;
+
+		//ring of the thread, released for other threads when the thread exits
+		struct RingSlot
+		{
+			Ring*		ring = nullptr;
+			uint16_t	idx = 0u;
+
+			~RingSlot()
+			{
+				if (ring)
+					g_owned[idx].store(false, std::memory_order_release);
+			}
+		};
+
+		thread_local RingSlot t_ringSlot;
+
+		//-----------------------------------------------------------
+		Ring* acquireRing()
+		{
+			for (uint16_t i = 0; i < POOL_TRACE_MAX_THREADS; i++) {
+				bool owned = false;
+				if (!g_owned[i].compare_exchange_strong(owned, true))
+					continue;
+
+				//ring of the exited thread is reused, its events stay in it
+				Ring* ring = g_rings[i].load(std::memory_order_acquire);
+				if (!ring) {
+					ring = static_cast<Ring*>(std::calloc(1, sizeof(Ring)));
+					if (!ring) {
+						g_owned[i].store(false);
+						return nullptr;
+					}
+					g_rings[i].store(ring, std::memory_order_release);
+				}
+				t_ringSlot.ring = ring;
+				t_ringSlot.idx = i;
+				return ring;
+			}
+			return nullptr;
+		}
+
+		//-----------------------------------------------------------
+		FILE* openFile(const char* path, const char* mode)
+		{
+			FILE* file = nullptr;
+#if defined(_MSC_VER)
+			if (fopen_s(&file, path, mode))
+				file = nullptr;
+#else
+			file = std::fopen(path, mode);
+#endif
+			return file;
+		}
+
+		//-----------------------------------------------------------
+		//writes events of the ring which haven't been written yet, g_recordLock has to be taken
+		void writeRing(Ring& ring, FILE* file)
+		{
+			const uint64_t head = ring.head.load(std::memory_order_acquire);
+			uint64_t idx = ring.recorded.load(std::memory_order_relaxed);
+			//events which have been overwritten are lost
+			if (head - idx > POOL_TRACE_RING_SIZE)
+				idx = head - POOL_TRACE_RING_SIZE;
+			for (; idx < head; idx++)
+				g_recordedEvents += std::fwrite(&ring.events[idx & s_ringMask], sizeof(Event), 1u, file);
+			ring.recorded.store(head, std::memory_order_relaxed);
+		}
+
+		//-----------------------------------------------------------
+		const char* kindName(const uint32_t poolId)
+		{
+			switch (static_cast<PoolKind>(poolId >> s_kindShift)) {
+			case PoolKind::ALIGNED_POOL: return "Aligned Pool";
+			case PoolKind::STACK_BASED_POOL: return "Stack Based Pool";
+			case PoolKind::FREE_LIST_STORAGE: return "Free List Storage";
+			case PoolKind::TLSF_STORAGE: return "Tlsf Storage";
+			default: return "Unknown Pool";
+			}
+		}
+
+		struct PoolSummary
+		{
+			uint32_t	poolId;
+			uint64_t	totalSize;
+			uint64_t	occupied;
+			uint64_t	peakOccupied;
+			uint64_t	allocations;
+			uint64_t	frees;
+			uint64_t	failures;
+		};
+	}
+
+	//-----------------------------------------------------------
+	uint32_t newPoolId(const PoolKind kind)
+	{
+		const uint32_t number = (g_nextPoolNumber.fetch_add(1u, std::memory_order_relaxed) + 1u) & ((1u << s_kindShift) - 1u);
+		return (static_cast<uint32_t>(kind) << s_kindShift) | number;
+	}
+
+	//-----------------------------------------------------------
+	void record(const EventOp op, const uint32_t poolId, const void* const ptr, const size_t size)
+	{
+		Ring* ring = t_ringSlot.ring ? t_ringSlot.ring : acquireRing();
+		if (!ring)
+			return;
+
+		const uint64_t head = ring->head.load(std::memory_order_relaxed);
+		Event& event = ring->events[head & s_ringMask];
+		event.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+		event.ptr = reinterpret_cast<uintptr_t>(ptr);
+		event.size = size;
+		event.poolId = poolId;
+		event.thread = t_ringSlot.idx;
+		event.op = static_cast<uint8_t>(op);
+		event.reserved = 0u;
+		ring->head.store(head + 1u, std::memory_order_release);
+
+		//ring is written out before its oldest unwritten event is overwritten by the next one
+		if (g_recordFile.load(std::memory_order_relaxed)
+			&& head + 1u - ring->recorded.load(std::memory_order_relaxed) >= POOL_TRACE_RING_SIZE) {
+			std::lock_guard<std::mutex> lock(g_recordLock);
+			if (FILE* file = g_recordFile.load(std::memory_order_relaxed))
+				writeRing(*ring, file);
+		}
+	}
+
+	//-----------------------------------------------------------
+	size_t dump(const char* path)
+	{
+		FILE* file = openFile(path, "wb");
+		if (!file) {
+			printf_s("Can't open trace file[%s]\n", path);
+			return 0u;
+		}
+
+		//events are copied out of the ring first, as its owner keeps writing while they are being checked
+		Event* events = static_cast<Event*>(std::malloc(sizeof(Event) * POOL_TRACE_RING_SIZE));
+		if (!events) {
+			printf_s("Not enough memory to dump the trace\n");
+			std::fclose(file);
+			return 0u;
+		}
+
+		FileHeader header{ { 'P', 'T', 'R', 'C' }, s_fileVersion, sizeof(Event), 0u };
+		std::fwrite(&header, sizeof(header), 1u, file);
+
+		size_t written = 0u;
+		for (size_t i = 0; i < POOL_TRACE_MAX_THREADS; i++) {
+			const Ring* ring = g_rings[i].load(std::memory_order_acquire);
+			if (!ring)
+				continue;
+
+			//oldest event first, ring keeps only the last POOL_TRACE_RING_SIZE events
+			const uint64_t head = ring->head.load(std::memory_order_acquire);
+			const uint64_t first = head > POOL_TRACE_RING_SIZE ? head - POOL_TRACE_RING_SIZE : 0u;
+			for (uint64_t idx = first; idx < head; idx++)
+				events[idx - first] = ring->events[idx & s_ringMask];
+
+			//events whose slots the owner has started to overwrite during the copy are partly written, they are skipped
+			std::atomic_thread_fence(std::memory_order_acquire);
+			const uint64_t headAfterCopy = ring->head.load(std::memory_order_relaxed);
+			const uint64_t valid = headAfterCopy >= POOL_TRACE_RING_SIZE ? headAfterCopy - POOL_TRACE_RING_SIZE + 1u : 0u;
+			const uint64_t skipped = std::min(head, std::max(first, valid)) - first;
+			written += std::fwrite(events + skipped, sizeof(Event), head - first - skipped, file);
+		}
+
+		std::free(events);
+		std::fclose(file);
+		return written;
+	}
+
+	//-----------------------------------------------------------
+	void clear()
+	{
+		for (size_t i = 0; i < POOL_TRACE_MAX_THREADS; i++) {
+			Ring* ring = g_rings[i].load(std::memory_order_acquire);
+			if (ring) {
+				ring->head.store(0u, std::memory_order_release);
+				ring->recorded.store(0u, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	//-----------------------------------------------------------
+	bool startRecording(const char* path)
+	{
+		std::lock_guard<std::mutex> lock(g_recordLock);
+		if (g_recordFile.load(std::memory_order_relaxed)) {
+			printf_s("Trace is being recorded already\n");
+			return false;
+		}
+
+		FILE* file = openFile(path, "wb");
+		if (!file) {
+			printf_s("Can't open trace file[%s]\n", path);
+			return false;
+		}
+
+		FileHeader header{ { 'P', 'T', 'R', 'C' }, s_fileVersion, sizeof(Event), 0u };
+		std::fwrite(&header, sizeof(header), 1u, file);
+
+		for (size_t i = 0; i < POOL_TRACE_MAX_THREADS; i++) {
+			Ring* ring = g_rings[i].load(std::memory_order_acquire);
+			if (ring)
+				ring->recorded.store(ring->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+		}
+		g_recordedEvents = 0u;
+		g_recordFile.store(file, std::memory_order_release);
+		return true;
+	}
+
+	//-----------------------------------------------------------
+	size_t stopRecording()
+	{
+		std::lock_guard<std::mutex> lock(g_recordLock);
+		FILE* file = g_recordFile.exchange(nullptr);
+		if (!file)
+			return 0u;
+
+		for (size_t i = 0; i < POOL_TRACE_MAX_THREADS; i++) {
+			Ring* ring = g_rings[i].load(std::memory_order_acquire);
+			if (ring)
+				writeRing(*ring, file);
+		}
+		std::fclose(file);
+		return g_recordedEvents;
+	}
+
+	//-----------------------------------------------------------
+	bool decode(const char* path)
+	{
+		FILE* file = openFile(path, "rb");
+		if (!file) {
+			printf_s("Can't open trace file[%s]\n", path);
+			return false;
+		}
+
+		FileHeader header{};
+		if (std::fread(&header, sizeof(header), 1u, file) != 1u || std::memcmp(header.magic, "PTRC", 4u)
+			|| header.version != s_fileVersion || header.eventSize != sizeof(Event)) {
+			printf_s("File[%s] isn't a trace of this version\n", path);
+			std::fclose(file);
+			return false;
+		}
+
+		std::fseek(file, 0, SEEK_END);
+		const long fileSize = std::ftell(file);
+		std::fseek(file, sizeof(header), SEEK_SET);
+
+		const size_t eventsNumber = (static_cast<size_t>(fileSize) - sizeof(header)) / sizeof(Event);
+		Event* events = static_cast<Event*>(std::malloc(eventsNumber * sizeof(Event) + 1u));
+		size_t* order = static_cast<size_t*>(std::malloc(eventsNumber * sizeof(size_t) + 1u));
+		PoolSummary* pools = static_cast<PoolSummary*>(std::malloc(eventsNumber * sizeof(PoolSummary) + 1u));
+		if (!events || !order || !pools) {
+			printf_s("Not enough memory to decode [%zu] events\n", eventsNumber);
+			std::free(events);
+			std::free(order);
+			std::free(pools);
+			std::fclose(file);
+			return false;
+		}
+		const size_t readNumber = std::fread(events, sizeof(Event), eventsNumber, file);
+		std::fclose(file);
+
+		//rings are written one after another, merge them by time keeping order of events with the same time
+		for (size_t i = 0; i < readNumber; i++)
+			order[i] = i;
+		std::sort(order, order + readNumber, [events](const size_t l, const size_t r) {
+			return events[l].timestamp != events[r].timestamp ? events[l].timestamp < events[r].timestamp : l < r; });
+
+		size_t poolsNumber = 0u;
+		const uint64_t start = readNumber ? events[order[0]].timestamp : 0u;
+		for (size_t i = 0; i < readNumber; i++) {
+			const Event& event = events[order[i]];
+
+			PoolSummary* pool = pools;
+			while (pool != pools + poolsNumber && pool->poolId != event.poolId)
+				pool++;
+			if (pool == pools + poolsNumber) {
+				*pool = PoolSummary{ event.poolId, 0u, 0u, 0u, 0u, 0u, 0u };
+				poolsNumber++;
+			}
+
+			const char* action = "";
+			switch (static_cast<EventOp>(event.op)) {
+			case EventOp::INIT:
+				pool->totalSize = event.size;
+				action = "has got";
+				break;
+			case EventOp::ALLOC:
+				pool->allocations++;
+				pool->occupied += event.size;
+				pool->peakOccupied = std::max(pool->peakOccupied, pool->occupied);
+				action = "has been allocated";
+				break;
+			case EventOp::FREE:
+				pool->frees++;
+				//ring could have dropped the allocation
+				pool->occupied -= std::min(pool->occupied, event.size);
+				action = "has been freed";
+				break;
+			case EventOp::FAIL:
+				pool->failures++;
+				action = "failed to allocate";
+				break;
+			}
+
+			printf_s("[%12.3f us][thread %2u] %s#%u: at memory location[0x%llx] %s [%llu] bytes of memory",
+				(event.timestamp - start) / 1000.0,
+				static_cast<unsigned>(event.thread),
+				kindName(event.poolId),
+				event.poolId & ((1u << s_kindShift) - 1u),
+				static_cast<unsigned long long>(event.ptr),
+				action,
+				static_cast<unsigned long long>(event.size));
+			if (pool->totalSize) {
+				printf_s(", occupied [%llu] of [%llu] bytes(%.2f%%)\n",
+					static_cast<unsigned long long>(pool->occupied),
+					static_cast<unsigned long long>(pool->totalSize),
+					100.0 * pool->occupied / pool->totalSize);
+			} else {
+				printf_s(", occupied [%llu] bytes\n", static_cast<unsigned long long>(pool->occupied));
+			}
+		}
+
+		printf_s("#--------------------------------------------------------------------#\n");
+		printf_s("[%zu] events of [%zu] pools\n", readNumber, poolsNumber);
+		for (size_t i = 0; i < poolsNumber; i++) {
+			const PoolSummary& pool = pools[i];
+			printf_s("%s#%u: allocations[%llu] frees[%llu] failures[%llu] occupied[%llu] peak occupied[%llu] total size[%llu]\n",
+				kindName(pool.poolId),
+				pool.poolId & ((1u << s_kindShift) - 1u),
+				static_cast<unsigned long long>(pool.allocations),
+				static_cast<unsigned long long>(pool.frees),
+				static_cast<unsigned long long>(pool.failures),
+				static_cast<unsigned long long>(pool.occupied),
+				static_cast<unsigned long long>(pool.peakOccupied),
+				static_cast<unsigned long long>(pool.totalSize));
+		}
+		printf_s("#--------------------------------------------------------------------#\n");
+
+		std::free(events);
+		std::free(order);
+		std::free(pools);
+		return true;
+	}
+}//namespace pool_trace
@@ -0,0 +1,99 @@
+#ifndef MEM_POOL_UTILS_TRACE
+#define MEM_POOL_UTILS_TRACE
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+number of events kept by the ring of every thread, older events are overwritten.
+Has to be a power of two
+*/
+#ifndef POOL_TRACE_RING_SIZE
+#define POOL_TRACE_RING_SIZE 8192
+#endif
+
+//max number of threads which can record events at the same time, events of other threads are dropped
+#ifndef POOL_TRACE_MAX_THREADS
+#define POOL_TRACE_MAX_THREADS 64
+#endif
+
+/*
+binary tracing shared by all pools. Every thread writes fixed size events into its own ring buffer
+without locks and formatting, so tracing is cheap enough to stay on under real load.
+dump() writes rings of all threads into a file, decode() prints it in the readable form
+*/
+namespace pool_trace
+{
+	enum class PoolKind : uint8_t
+	{
+		ALIGNED_POOL = 1,
+		STACK_BASED_POOL,
+		FREE_LIST_STORAGE,
+		TLSF_STORAGE,
+	};
+
+	enum class EventOp : uint8_t
+	{
+		//pool got memory, size - total size of the pool
+		INIT = 0,
+		ALLOC,
+		FREE,
+		//allocation failed, size - requested size
+		FAIL,
+	};
+
+	//version of the trace file, it's changed with the layout of the event
+	constexpr uint32_t s_fileVersion = 1u;
+
+	//record of the trace file, the file is FileHeader followed by events
+	struct Event
+	{
+		uint64_t	timestamp;//nanoseconds of the steady clock
+		uint64_t	ptr;
+		uint64_t	size;
+		uint32_t	poolId;//kind in the high byte, number of the pool in the rest
+		uint16_t	thread;//index of the ring
+		uint8_t		op;
+		uint8_t		reserved;
+	};
+	static_assert(sizeof(Event) == 32, "trace file layout depends on the size of the event");
+
+	struct FileHeader
+	{
+		char		magic[4];
+		uint32_t	version;
+		uint32_t	eventSize;
+		uint32_t	reserved;
+	};
+
+	//unique id of a new pool of the kind
+	uint32_t	newPoolId(const PoolKind kind);
+
+	//appends event to the ring of the calling thread
+	void		record(const EventOp op, const uint32_t poolId, const void* const ptr, const size_t size);
+
+	/*
+	writes events of all rings into the file, returns number of written events.
+	Threads can keep recording, events recorded while dump is running can be lost
+	and events overwritten during the dump are skipped
+	*/
+	size_t		dump(const char* path);
+
+	//drops recorded events
+	void		clear();
+
+	/*
+	starts writing every event into the file. Ring of a thread is written out by the thread when it's full,
+	so the file keeps the whole history instead of the last events of rings, e.g. for pool_replay.
+	Events recorded before the call aren't written
+	*/
+	bool		startRecording(const char* path);
+
+	//writes the rest of events and closes the file, returns number of recorded events. Other threads have to be stopped
+	size_t		stopRecording();
+
+	//prints events of the trace file ordered by time and a summary of every pool
+	bool		decode(const char* path);
+}//namespace pool_trace
+
+#endif//MEM_POOL_UTILS_TRACE
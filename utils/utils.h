@@ -1,11 +1,21 @@
 #ifndef MEM_POOL_UTILS
 #define MEM_POOL_UTILS
 
-#include <ctime>
+#include <chrono>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <queue>
+#include <random>
+#include <string>
 #include <vector>
 
+#include "trace.h"
+#include "latency.h"
+#include "replay.h"
+#include "bench.h"
+
 #if defined(PROJ_ALIGNED_POOL)
 
 #include "../AlignedPool/src/ap.h"
@@ -22,6 +32,10 @@ const char* g_poolName = "Stack Based";
 
 #include "../HeapBasedPool/src/hbp.h"
 #include "../HeapBasedPool/src/Handle.h"
+#include "../HeapBasedPool/src/ConcurrentHeapStorage.h"
+#include <thread>
+#include <atomic>
+#include <algorithm>
 typedef hbp::HeapStorage CustomPool;
 const char* g_poolName = "Heap Storage";
 
@@ -40,95 +54,182 @@ namespace pool_utils
 		char data[Size];
 	};
 
+	//wall time in seconds between calls, detailed measurements are made by pool_bench::Report
 	struct Timer
 	{
+		typedef std::chrono::steady_clock Clock;
+
 		Timer()
 		{
-			start = std::clock();
+			start = Clock::now();
 		}
 
 		double getDelt()
 		{
-			clock_t temp = std::clock();
-			float res = (temp - start) / static_cast<float>(CLOCKS_PER_SEC);
+			Clock::time_point temp = Clock::now();
+			double res = std::chrono::duration<double>(temp - start).count();
 			start = temp;
 			return res;
 		}
 	private:
-		clock_t start;
+		Clock::time_point start;
 	};
 
+	/*
+	"--decode-trace <file>" prints trace written by the previous run,
+	returns false if there is no such argument
+	*/
+	bool decodeTraceArgument(int argc, char** argv)
+	{
+		for (int i = 1; i + 1 < argc; i++) {
+			if (std::strcmp(argv[i], "--decode-trace") == 0) {
+				pool_trace::decode(argv[i + 1]);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	"--record-trace <file>" writes every event of pools of the project into the file till stopTraceRecording,
+	the file can be replayed by "--replay-trace <file>" of any project
+	*/
+	void recordTraceArgument(int argc, char** argv)
+	{
+		for (int i = 1; i + 1 < argc; i++) {
+			if (std::strcmp(argv[i], "--record-trace") == 0) {
+#if ALIGNED_POOL_ENABLE_MEM_LOG || STACK_BASED_POOL_ENABLE_MEM_LOG || HEAP_BASED_POOL_ENABLE_MEM_LOG
+				if (pool_trace::startRecording(argv[i + 1]))
+					std::cout << "trace is recorded into " << argv[i + 1] << "\n";
+#else
+				std::cout << "tracing of pools is off, trace can't be recorded\n";
+#endif
+				return;
+			}
+		}
+	}
+
+	void stopTraceRecording()
+	{
+		const size_t recorded = pool_trace::stopRecording();
+		if (recorded)
+			std::cout << "[" << recorded << "] trace events are recorded\n";
+	}
+
+	//writes events recorded by pools of the project, when their tracing is on
+	void dumpTrace(const char* path = "pool_trace.bin")
+	{
+#if ALIGNED_POOL_ENABLE_MEM_LOG || STACK_BASED_POOL_ENABLE_MEM_LOG || HEAP_BASED_POOL_ENABLE_MEM_LOG
+		std::cout << "[" << pool_trace::dump(path) << "] trace events are written into " << path << "\n";
+#else
+		(void)path;
+#endif
+	}
+
+	//prints latency histograms of pools of the project, when their instrumentation is on
+	void printLatency()
+	{
+#if ALIGNED_POOL_ENABLE_LATENCY || STACK_BASED_POOL_ENABLE_LATENCY || HEAP_BASED_POOL_ENABLE_LATENCY
+		pool_latency::print();
+#else
+		std::cout << "latency instrumentation is off\n";
+#endif
+	}
+
+	//writes buckets of latency histograms, when instrumentation of pools of the project is on
+	void dumpLatency(const char* path = "pool_latency.csv")
+	{
+#if ALIGNED_POOL_ENABLE_LATENCY || STACK_BASED_POOL_ENABLE_LATENCY || HEAP_BASED_POOL_ENABLE_LATENCY
+		if (pool_latency::dump(path))
+			std::cout << "latency histograms are written into " << path << "\n";
+#else
+		(void)path;
+#endif
+	}
+
 #if defined(PROJ_ALIGNED_POOL)
+	//malloc_n has to find a run of free blocks, so its tail grows with fragmentation of the pool
+	void latencyTestFragmentedMallocN()
+	{
+		const size_t blockCount = 20000;
+		const size_t repetition = 1000;
+
+		std::cout << "*************************************************************\n";
+		std::cout << "latencyTestFragmentedMallocN\n";
+		std::cout << "*************************************************************\n";
+
+		align_pool::AlignedPool pool{ 64, blockCount };
+		std::vector<void*> blocks(blockCount, nullptr);
+		for (size_t i = 0; i < blockCount; i++)
+		{
+			blocks[i] = pool.malloc();
+		}
+
+		//every block is freed with probability 1/2, so long runs of free blocks are rare
+		std::mt19937 rng{ 42 };
+		for (size_t i = 0; i < blockCount; i++)
+		{
+			if (rng() % 2)
+			{
+				pool.free(blocks[i]);
+				blocks[i] = nullptr;
+			}
+		}
+
+		pool_latency::reset();
+		for (size_t n = 1; n <= 8; n *= 2)
+		{
+			for (size_t j = 0; j < repetition; j++)
+			{
+				void* ptr = pool.malloc_n(n);
+				if (ptr)
+					pool.free_n(ptr, n);
+			}
+		}
+		printLatency();
+
+		for (void* ptr : blocks)
+		{
+			if (ptr)
+				pool.free(ptr);
+		}
+	}
+
 	template<unsigned int Size>
-	void timingTest()
+	void timingTest(pool_bench::Report& report)
 	{
 		const unsigned int iteration = 18000;
-		const unsigned int repetition = 10;
 
-		std::cout << std::setprecision(8);
 		std::cout << "TimingTest with object of size: " << Size << "\n";
+		report.setSuite("vector push_back, size " + std::to_string(Size));
 
 		std::vector<A<Size> > vecStdAlloc;
 		std::vector<A<Size>, align_pool::AlignedPoolAllocator<A<Size> > > vecMyAlloc;
 
-		std::cout << "\nVector with standard allocator\n";
-		Timer t;
-
-		double temp = 0.0;
-		double min = 1.0;
-		double max = 0.0;
-		double accum = 0.0;
-		
-		t.getDelt();
-
 		//---------------------------------------------------------------------
 		//std::allocator
 		//---------------------------------------------------------------------
-		for (int j = 0; j < repetition; j++)
-		{
-			for (int i = 0; i < iteration; i++)
+		report.measure("push_back in vector with std::allocator", iteration, [&]() {
+			for (unsigned int i = 0; i < iteration; i++)
 			{
 				vecStdAlloc.push_back(A<Size>());
 			}
 			vecStdAlloc.clear();
-			
-			temp = t.getDelt();
-			min = min < temp ? min : temp;
-			max = max > temp ? max : temp;
-			accum += temp;
-			std::cout << "push_back in vector with std::allocator: repetition:[" << j << "]: seconds " << temp << "\n";
-		}
-		std::cout << "Min time:[" << min << "]\n";
-		std::cout << "Max time:[" << max << "]\n";
-		std::cout << "Average time:[" << accum / repetition << "]\n";
-
-		min = 1.0;
-		max = 0.0;
-		accum = 0.0;
-
-		std::cout << "\nCustom allocators\n";
-		t.getDelt();
+			vecStdAlloc.shrink_to_fit();
+		});
 
 		//---------------------------------------------------------------------
 		//align_pool::AlignedPoolAllocator
 		//---------------------------------------------------------------------
-		for (int j = 0; j < repetition; j++)
-		{
-			for (int i = 0; i < iteration; i++)
+		report.measure("push_back in vector with align_pool::allocator", iteration, [&]() {
+			for (unsigned int i = 0; i < iteration; i++)
 			{
 				vecMyAlloc.push_back(A<Size>());
 			}
 			vecMyAlloc.clear();
-			temp = t.getDelt();
-			min = min < temp ? min : temp;
-			max = max > temp ? max : temp;
-			accum += temp;
-			std::cout << "push_back in vector with align_poll:allocator: repetition:[" << j << "]: seconds " << temp << "\n";
-		}
-		std::cout << "Min time:[" << min << "]\n";
-		std::cout << "Max time:[" << max << "]\n";
-		std::cout << "Average time:[" << accum / repetition << "]\n";
-		std::cout << "\n\n";
+			vecMyAlloc.shrink_to_fit();
+		});
+		std::cout << "\n";
 	}
 #endif
 
@@ -153,10 +254,9 @@ namespace pool_utils
 	}
 
 	template<unsigned int Size>
-	void timingTest2()
+	void timingTest2(pool_bench::Report& report)
 	{
 		typedef pool_utils::A<Size> MyType;
-		const size_t repetion = 1000;
 		const size_t arraySize = 2000;
 		MyType* arr[arraySize]{nullptr};
 
@@ -172,52 +272,43 @@ namespace pool_utils
 #endif
 		std::cout << "Timing test for array of objects with size:[" <<
 			sizeof(MyType*) << "] and align[" << alignof(MyType*) << "]\n";
-		
-		Timer t;
+		report.setSuite(std::string(g_poolName) + ", size " + std::to_string(Size));
 
-		t.getDelt();
 		//---------------------------------------------------------------------
 		// malloc-free
 		//---------------------------------------------------------------------
-		for (int j = 0; j < repetion; j++)
-		{
-			for (int i = 0; i < arraySize; i++)
+		report.measure("malloc-free", arraySize, [&]() {
+			for (size_t i = 0; i < arraySize; i++)
 			{
 				*(arr + i) = (MyType*)std::malloc(Size);
 				(*(arr + i))->data[0] = 'a';
 			}
 
-			for (int i = 0; i < arraySize; i++)
+			for (size_t i = 0; i < arraySize; i++)
 			{
 				std::free(*(arr + i));
 			}
-		}
-		std::cout << "malloc-free time: " << t.getDelt() << "\n";
+		});
 		
-		t.getDelt();
 		//---------------------------------------------------------------------
 		// malloc_n-free_n
 		//---------------------------------------------------------------------
-		for (int j = 0; j < repetion; j++)
-		{
+		report.measure("malloc_n-free_n", arraySize, [&]() {
 			void* first = std::malloc(Size * arraySize);
-			for (int i = 0; i < arraySize; i++)
+			for (size_t i = 0; i < arraySize; i++)
 			{
 				*(arr + i) = static_cast<MyType*>(first) + i;
 			}
-			for (int k = 0; k < arraySize; k++)
+			for (size_t k = 0; k < arraySize; k++)
 				arr[k]->data[0] = 'a';
 			std::free(first);
-		}
-		std::cout << "malloc_n-free_n time: " << t.getDelt() << "\n";
+		});
 		
-		t.getDelt();
 		//---------------------------------------------------------------------
 		// AlignedPool malloc-free
 		//---------------------------------------------------------------------
-		for (int j = 0; j < repetion; j++)
-		{
-			for (int i = 0; i < arraySize; i++)
+		report.measure("pool malloc-free", arraySize, [&]() {
+			for (size_t i = 0; i < arraySize; i++)
 			{
 #if defined(PROJ_ALIGNED_POOL)
 				*(arr + i) = (MyType*)loc.malloc();
@@ -227,44 +318,37 @@ namespace pool_utils
 				(*(arr + i))->data[0] = 'a';
 			}
 			
-			for (int k = 0; k < arraySize; k++)
+			for (size_t k = 0; k < arraySize; k++)
 			{
 				loc.free(*(arr + k));
 			}
-		}
-		std::cout << g_poolName << " malloc-free time: " << t.getDelt() << "\n";
+		});
 		
-		t.getDelt();
 		loc.DEBUG_DumpAllFreeMemory();
 
 		//---------------------------------------------------------------------
 		// AlignedPool malloc_n-free
 		//---------------------------------------------------------------------
-		for (int j = 0; j < repetion; j++)
-		{
+		report.measure("pool malloc_n-free_n", arraySize, [&]() {
 #if defined(PROJ_ALIGNED_POOL)
-			* arr = (MyType*)loc.malloc_n(arraySize);
+			MyType* first = (MyType*)loc.malloc_n(arraySize);
 #elif defined(PROJ_STACK_BASED_POOL) | defined (PROJ_HEAP_BASED_POOL)
 			MyType* first = (MyType*)loc.malloc(sizeof(MyType) * arraySize);
-			for (int i = 0; i < arraySize; i++)
+#endif
+			for (size_t i = 0; i < arraySize; i++)
 			{
 				*(arr + i) = first + i;
 			}
-#endif
-			for (int k = 0; k < arraySize; k++)
+			for (size_t k = 0; k < arraySize; k++)
 				arr[k]->data[0] = 'a';
-#if defined (PROJ_HEAP_BASED_POOL)
-			loc.free(*arr);
+			//elements aren't separate allocations, the whole array is freed at once
+#if defined (PROJ_ALIGNED_POOL)
+			loc.free_n(*arr, arraySize);
 #else
-			for (int i = 0; i < arraySize; i++)
-			{
-				loc.free(*(arr + i));
-			}
+			loc.free(*arr);
 #endif
-		}
-		std::cout << g_poolName << " malloc_n-free_n time: " << t.getDelt() << "\n";
+		});
 
-		t.getDelt();
 		loc.DEBUG_DumpAllFreeMemory();
 
 
@@ -272,39 +356,66 @@ namespace pool_utils
 		//---------------------------------------------------------------------
 		// AlignedPoolManager malloc-free
 		//---------------------------------------------------------------------
-		for (int j = 0; j < repetion; j++)
-		{
-			for (int i = 0; i < arraySize; i++)
+		report.measure("AlignedPoolManager malloc-free", arraySize, [&]() {
+			for (size_t i = 0; i < arraySize; i++)
 			{
 				*(arr + i) = (MyType*)align_pool::GetAlignedPoolManager().malloc(Size);
 				(*(arr + i))->data[0] = 'a';
 			}
 			
-			for (int i = 0; i < arraySize; i++)
+			for (size_t i = 0; i < arraySize; i++)
 			{
 				align_pool::GetAlignedPoolManager().free(*(arr + i));
 			}
-		}
-		std::cout << "AlignedPoolManager time: " << t.getDelt() << "\n";
+		});
 
 		//---------------------------------------------------------------------
 		// AlignedPoolManager malloc_n-free_n
 		//---------------------------------------------------------------------
-		for (int j = 0; j < repetion; j++)
-		{
-			*(arr) = (MyType*)align_pool::GetAlignedPoolManager().malloc_n(Size, arraySize);
-			
-			for (int k = 0; k < arraySize; k++)
-				arr[k]->data[0] = 'a';
+		report.measure("AlignedPoolManager malloc_n-free_n", arraySize, [&]() {
+			MyType* first = (MyType*)align_pool::GetAlignedPoolManager().malloc_n(Size, arraySize);
 
-			align_pool::GetAlignedPoolManager().free_n(*(arr), arraySize);
-		}
-		std::cout << "AlignedPoolManager time: " << t.getDelt() << "\n";
+			for (size_t k = 0; k < arraySize; k++)
+				(first + k)->data[0] = 'a';
+
+			align_pool::GetAlignedPoolManager().free_n(first, arraySize);
+		});
+
+		const align_pool::AlignedPoolManager::Stats stats = align_pool::GetAlignedPoolManager().stats();
+		std::cout << "AlignedPoolManager allocations[" << stats.pools.allocations << "], frees[" << stats.pools.frees
+			<< "], failed[" << stats.pools.failedAllocations << "], failed frees[" << stats.pools.failedFrees
+			<< "], peak bytes[" << stats.pools.peakBytesInUse << "]\n";
+		std::cout << "malloc cache hits[" << stats.mallocCacheHits << "], misses[" << stats.mallocCacheMisses
+			<< "], free cache hits[" << stats.freeCacheHits << "], misses[" << stats.freeCacheMisses << "]\n";
 		std::cout << "------------------------------------------\n\n";
+#elif defined(PROJ_HEAP_BASED_POOL)
+		loc.cleanAll();
 #endif //PROJ_ALIGNED_POOL
 	}
 
 #if defined(PROJ_HEAP_BASED_POOL)
+	void printHeapStats(const char* name, const hbp::HeapStats& stats)
+	{
+		std::cout << name << " stats: allocations[" << stats.allocations << "], frees[" << stats.frees
+			<< "], failed[" << stats.failedAllocations << "], bytes in use[" << stats.bytesInUse
+			<< "], peak bytes[" << stats.peakBytesInUse << "]\n";
+		std::cout << "heap used[" << stats.heapUsed << "] of [" << stats.heapSize << "], reinits[" << stats.reinits
+			<< "], defragmentation steps[" << stats.defragSteps << "], compactions[" << stats.compactions
+			<< "], objects moved[" << stats.objectsMoved << "], bytes moved[" << stats.bytesMoved << "]\n";
+	}
+
+	void printFreeSpace(const hbp::FreeSpaceStats& freeSpace)
+	{
+		std::cout << "free bytes[" << freeSpace.freeBytes << "] in [" << freeSpace.holesNumber
+			<< "] holes, largest hole[" << freeSpace.largestHole << "], holes per size:";
+		for (size_t i = 0; i < hbp::FreeSpaceStats::s_bucketsNumber; i++)
+		{
+			if (freeSpace.holes[i])
+				std::cout << " [" << (size_t(1) << i) << "]x" << freeSpace.holes[i];
+		}
+		std::cout << "\n";
+	}
+
 	template <typename C, typename _Result = hbp::helpers::GetHandleType_t<std::remove_reference_t<C>>>
 	_Result * GetObjPtr(hbp::HeapStorage & storage, const C*)
 	{
@@ -328,18 +439,18 @@ namespace pool_utils
 
 
 	template<unsigned int Size>
-	void timingTestHandle()
+	void timingTestHandle(pool_bench::Report& report)
 	{
 		using namespace hbp::helpers;
 		typedef pool_utils::A<Size> ValType;
 		typedef hbp::Handle<ValType> HandleType;
 		
 		const int arrSize = 2000;
-		const int repetion = 100;
 
 		std::cout << "*************************************************************\n";
 		std::cout << "timingTestHandle with Size[" << Size <<  "]\n";
 		std::cout << "*************************************************************\n";
+		report.setSuite("handles, size " + std::to_string(Size));
 
 		CustomPool& heap = hbp::GetHeapStorage();
 		heap.init(arrSize * Size * 4);
@@ -350,16 +461,10 @@ namespace pool_utils
 		std::cout << "*************************************************************\n";
 		heap.DEBUG_DumpAllFreeMemory();
 
-		Timer t;
-
-		std::cout << "*************************************************************\n";
-		std::cout << "makeHandle -> destroyHandle\n";
-		std::cout << "*************************************************************\n";
-
-		t.getDelt();
-
-		for (int j = 0; j < repetion; j++)
-		{
+		//---------------------------------------------------------------------
+		// makeHandle -> destroyHandle
+		//---------------------------------------------------------------------
+		report.measure("Handle construction->operation->destruction", arrSize, [&]() {
 			HandleType* first = makeHandleT<ValType>(heap, arrSize);
 
 			for (int i = 0; i < arrSize; i++)
@@ -369,20 +474,15 @@ namespace pool_utils
 			}
 
 			heap.free(destroyHandle(first, arrSize));
-		}
-
-		std::cout << "Handle constuction->operation->destruction " << t.getDelt() << "\n";
-
-		std::cout << "*************************************************************\n";
-		std::cout << "Begin HandleVec\n";
-		std::cout << "*************************************************************\n";
+		});
 
+		//---------------------------------------------------------------------
+		// HandleVec
+		//---------------------------------------------------------------------
 		HandleVec<ValType> vec{};
+		int j = 0;
 
-		t.getDelt();
-
-		for (int j = 0; j < repetion; j++)
-		{
+		report.measure("HandleVec construction->operation->destruction", arrSize, [&]() {
 			vec.reserve(arrSize);
 
 			for (int i = 0; i < arrSize; i++)
@@ -396,9 +496,8 @@ namespace pool_utils
 			}
 
 			vec.clear();
-		}
-
-		std::cout << "HandleVec constuction->operation->destruction " << t.getDelt() << "\n";
+			j++;
+		});
 
 		heap.DEBUG_DumpAllFreeMemory();
 		std::cout << "*************************************************************\n";
@@ -485,7 +584,1276 @@ namespace pool_utils
 		heap.cleanAll();
 	}
 
-#endif //PROJ_HEAP_BASED_POOL
+	void HandleTestIncrementalDefragmentation()
+	{
+		using namespace hbp::helpers;
+		//bigger than small objects, so freed objects become holes of the heap instead of free slots of slab pages
+		typedef pool_utils::A<320> ValType;
+
+		hbp::HeapStorage& heap = hbp::GetHeapStorage();
+		heap.init(64 * 1024);
+
+		HandleVec<ValType> vec;
+		for (int i = 0; i < 150; i++)
+		{
+			vec.push_back(hbp::Handle<ValType>{ GetObjPtr<ValType>(heap) });
+			hRef(vec.back()).data[0] = i % 127;
+		}
+
+		//free every second object to make a lot of small holes
+		HandleVec<ValType> survivors;
+		for (size_t i = 0; i < vec.size(); i++)
+		{
+			if (i % 2)
+				survivors.push_back(std::move(vec[i]));
+		}
+		vec.clear();
+
+		std::cout << "Fragmentation before defragmentation[" << heap.getFragmentation() << "]\n";
+		printFreeSpace(heap.getFreeSpace());
+
+		//steps are made while free memory is split into many holes or a big object can't fit
+		const hbp::DefragTrigger trigger{ 0.5f, 16u, 4096u };
+		hbp::DefragReport report{};
+		while (heap.needsDefragmentation(trigger))
+		{
+			report = heap.defragmentStep(1024);
+			std::cout << "defragmentStep: moved[" << report.bytesMoved << "] bytes in [" << report.objectsMoved 
+				<< "] objects, fragmentation[" << report.fragmentationBefore << " -> " << report.fragmentationAfter << "]\n";
+			if (report.passFinished && !report.objectsMoved)
+				break;
+		}
+		printFreeSpace(heap.getFreeSpace());
+
+		for (size_t i = 0; i < survivors.size(); i++)
+		{
+			if (hRef(survivors[i]).data[0] != (2 * i + 1) % 127)
+				std::cout << "Error, object[" << i << "] is corrupted after defragmentation\n";
+		}
+
+		survivors.clear();
+		heap.cleanAll();
+	}
+
+	//object with pointer to itself, can't be moved with memcpy
+	struct SelfRef
+	{
+		SelfRef(int v) : self{ this }, value{ v } {}
+		SelfRef(SelfRef&& other) noexcept : self{ this }, value{ other.value } { other.value = -1; }
+		~SelfRef() { self = nullptr; }
+
+		bool isValid() const { return self == this; }
+
+		SelfRef*	self;
+		int			value;
+		//bigger than small objects, so objects take blocks of the heap, which compaction slides, instead of slab slots
+		char		payload[320];
+	};
+
+	void HandleTestRelocation()
+	{
+		using namespace hbp::helpers;
+
+		hbp::HeapStorageHandles storage;
+		storage.init(16 * 1024);
+
+		std::vector<hbp::Handle<SelfRef>*> handles;
+		for (int i = 0; i < 200; i++)
+		{
+			hbp::Handle<SelfRef>* h = storage.allocHandle<SelfRef>();
+			new (hPtr(h)) SelfRef{ i };
+			storage.setRelocate(h);
+			handles.push_back(h);
+		}
+
+		//free every second object, so compaction has to move the rest
+		std::vector<hbp::Handle<SelfRef>*> survivors;
+		for (size_t i = 0; i < handles.size(); i++)
+		{
+			if (i % 2) {
+				survivors.push_back(handles[i]);
+				continue;
+			}
+			hPtr(handles[i])->~SelfRef();
+			storage.free(handles[i]);
+		}
+
+		hbp::DefragReport report = storage.compact();
+		std::cout << "Relocation: moved[" << report.objectsMoved << "] objects\n";
+		if (report.objectsMoved == 0)
+			std::cout << "Error, compaction hasn't moved any object, relocation hasn't been checked\n";
+
+		for (size_t i = 0; i < survivors.size(); i++)
+		{
+			SelfRef* obj = hPtr(survivors[i]);
+			if (!obj->isValid() || obj->value != static_cast<int>(2 * i + 1))
+				std::cout << "Error, object[" << i << "] is corrupted after relocation\n";
+			obj->~SelfRef();
+			storage.free(survivors[i]);
+		}
+		storage.cleanAll();
+	}
+
+	void HandleTestConcurrentHeapStorage()
+	{
+		using namespace hbp::helpers;
+
+		const int threadsNumber = 4;
+		const int objectsNumber = 2000;
+		const int repetion = 200;
+
+		hbp::ConcurrentHeapStorage& heap = hbp::GetConcurrentHeapStorage();
+		heap.init(64 * 1024, threadsNumber);
+
+		std::atomic<bool> done{ false };
+		std::atomic<int> errors{ 0 };
+		std::vector<std::thread> threads;
+
+		for (int t = 0; t < threadsNumber; t++)
+		{
+			threads.emplace_back([&heap, &errors, t, objectsNumber, repetion]() {
+				std::vector<hbp::Handle<int>*> handles;
+				for (int i = 0; i < objectsNumber; i++)
+				{
+					int* obj = static_cast<int*>(heap.malloc(sizeof(int)));
+					*obj = t * objectsNumber + i;
+					handles.push_back(static_cast<hbp::Handle<int>*>(makeHandle(obj)));
+				}
+
+				//holes for the compactor
+				for (int i = 1; i < objectsNumber; i += 2)
+				{
+					heap.destroy(handles[i]);
+					handles[i] = nullptr;
+				}
+
+				//objects are read while they are moved by other thread
+				for (int j = 0; j < repetion; j++)
+				{
+					hbp::EpochGuard guard;
+					for (int i = 0; i < objectsNumber; i += 2)
+					{
+						if (hVal(handles[i]) != t * objectsNumber + i)
+							errors++;
+					}
+				}
+
+				for (int i = 0; i < objectsNumber; i += 2)
+				{
+					heap.destroy(handles[i]);
+				}
+			});
+		}
+
+		std::thread compactor([&heap, &done]() {
+			while (!done)
+			{
+				heap.defragmentStep(4096);
+			}
+		});
+
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+		done = true;
+		compactor.join();
+
+		std::cout << "ConcurrentHeapStorage: threads[" << threadsNumber << "], errors[" << errors << "]\n";
+		printHeapStats("ConcurrentHeapStorage", heap.stats());
+		heap.cleanAll();
+	}
+
+	void timingTestBackgroundCompactor()
+	{
+		using namespace hbp::helpers;
+		typedef std::chrono::steady_clock Clock;
+
+		const int iteration = 200000;
+		const size_t maxLiveObjects = 4000;
+
+		hbp::ConcurrentHeapStorage& heap = hbp::GetConcurrentHeapStorage();
+
+		for (int withCompactor = 0; withCompactor < 2; withCompactor++)
+		{
+			heap.init(256 * 1024, 1);
+			if (withCompactor)
+				heap.startCompactor(0.3f, 16 * 1024, 200);
+
+			std::mt19937 rng{ 42 };
+			std::vector<hbp::Handle<char>*> live;
+			std::vector<double> latencies;
+			latencies.reserve(iteration);
+
+			for (int i = 0; i < iteration; i++)
+			{
+				if (live.size() < maxLiveObjects && rng() % 3)
+				{
+					const size_t size = 8 + rng() % 248;
+					Clock::time_point start = Clock::now();
+					void* obj = heap.malloc(size);
+					latencies.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+					live.push_back(static_cast<hbp::Handle<char>*>(makeHandle(obj)));
+				}
+				else if (!live.empty())
+				{
+					const size_t idx = rng() % live.size();
+					heap.destroy(live[idx]);
+					live[idx] = live.back();
+					live.pop_back();
+				}
+			}
+
+			for (auto h : live)
+			{
+				heap.destroy(h);
+			}
+
+			std::sort(latencies.begin(), latencies.end());
+			double sum = 0.0;
+			for (double l : latencies)
+			{
+				sum += l;
+			}
+
+			std::cout << "Foreground malloc with compactor " << (withCompactor ? "on" : "off")
+				<< ": avg[" << sum / latencies.size() << "ns]"
+				<< " p50[" << latencies[latencies.size() / 2] << "ns]"
+				<< " p99[" << latencies[latencies.size() * 99 / 100] << "ns]"
+				<< " max[" << latencies.back() << "ns]\n";
+
+			heap.cleanAll();
+		}
+	}
+
+	template<unsigned int Size>
+	void timingTestHeapStorageHandles(pool_bench::Report& report)
+	{
+		using namespace hbp::helpers;
+		typedef pool_utils::A<Size> ValType;
+		typedef hbp::Handle<ValType> HandleType;
+
+		const int arrSize = 2000;
+
+		std::cout << "*************************************************************\n";
+		std::cout << "timingTestHeapStorageHandles with Size[" << Size << "]\n";
+		std::cout << "*************************************************************\n";
+		report.setSuite("HeapStorageHandles, size " + std::to_string(Size));
+
+		HandleType* hArr[arrSize]{ nullptr };
+
+		hbp::HeapStorage& heap = hbp::GetHeapStorage();
+		heap.init(arrSize * Size * 4);
+
+		//---------------------------------------------------------------------
+		// HeapStorage::malloc + makeHandle
+		//---------------------------------------------------------------------
+		report.measure("HeapStorage malloc + makeHandle -> destroyHandle + free", arrSize, [&]() {
+			for (int i = 0; i < arrSize; i++)
+			{
+				hArr[i] = static_cast<HandleType*>(makeHandle(heap.malloc(sizeof(ValType))));
+				hRef(hArr[i]).data[0] = i % 255;
+			}
+
+			for (int i = 0; i < arrSize; i++)
+			{
+				heap.free(destroyHandle(hArr[i]));
+			}
+		});
+		heap.cleanAll();
+
+		hbp::HeapStorageHandles storage;
+		storage.init(arrSize * Size * 4);
+
+		//---------------------------------------------------------------------
+		// HeapStorageHandles allocHandle-free
+		//---------------------------------------------------------------------
+		report.measure("HeapStorageHandles allocHandle -> free", arrSize, [&]() {
+			for (int i = 0; i < arrSize; i++)
+			{
+				hArr[i] = storage.allocHandle<ValType>();
+				hRef(hArr[i]).data[0] = i % 255;
+			}
+
+			for (int i = 0; i < arrSize; i++)
+			{
+				storage.free(hArr[i]);
+			}
+		});
+
+		//---------------------------------------------------------------------
+		// HeapStorageHandles allocHandle_n-free_n
+		//---------------------------------------------------------------------
+		report.measure("HeapStorageHandles allocHandle(n) -> free_n", arrSize, [&]() {
+			HandleType* first = storage.allocHandle<ValType>(arrSize);
+			for (int i = 0; i < arrSize; i++)
+			{
+				hRef(first + i).data[0] = i % 255;
+			}
+
+			storage.free_n(first, arrSize);
+		});
+
+		storage.DEBUG_DumpAllFreeMemory();
+		storage.cleanAll();
+	}
+
+	template<unsigned int Size>
+	void timingTestSmallObjects(pool_bench::Report& report)
+	{
+		const int arrSize = 20000;
+
+		std::cout << "*************************************************************\n";
+		std::cout << "timingTestSmallObjects with Size[" << Size << "]\n";
+		std::cout << "*************************************************************\n";
+		report.setSuite("small objects, size " + std::to_string(Size));
+
+		void* arr[arrSize]{ nullptr };
+
+		hbp::HeapStorage& heap = hbp::GetHeapStorage();
+		heap.init(arrSize * Size * 4);
+
+		//objects of a fresh heap are placed one after another, so their span is the memory they take
+		char* lo = nullptr;
+		char* hi = nullptr;
+		for (int i = 0; i < arrSize; i++)
+		{
+			char* ptr = static_cast<char*>(heap.malloc(Size));
+			lo = !lo || ptr < lo ? ptr : lo;
+			hi = !hi || ptr + Size > hi ? ptr + Size : hi;
+			arr[i] = ptr;
+		}
+		std::cout << "HeapStorage bytes per object " << static_cast<double>(hi - lo) / arrSize << "\n";
+		for (int i = 0; i < arrSize; i++)
+		{
+			heap.free(arr[i]);
+		}
+
+		//objects are freed in random order, so free can't just put memory back to the head of a list
+		std::mt19937 rng{ 42 };
+
+		//---------------------------------------------------------------------
+		// HeapStorage malloc-free
+		//---------------------------------------------------------------------
+		report.measure("HeapStorage malloc -> free", arrSize, [&]() {
+			for (int i = 0; i < arrSize; i++)
+			{
+				arr[i] = heap.malloc(Size);
+			}
+
+			std::shuffle(arr, arr + arrSize, rng);
+			for (int i = 0; i < arrSize; i++)
+			{
+				heap.free(arr[i]);
+			}
+		});
+		heap.cleanAll();
+
+		//---------------------------------------------------------------------
+		// std malloc-free
+		//---------------------------------------------------------------------
+		rng.seed(42);
+		report.measure("std malloc -> free", arrSize, [&]() {
+			for (int i = 0; i < arrSize; i++)
+			{
+				arr[i] = std::malloc(Size);
+			}
+
+			std::shuffle(arr, arr + arrSize, rng);
+			for (int i = 0; i < arrSize; i++)
+			{
+				std::free(arr[i]);
+			}
+		});
+	}
+
+	template<unsigned int Size>
+	void timingTestPinnedHandle(pool_bench::Report& report)
+	{
+		using namespace hbp::helpers;
+		typedef pool_utils::A<Size> ValType;
+
+		const int arrSize = 2000;
+
+		std::cout << "*************************************************************\n";
+		std::cout << "timingTestPinnedHandle with Size[" << Size << "]\n";
+		std::cout << "*************************************************************\n";
+		report.setSuite("pinned handles, size " + std::to_string(Size));
+
+		hbp::HeapStorage& heap = hbp::GetHeapStorage();
+		heap.init(arrSize * Size * 4);
+
+		HandleVec<ValType> vec;
+		ValType* rawArr[arrSize]{ nullptr };
+		for (int i = 0; i < arrSize; i++)
+		{
+			vec.push_back(hbp::Handle<ValType>{ GetObjPtr<ValType>(heap) });
+			rawArr[i] = hPtr(vec.back());
+		}
+
+		int j = 0;
+		report.measure("raw pointers loop", arrSize, [&]() {
+			for (int i = 0; i < arrSize; i++)
+			{
+				rawArr[i]->data[0] = j % 255;
+			}
+			j++;
+		});
+
+		report.measure("hRef loop", arrSize, [&]() {
+			for (auto& h : vec)
+			{
+				hRef(h).data[0] = j % 255;
+			}
+			j++;
+		});
+
+		{
+			hbp::PinRange<ValType> pinned{ vec };
+			report.measure("pinned handles loop", arrSize, [&]() {
+				for (ValType* ptr : pinned)
+				{
+					ptr->data[0] = j % 255;
+				}
+				j++;
+			});
+		}
+
+		//pinned objects have to stay in place during compaction
+		HandleVec<ValType> survivors;
+		for (size_t i = 0; i < vec.size(); i++)
+		{
+			if (i % 2)
+				survivors.push_back(std::move(vec[i]));
+		}
+		vec.clear();
+
+		hbp::PinGuard<ValType> guard = survivors.back().pin();
+		ValType* pinnedPtr = guard.get();
+		heap.compact();
+		if (hPtr(survivors.back()) != pinnedPtr)
+			std::cout << "Error, pinned object has been moved by compaction\n";
+		guard.unpin();
+
+		survivors.clear();
+		heap.cleanAll();
+	}
+
+	//HeapStorage::malloc sometimes compacts or grows the heap, these calls make the tail of its latency
+	void latencyTestHeapStorage()
+	{
+		const int opsNumber = 100000;
+		const size_t liveNumber = 500;
+
+		std::cout << "*************************************************************\n";
+		std::cout << "latencyTestHeapStorage\n";
+		std::cout << "*************************************************************\n";
+
+		hbp::HeapStorage& heap = hbp::GetHeapStorage();
+		heap.init(64 * 1024);
+		pool_latency::reset();
+
+		std::mt19937 rng{ 42 };
+		std::vector<void*> live;
+		for (int i = 0; i < opsNumber; i++)
+		{
+			if (live.empty() || (live.size() < liveNumber && rng() % 2))
+			{
+				live.push_back(heap.malloc(300 + rng() % 3000));
+			}
+			else
+			{
+				const size_t idx = rng() % live.size();
+				heap.free(live[idx]);
+				live[idx] = live.back();
+				live.pop_back();
+			}
+		}
+
+		for (void* ptr : live)
+		{
+			heap.free(ptr);
+		}
+		printHeapStats("HeapStorage", heap.stats());
+		printLatency();
+		heap.cleanAll();
+	}
+
+	//single producer single consumer ring of pointers
+	class PointerQueue
+	{
+	public:
+		explicit PointerQueue(const size_t capacityLog2)
+			: m_items(size_t(1) << capacityLog2, nullptr)
+			, m_mask((size_t(1) << capacityLog2) - 1)
+			, m_head{ 0 }
+			, m_tail{ 0 }
+		{
+		}
+
+		bool push(void* ptr)
+		{
+			const size_t tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+				return false;
+			m_items[tail & m_mask] = ptr;
+			m_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		void* pop()
+		{
+			const size_t head = m_head.load(std::memory_order_relaxed);
+			if (head == m_tail.load(std::memory_order_acquire))
+				return nullptr;
+			void* ptr = m_items[head & m_mask];
+			m_head.store(head + 1, std::memory_order_release);
+			return ptr;
+		}
+
+	private:
+		std::vector<void*>	m_items;
+		const size_t		m_mask;
+		//consumer and producer don't share cache line of their indices
+		alignas(64) std::atomic<size_t> m_head;
+		alignas(64) std::atomic<size_t> m_tail;
+	};
+
+	//threads wait until all of them come, the barrier can be reused
+	class SpinBarrier
+	{
+	public:
+		explicit SpinBarrier(const size_t threadsNumber)
+			: m_threadsNumber{ threadsNumber }
+			, m_arrived{ 0 }
+			, m_generation{ 0 }
+		{
+		}
+
+		void wait()
+		{
+			const size_t generation = m_generation.load(std::memory_order_acquire);
+			if (m_arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == m_threadsNumber)
+			{
+				m_arrived.store(0, std::memory_order_relaxed);
+				m_generation.fetch_add(1, std::memory_order_release);
+				return;
+			}
+			while (m_generation.load(std::memory_order_acquire) == generation)
+			{
+				std::this_thread::yield();
+			}
+		}
+
+	private:
+		const size_t		m_threadsNumber;
+		std::atomic<size_t>	m_arrived;
+		std::atomic<size_t>	m_generation;
+	};
+
+	enum class ScalingPattern
+	{
+		//every thread allocates and frees its own objects
+		THREAD_LOCAL_CHURN,
+		//half of threads allocate, their pairs free
+		PRODUCER_CONSUMER,
+		//threads allocate batches and free batches of the neighbour
+		CROSS_THREAD_FREE,
+	};
+
+	/*
+	runs the pattern on threadsNumber threads, every thread makes opsPerThread mallocs and frees together.
+	Sizes are taken from the table in turn, so random numbers aren't generated while measuring
+	*/
+	template <typename Malloc, typename Free>
+	void runScalingPattern(const ScalingPattern pattern, const size_t threadsNumber, const size_t opsPerThread,
+		const std::vector<size_t>& sizes, Malloc mallocFunc, Free freeFunc)
+	{
+		const size_t sizesMask = sizes.size() - 1;
+		const size_t liveNumber = 64;
+		const size_t batchSize = 256;
+
+		std::vector<std::unique_ptr<PointerQueue>> queues;
+		std::vector<std::vector<void*>> batches;
+		SpinBarrier barrier{ threadsNumber };
+		std::vector<std::thread> threads;
+
+		switch (pattern)
+		{
+		case ScalingPattern::THREAD_LOCAL_CHURN:
+			for (size_t t = 0; t < threadsNumber; t++)
+			{
+				threads.emplace_back([&, t]() {
+					void* live[liveNumber] = {};
+					for (size_t i = 0; i < opsPerThread / 2; i++)
+					{
+						void*& slot = live[i % liveNumber];
+						if (slot)
+							freeFunc(slot);
+						slot = mallocFunc(sizes[(i + t * 131) & sizesMask]);
+					}
+					for (void* ptr : live)
+					{
+						if (ptr)
+							freeFunc(ptr);
+					}
+				});
+			}
+			break;
+
+		case ScalingPattern::PRODUCER_CONSUMER:
+			for (size_t p = 0; p < threadsNumber / 2; p++)
+			{
+				queues.emplace_back(new PointerQueue(10));
+			}
+			for (size_t p = 0; p < threadsNumber / 2; p++)
+			{
+				PointerQueue& queue = *queues[p];
+				threads.emplace_back([&, p]() {
+					for (size_t i = 0; i < opsPerThread; i++)
+					{
+						void* ptr = mallocFunc(sizes[(i + p * 131) & sizesMask]);
+						while (!queue.push(ptr))
+						{
+							std::this_thread::yield();
+						}
+					}
+				});
+				threads.emplace_back([&]() {
+					for (size_t i = 0; i < opsPerThread; i++)
+					{
+						void* ptr = queue.pop();
+						while (!ptr)
+						{
+							std::this_thread::yield();
+							ptr = queue.pop();
+						}
+						freeFunc(ptr);
+					}
+				});
+			}
+			break;
+
+		case ScalingPattern::CROSS_THREAD_FREE:
+			batches.assign(threadsNumber, std::vector<void*>(batchSize, nullptr));
+			for (size_t t = 0; t < threadsNumber; t++)
+			{
+				threads.emplace_back([&, t]() {
+					std::vector<void*>& own = batches[t];
+					const std::vector<void*>& neighbour = batches[(t + 1) % threadsNumber];
+					for (size_t round = 0; round < opsPerThread / (2 * batchSize); round++)
+					{
+						for (size_t i = 0; i < batchSize; i++)
+						{
+							own[i] = mallocFunc(sizes[(round * batchSize + i + t * 131) & sizesMask]);
+						}
+						barrier.wait();
+						for (void* ptr : neighbour)
+						{
+							freeFunc(ptr);
+						}
+						barrier.wait();
+					}
+				});
+			}
+			break;
+		}
+
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+	}
+
+	/*
+	throughput of thread safe modes of ConcurrentHeapStorage and system malloc from 1 thread to the number
+	of hardware threads. AlignedPool and StackBasedPool aren't thread safe, so they aren't measured.
+	Ops per thread are mallocs and frees a thread makes per second, start of threads is included into samples.
+	Contention is the part of arena locks which had to wait for another thread
+	*/
+	void scalingTest(pool_bench::Report& report)
+	{
+		const size_t opsPerThread = 32 * 1024;
+		const pool_bench::Config config{ 1, 10 };
+
+		std::cout << "*************************************************************\n";
+		std::cout << "scalingTest\n";
+		std::cout << "*************************************************************\n";
+
+		//mostly small objects of slab pages and some blocks
+		std::mt19937 rng{ 42 };
+		std::vector<size_t> sizes(1024);
+		for (size_t& size : sizes)
+		{
+			size = rng() % 8 ? 8 + rng() % 120 : 128 + rng() % 896;
+		}
+
+		const size_t maxThreads = std::max<size_t>(2, std::thread::hardware_concurrency());
+		std::vector<size_t> threadsNumbers;
+		for (size_t n = 1; n < maxThreads; n *= 2)
+		{
+			threadsNumbers.push_back(n);
+		}
+		threadsNumbers.push_back(maxThreads);
+
+		enum class Mode { SHARED_ARENA, ARENA_PER_THREAD, ARENA_PER_THREAD_WITH_COMPACTOR, SYSTEM_MALLOC };
+		const Mode modes[] = { Mode::SHARED_ARENA, Mode::ARENA_PER_THREAD, Mode::ARENA_PER_THREAD_WITH_COMPACTOR, Mode::SYSTEM_MALLOC };
+		const char* modeNames[] = { "ConcurrentHeapStorage, shared arena", "ConcurrentHeapStorage, arena per thread",
+			"ConcurrentHeapStorage, arena per thread, compactor", "system malloc" };
+		const ScalingPattern patterns[] = { ScalingPattern::THREAD_LOCAL_CHURN, ScalingPattern::PRODUCER_CONSUMER, ScalingPattern::CROSS_THREAD_FREE };
+		const char* patternNames[] = { "thread local churn", "producer/consumer", "cross thread free" };
+
+		hbp::ConcurrentHeapStorage& heap = hbp::GetConcurrentHeapStorage();
+
+		for (size_t m = 0; m < 4; m++)
+		{
+			const Mode mode = modes[m];
+			report.setSuite(std::string("Scaling, ") + modeNames[m]);
+			std::cout << modeNames[m] << "\n";
+
+			for (const size_t threadsNumber : threadsNumbers)
+			{
+				if (mode != Mode::SYSTEM_MALLOC)
+				{
+					heap.init(1024 * 1024, mode == Mode::SHARED_ARENA ? 1 : threadsNumber);
+					if (mode == Mode::ARENA_PER_THREAD_WITH_COMPACTOR)
+						heap.startCompactor(0.3f, 16 * 1024, 200);
+				}
+
+				for (size_t p = 0; p < 3; p++)
+				{
+					//producers need pairs
+					if (patterns[p] == ScalingPattern::PRODUCER_CONSUMER && threadsNumber < 2)
+						continue;
+					const size_t workers = patterns[p] == ScalingPattern::PRODUCER_CONSUMER ? threadsNumber / 2 * 2 : threadsNumber;
+					const std::string name = std::string(patternNames[p]) + ", threads " + std::to_string(workers);
+
+					const hbp::ContentionStats before = mode != Mode::SYSTEM_MALLOC ? heap.contention() : hbp::ContentionStats{};
+					const pool_bench::Result& res = mode == Mode::SYSTEM_MALLOC
+						? report.measure(name.c_str(), workers * opsPerThread, config, [&]() {
+							runScalingPattern(patterns[p], workers, opsPerThread, sizes,
+								[](const size_t size) { return std::malloc(size); },
+								[](void* ptr) { std::free(ptr); });
+						})
+						: report.measure(name.c_str(), workers * opsPerThread, config, [&]() {
+							runScalingPattern(patterns[p], workers, opsPerThread, sizes,
+								[&heap](const size_t size) { return heap.malloc(size); },
+								[&heap](void* ptr) { heap.free(ptr); });
+						});
+
+					std::cout << "    per thread[" << std::fixed << std::setprecision(2) << 1e3 / (res.medianNs * workers) << " Mops/s]";
+					if (mode != Mode::SYSTEM_MALLOC)
+					{
+						const hbp::ContentionStats after = heap.contention();
+						const size_t locks = after.locks - before.locks;
+						std::cout << " contended locks[" << (locks ? 100.0 * (after.contendedLocks - before.contendedLocks) / locks : 0.0) << "%]"
+							<< " remote frees[" << after.remoteFrees - before.remoteFrees << "]"
+							<< " compactor skips[" << after.compactorSkips - before.compactorSkips << "]";
+					}
+					std::cout << "\n";
+					std::cout.unsetf(std::ios_base::floatfield);
+				}
+
+				if (mode != Mode::SYSTEM_MALLOC)
+					heap.cleanAll();
+			}
+		}
+	}
+
+#endif //PROJ_HEAP_BASED_POOL
+
+	struct TraceReplayResult
+	{
+		double		seconds;
+		size_t		failed;
+		//results without natural alignment of the request
+		size_t		misaligned;
+		size_t		peakLiveBytes;
+		//growth of resident memory of the process, memory kept from previous replays isn't counted again
+		size_t		peakRssGrowth;
+		//distance between the lowest and the highest byte ever allocated
+		size_t		footprint;
+		//negative - target doesn't measure it
+		float		peakFragmentation;
+	};
+
+	//target of replayTrace, other targets have the same members, soakTest additionally needs largestFreeBlock()
+	struct SystemMallocTarget
+	{
+		const char*	name() const { return "system malloc"; }
+		void*		malloc(const size_t size) { return std::malloc(size); }
+		void		free(void* ptr, const size_t) { std::free(ptr); }
+		float		fragmentation(const size_t) const { return -1.0f; }
+		//0 - unknown
+		size_t		largestFreeBlock() const { return 0; }
+	};
+
+#if defined(PROJ_ALIGNED_POOL)
+	//bigger requests than the biggest pool of setupPoolManager take several blocks, as AlignedPoolAllocator does with arrays
+	struct AlignedPoolManagerTarget
+	{
+		static constexpr size_t s_maxBlockSize = 512;
+
+		const char*	name() const { return "AlignedPoolManager"; }
+		void*		malloc(const size_t size)
+		{
+			return size <= s_maxBlockSize
+				? align_pool::GetAlignedPoolManager().malloc(size)
+				: align_pool::GetAlignedPoolManager().malloc_n(s_maxBlockSize, (size + s_maxBlockSize - 1) / s_maxBlockSize);
+		}
+		void		free(void* ptr, const size_t size)
+		{
+			if (size <= s_maxBlockSize)
+				align_pool::GetAlignedPoolManager().free(ptr);
+			else
+				align_pool::GetAlignedPoolManager().free_n(ptr, (size + s_maxBlockSize - 1) / s_maxBlockSize);
+		}
+		//internal fragmentation, part of used blocks which isn't requested
+		float		fragmentation(const size_t liveBytes) const
+		{
+			const size_t bytesInUse = align_pool::GetAlignedPoolManager().stats().pools.bytesInUse;
+			return bytesInUse ? 1.0f - static_cast<float>(liveBytes) / bytesInUse : 0.0f;
+		}
+		size_t		largestFreeBlock() const { return align_pool::GetAlignedPoolManager().largestFreeBlock(); }
+	};
+
+#elif defined(PROJ_STACK_BASED_POOL)
+	struct StackBasedPoolTarget
+	{
+		explicit	StackBasedPoolTarget(const size_t size) : pool{ size } {}
+
+		const char*	name() const { return "StackBasedPool"; }
+		void*		malloc(const size_t size) { return pool.malloc(size); }
+		void		free(void* ptr, const size_t) { pool.free(ptr); }
+		//stack has no holes
+		float		fragmentation(const size_t) const { return 0.0f; }
+
+		sbp::StackBasedPool pool;
+	};
+
+#elif defined(PROJ_HEAP_BASED_POOL)
+	struct HeapStorageTarget
+	{
+		const char*	name() const { return "HeapStorage"; }
+		void*		malloc(const size_t size) { return hbp::GetHeapStorage().malloc(size); }
+		void		free(void* ptr, const size_t) { hbp::GetHeapStorage().free(ptr); }
+		float		fragmentation(const size_t) const { return hbp::GetHeapStorage().getFragmentation(); }
+		size_t		largestFreeBlock() const { return hbp::GetHeapStorage().getFreeSpace().largestHole; }
+	};
+#endif//PROJ_HEAP_BASED_POOL
+
+	/*
+	replays requests in the recorded order, memory is sampled every sampleRate requests(0 - never) and the sampling
+	is included into the time. Objects which are live at the end are freed in reverse order of allocation.
+	Table of objects is taken from calloc, as StackBasedPool replaces operator new with a small stack
+	*/
+	template <typename Target>
+	TraceReplayResult replayTrace(Target& target, const pool_replay::Trace& trace, const size_t sampleRate)
+	{
+		TraceReplayResult res{ 0.0, 0, 0, 0, 0, 0, -1.0f };
+		void** objects = static_cast<void**>(std::calloc(trace.objectsNumber() + 1, sizeof(void*)));
+		if (!objects)
+		{
+			std::cout << "Not enough memory for [" << trace.objectsNumber() << "] objects of the trace\n";
+			return res;
+		}
+		//pages of the table are touched before the baseline of resident memory is taken
+		for (size_t i = 0; i < trace.objectsNumber(); i += 512)
+		{
+			static_cast<void* volatile*>(objects)[i] = nullptr;
+		}
+		const size_t baseRss = pool_replay::currentRss();
+		size_t peakRss = baseRss;
+		size_t liveBytes = 0;
+		size_t count = 0;
+		char* lo = nullptr;
+		char* hi = nullptr;
+		Timer t;
+
+		for (const pool_replay::Request& r : trace)
+		{
+			if (r.op == pool_replay::Op::ALLOC)
+			{
+				void* ptr = target.malloc(r.size);
+				if (ptr)
+				{
+					objects[r.id] = ptr;
+					liveBytes += r.size;
+					res.peakLiveBytes = std::max(res.peakLiveBytes, liveBytes);
+					if (reinterpret_cast<uintptr_t>(ptr) & ((uintptr_t(1) << r.alignLog2) - 1))
+						res.misaligned++;
+					char* bytes = static_cast<char*>(ptr);
+					lo = !lo || bytes < lo ? bytes : lo;
+					hi = !hi || bytes + r.size > hi ? bytes + r.size : hi;
+				}
+				else
+				{
+					res.failed++;
+				}
+			}
+			else if (objects[r.id])
+			{
+				target.free(objects[r.id], r.size);
+				objects[r.id] = nullptr;
+				liveBytes -= r.size;
+			}
+
+			if (sampleRate && ++count % sampleRate == 0)
+			{
+				peakRss = std::max(peakRss, pool_replay::currentRss());
+				res.peakFragmentation = std::max(res.peakFragmentation, target.fragmentation(liveBytes));
+			}
+		}
+		res.seconds = t.getDelt();
+		res.peakRssGrowth = peakRss - baseRss;
+		res.footprint = hi - lo;
+
+		for (const pool_replay::Request* r = trace.end(); r != trace.begin(); )
+		{
+			r--;
+			if (r->op == pool_replay::Op::ALLOC && objects[r->id])
+			{
+				target.free(objects[r->id], r->size);
+				objects[r->id] = nullptr;
+			}
+		}
+		std::free(objects);
+		return res;
+	}
+
+	template <typename Target>
+	void printTraceReplay(Target& target, const pool_replay::Trace& trace)
+	{
+		const TraceReplayResult res = replayTrace(target, trace, 4096);
+		std::cout << std::left << std::setw(20) << target.name() << std::right
+			<< " throughput[" << std::setw(8) << std::fixed << std::setprecision(2) << trace.size() / res.seconds / 1e6 << " Mops/s]"
+			<< " peak live[" << res.peakLiveBytes << " B]"
+			<< " peak RSS growth[" << res.peakRssGrowth << " B]";
+		if (res.peakFragmentation >= 0.0f)
+			std::cout << " peak fragmentation[" << res.peakFragmentation << "]";
+		else
+			std::cout << " peak fragmentation[n/a]";
+		std::cout << " failed[" << res.failed << "] misaligned[" << res.misaligned << "]\n";
+		std::cout.unsetf(std::ios_base::floatfield);
+	}
+
+	//memory for live objects of the trace at its peak, pools which can't grow are created with it
+	void traceLiveBounds(const pool_replay::Trace& trace, size_t& peakLiveBytes, size_t& peakLiveObjects)
+	{
+		size_t liveBytes = 0;
+		size_t liveObjects = 0;
+		peakLiveBytes = 0;
+		peakLiveObjects = 0;
+		for (const pool_replay::Request& r : trace)
+		{
+			const bool alloc = r.op == pool_replay::Op::ALLOC;
+			liveBytes = alloc ? liveBytes + r.size : liveBytes - r.size;
+			liveObjects = alloc ? liveObjects + 1 : liveObjects - 1;
+			peakLiveBytes = std::max(peakLiveBytes, liveBytes);
+			peakLiveObjects = std::max(peakLiveObjects, liveObjects);
+		}
+	}
+
+#if defined(PROJ_HEAP_BASED_POOL)
+	//raw pointers don't survive growth of the heap by copying, so the heap is big enough for the trace from the start
+	size_t heapSizeForTrace(const pool_replay::Trace& trace)
+	{
+		size_t peakLiveBytes = 0;
+		size_t peakLiveObjects = 0;
+		traceLiveBounds(trace, peakLiveBytes, peakLiveObjects);
+		return std::max<size_t>(4 * (peakLiveBytes + peakLiveObjects * 64), 1024 * 1024);
+	}
+
+	//allocations and frees of objects with random size and lifetime, bigger than small objects of HeapStorage
+	void makeAllocationTrace(pool_replay::Trace& trace, const size_t opsNumber, const size_t liveNumber, const unsigned seed)
+	{
+		std::mt19937 rng{ seed };
+		std::vector<pool_replay::Request> requests;
+		std::vector<pool_replay::Request> live;
+		uint32_t nextId = 0;
+
+		requests.reserve(opsNumber);
+		while (requests.size() < opsNumber)
+		{
+			if (live.empty() || (live.size() < liveNumber && rng() % 2))
+			{
+				//mostly medium objects and some big ones, alignment isn't checked
+				const size_t size = rng() % 5 ? 300 + rng() % 700 : 1000 + rng() % 15000;
+				live.push_back(pool_replay::Request{ size, nextId++, 0, 0, pool_replay::Op::ALLOC });
+				requests.push_back(live.back());
+			}
+			else
+			{
+				const size_t idx = rng() % live.size();
+				requests.push_back(live[idx]);
+				requests.back().op = pool_replay::Op::FREE;
+				live[idx] = live.back();
+				live.pop_back();
+			}
+		}
+		trace.assign(requests.data(), requests.size());
+	}
+
+	//every placement policy of HeapStorage replays the same trace
+	void timingTestPlacementPolicy(const pool_replay::Trace& trace, const size_t heapSize)
+	{
+		const hbp::PlacementPolicy policies[] = { hbp::PlacementPolicy::FIRST_FIT, hbp::PlacementPolicy::NEXT_FIT,
+			hbp::PlacementPolicy::BEST_FIT, hbp::PlacementPolicy::GOOD_FIT };
+		const char* names[] = { "first fit", "next fit", "best fit", "good fit" };
+
+		hbp::HeapStorage& heap = hbp::GetHeapStorage();
+		HeapStorageTarget target;
+
+		for (size_t p = 0; p < 4; p++)
+		{
+			heap.init(heapSize);
+			heap.setPlacementPolicy(policies[p]);
+			if (heap.getPlacementPolicy() != policies[p])
+			{
+				std::cout << names[p] << " isn't supported by the storage engine\n";
+				heap.cleanAll();
+				continue;
+			}
+
+			//sampling isn't included into the time of the first replay
+			const double time = replayTrace(target, trace, 0).seconds;
+			const TraceReplayResult res = replayTrace(target, trace, 1000);
+
+			std::cout << names[p] << ": replay time " << time
+				<< ", peak fragmentation " << res.peakFragmentation
+				<< ", footprint / peak live bytes " << static_cast<double>(res.footprint) / res.peakLiveBytes
+				<< ", failed " << res.failed << "\n";
+			heap.cleanAll();
+		}
+	}
+
+	void timingTestPlacementPolicy()
+	{
+		std::cout << "*************************************************************\n";
+		std::cout << "timingTestPlacementPolicy\n";
+		std::cout << "*************************************************************\n";
+
+		pool_replay::Trace trace;
+		makeAllocationTrace(trace, 200000, 2000, 42);
+		timingTestPlacementPolicy(trace, 16 * 1024 * 1024);
+	}
+#endif//PROJ_HEAP_BASED_POOL
+
+	/*
+	"--replay-trace <file>" replays the recorded trace on the pool of the project and on system malloc,
+	HeapStorage replays it with every placement policy too. Returns false if there is no such argument
+	*/
+	bool replayTraceArgument(int argc, char** argv)
+	{
+		const char* path = nullptr;
+		for (int i = 1; i + 1 < argc; i++) {
+			if (std::strcmp(argv[i], "--replay-trace") == 0)
+				path = argv[i + 1];
+		}
+		if (!path)
+			return false;
+
+		pool_replay::Trace trace;
+		if (!trace.load(path))
+			return true;
+
+		//bounds of live memory for pools which can't grow
+		size_t peakLiveBytes = 0;
+		size_t peakLiveObjects = 0;
+		traceLiveBounds(trace, peakLiveBytes, peakLiveObjects);
+
+		std::cout << "*************************************************************\n";
+		std::cout << "replay of " << path << ": [" << trace.size() << "] requests of [" << trace.objectsNumber() << "] objects\n";
+		std::cout << "*************************************************************\n";
+
+#if defined(PROJ_ALIGNED_POOL)
+		AlignedPoolManagerTarget pool;
+		printTraceReplay(pool, trace);
+#elif defined(PROJ_STACK_BASED_POOL)
+		if (trace.isLifo())
+		{
+			StackBasedPoolTarget pool{ peakLiveBytes + peakLiveObjects * sizeof(void*) + 1 };
+			printTraceReplay(pool, trace);
+		}
+		else
+		{
+			std::cout << "frees of the trace aren't in reverse order of allocations, it can't be replayed on StackBasedPool\n";
+		}
+#elif defined(PROJ_HEAP_BASED_POOL)
+		hbp::GetHeapStorage().init(heapSizeForTrace(trace));
+		HeapStorageTarget pool;
+		printTraceReplay(pool, trace);
+		hbp::GetHeapStorage().cleanAll();
+		timingTestPlacementPolicy(trace, heapSizeForTrace(trace));
+#endif
+		SystemMallocTarget system;
+		printTraceReplay(system, trace);
+		return true;
+	}
+
+	struct SoakSample
+	{
+		double		seconds;
+		size_t		ops;
+		size_t		failed;
+		size_t		liveBytes;
+		size_t		rss;
+		size_t		largestFreeBlock;
+		float		fragmentation;
+		//latency of malloc during the sample
+		double		mallocP50Ns;
+		double		mallocP99Ns;
+		double		mallocMaxNs;
+	};
+
+	/*
+	long run of allocations with sizes spread evenly over powers of two below 2^maxSizeLog2 and three kinds of lifetime:
+	short(up to 200 allocations), medium(up to 20k) and long(up to 200k), so long living objects leave holes
+	which build up over time. The run is split into samplesNumber samples of equal time, the same seed gives
+	the same sequence of requests on every target
+	*/
+	template <typename Target>
+	std::vector<SoakSample> soakTest(Target& target, const double seconds, const size_t samplesNumber, const size_t maxSizeLog2)
+	{
+		struct Object
+		{
+			size_t		expiry;
+			void*		ptr;
+			size_t		size;
+		};
+		auto later = [](const Object& l, const Object& r) { return l.expiry > r.expiry; };
+		std::priority_queue<Object, std::vector<Object>, decltype(later)> live(later);
+
+		std::mt19937 rng{ 42 };
+		std::vector<double> latencies;
+		latencies.reserve(1 << 20);
+		std::vector<SoakSample> samples;
+		size_t op = 0;
+		size_t failed = 0;
+		size_t liveBytes = 0;
+
+		std::cout << "soak of " << target.name() << " for " << seconds << " s\n";
+		const int64_t start = pool_bench::nowNs();
+		for (size_t s = 1; s <= samplesNumber; s++)
+		{
+			const int64_t end = start + static_cast<int64_t>(seconds * 1e9 * s / samplesNumber);
+			latencies.clear();
+
+			//clock is read every 256 operations
+			while ((op & 255) != 0 || pool_bench::nowNs() < end)
+			{
+				op++;
+				while (!live.empty() && live.top().expiry <= op)
+				{
+					target.free(live.top().ptr, live.top().size);
+					liveBytes -= live.top().size;
+					live.pop();
+				}
+
+				const size_t log2 = 3 + rng() % (maxSizeLog2 - 3);
+				const size_t size = (size_t(1) << log2) + rng() % (size_t(1) << log2);
+				const unsigned kind = rng() % 100;
+				const size_t lifetime = kind < 70 ? 1 + rng() % 200 : kind < 95 ? 1 + rng() % 20000 : 1 + rng() % 200000;
+
+				const int64_t mallocStart = pool_bench::nowNs();
+				void* ptr = target.malloc(size);
+				if (latencies.size() < latencies.capacity())
+					latencies.push_back(static_cast<double>(pool_bench::nowNs() - mallocStart));
+
+				if (!ptr)
+				{
+					failed++;
+					continue;
+				}
+				live.push(Object{ op + lifetime, ptr, size });
+				liveBytes += size;
+			}
+
+			std::sort(latencies.begin(), latencies.end());
+			const SoakSample sample{ (pool_bench::nowNs() - start) / 1e9, op, failed, liveBytes,
+				pool_replay::currentRss(), target.largestFreeBlock(), target.fragmentation(liveBytes),
+				pool_bench::percentile(latencies, 0.5), pool_bench::percentile(latencies, 0.99),
+				latencies.empty() ? 0.0 : latencies.back() };
+			samples.push_back(sample);
+
+			std::cout << "[" << std::fixed << std::setprecision(1) << std::setw(7) << sample.seconds << " s]"
+				<< " ops[" << sample.ops << "] failed[" << sample.failed << "]"
+				<< " live[" << sample.liveBytes << " B] RSS[" << sample.rss << " B]";
+			if (sample.largestFreeBlock)
+				std::cout << " largest free block[" << sample.largestFreeBlock << " B]";
+			if (sample.fragmentation >= 0.0f)
+				std::cout << std::setprecision(3) << " fragmentation[" << sample.fragmentation << "]";
+			std::cout << std::setprecision(0) << " malloc p50[" << sample.mallocP50Ns << " ns] p99[" << sample.mallocP99Ns
+				<< " ns] max[" << sample.mallocMaxNs << " ns]\n";
+			std::cout.unsetf(std::ios_base::floatfield);
+		}
+
+		while (!live.empty())
+		{
+			target.free(live.top().ptr, live.top().size);
+			live.pop();
+		}
+		return samples;
+	}
+
+	//largest free block 0 and negative fragmentation - target doesn't measure them
+	void writeSoakSamples(std::ostream& file, const char* target, const std::vector<SoakSample>& samples)
+	{
+		file << std::fixed << std::setprecision(3);
+		for (const SoakSample& s : samples)
+		{
+			file << "\"" << target << "\"," << s.seconds << "," << s.ops << "," << s.failed << "," << s.liveBytes << ","
+				<< s.rss << "," << s.largestFreeBlock << "," << s.fragmentation << ","
+				<< s.mallocP50Ns << "," << s.mallocP99Ns << "," << s.mallocMaxNs << "\n";
+		}
+	}
+
+	/*
+	"--soak <seconds>" runs soakTest on the pool of the project and on system malloc for the given time each,
+	samples are written into pool_soak.csv. Returns false if there is no such argument
+	*/
+	bool soakTestArgument(int argc, char** argv)
+	{
+		double seconds = 0.0;
+		for (int i = 1; i + 1 < argc; i++) {
+			if (std::strcmp(argv[i], "--soak") == 0)
+				seconds = std::strtod(argv[i + 1], nullptr);
+		}
+		if (seconds <= 0.0)
+			return false;
+
+		const size_t samplesNumber = 30;
+		const char* path = "pool_soak.csv";
+		std::ofstream file(path);
+		if (!file)
+		{
+			std::cout << "Can't open soak output file[" << path << "]\n";
+			return true;
+		}
+		file << "target,seconds,ops,failed,live_bytes,rss,largest_free_block,fragmentation,malloc_p50_ns,malloc_p99_ns,malloc_max_ns\n";
+
+		std::cout << "*************************************************************\n";
+		std::cout << "soakTest\n";
+		std::cout << "*************************************************************\n";
+
+#if defined(PROJ_ALIGNED_POOL)
+		//the biggest pool takes up to 8 blocks
+		AlignedPoolManagerTarget pool;
+		writeSoakSamples(file, pool.name(), soakTest(pool, seconds, samplesNumber, 12));
+		SystemMallocTarget system;
+		writeSoakSamples(file, system.name(), soakTest(system, seconds, samplesNumber, 12));
+#elif defined(PROJ_HEAP_BASED_POOL)
+		hbp::GetHeapStorage().init(16 * 1024 * 1024);
+		HeapStorageTarget pool;
+		writeSoakSamples(file, pool.name(), soakTest(pool, seconds, samplesNumber, 12));
+		printHeapStats("HeapStorage", hbp::GetHeapStorage().stats());
+		hbp::GetHeapStorage().cleanAll();
+		SystemMallocTarget system;
+		writeSoakSamples(file, system.name(), soakTest(system, seconds, samplesNumber, 12));
+#endif
+		std::cout << "soak samples are written into " << path << "\n";
+		return true;
+	}
 
 }//pool_utils
 